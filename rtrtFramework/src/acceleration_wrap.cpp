@@ -1,18 +1,103 @@
 
 #include "acceleration_wrap.h"
 #include "vkapp.h"
+#include "texcompress.h"
+#include "fileio.h"
+#include <chrono>
+#include <cstring>
+#include <filesystem>
 #include <numeric>
 
 //--------------------------------------------------------------------------------------------------
 // Initializing the allocator and querying the raytracing properties
 //
 
-void RaytracingBuilderKHR::setup(VkApp* _VK, const VkDevice& device, uint32_t queueIndex)
+void RaytracingBuilderKHR::setup(VkApp* _VK, const VkDevice& device, uint32_t queueIndex, VkQueue buildQueue)
 {
     VK = _VK;
     //printf("RaytracingBuilderKHR::setup (3)\n");
     m_device     = device;
     m_queueIndex = queueIndex;
+    m_buildQueue = buildQueue;
+
+    // The builder's own pool: builds may be recorded on a worker thread.
+    VkCommandPoolCreateInfo poolInfo{VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO};
+    poolInfo.flags            = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+    poolInfo.queueFamilyIndex = queueIndex;
+    vkCreateCommandPool(m_device, &poolInfo, nullptr, &m_buildPool);
+
+    VkQueryPoolCreateInfo qpci{VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO};
+    qpci.queryCount = 2;
+    qpci.queryType  = VK_QUERY_TYPE_TIMESTAMP;
+    vkCreateQueryPool(m_device, &qpci, nullptr, &m_tlasTimestamps);
+
+    VkPhysicalDeviceAccelerationStructurePropertiesKHR asProperties
+        {VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_PROPERTIES_KHR};
+    VkPhysicalDeviceProperties2 properties{VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2, &asProperties};
+    vkGetPhysicalDeviceProperties2(VK->m_physicalDevice, &properties);
+    m_scratchAlignment = std::max<VkDeviceSize>(asProperties.minAccelerationStructureScratchOffsetAlignment, 1);
+    m_unifiedMemory = properties.properties.deviceType == VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU
+        || properties.properties.deviceType == VK_PHYSICAL_DEVICE_TYPE_CPU;
+}
+
+//--------------------------------------------------------------------------------------------------
+// A command buffer of the builder's pool, begun.  Submit it to the
+// build queue without waiting with submitNoWait, after which finish
+// waits for and frees it, and poll frees it if it is done.
+//
+VkCommandBuffer RaytracingBuilderKHR::createCmdBuffer()
+{
+    VkCommandBufferAllocateInfo allocateInfo{VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO};
+    allocateInfo.commandBufferCount = 1;
+    allocateInfo.commandPool        = m_buildPool;
+    allocateInfo.level              = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    VkCommandBuffer cmdBuf;
+    vkAllocateCommandBuffers(m_device, &allocateInfo, &cmdBuf);
+
+    VkCommandBufferBeginInfo beginInfo{VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO};
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    vkBeginCommandBuffer(cmdBuf, &beginInfo);
+    return cmdBuf;
+}
+
+RaytracingBuilderKHR::PendingSubmit RaytracingBuilderKHR::submitNoWait(VkCommandBuffer cmdBuf, VkSemaphore signal)
+{
+    vkEndCommandBuffer(cmdBuf);
+    PendingSubmit pending{cmdBuf, VK_NULL_HANDLE};
+    VkFenceCreateInfo fenceInfo{VK_STRUCTURE_TYPE_FENCE_CREATE_INFO};
+    vkCreateFence(m_device, &fenceInfo, nullptr, &pending.fence);
+
+    VkSubmitInfo submitInfo{VK_STRUCTURE_TYPE_SUBMIT_INFO};
+    submitInfo.commandBufferCount   = 1;
+    submitInfo.pCommandBuffers      = &cmdBuf;
+    submitInfo.signalSemaphoreCount = signal ? 1 : 0;
+    submitInfo.pSignalSemaphores    = &signal;
+    vkQueueSubmit(m_buildQueue, 1, &submitInfo, pending.fence);
+    return pending;
+}
+
+void RaytracingBuilderKHR::finish(PendingSubmit& pending)
+{
+    if (pending.cmdBuf == VK_NULL_HANDLE)
+        return;
+    vkWaitForFences(m_device, 1, &pending.fence, VK_TRUE, UINT64_MAX);
+    vkDestroyFence(m_device, pending.fence, nullptr);
+    vkFreeCommandBuffers(m_device, m_buildPool, 1, &pending.cmdBuf);
+    pending = PendingSubmit{};
+}
+
+bool RaytracingBuilderKHR::poll(PendingSubmit& pending)
+{
+    if (pending.cmdBuf != VK_NULL_HANDLE && vkGetFenceStatus(m_device, pending.fence) != VK_SUCCESS)
+        return false;
+    finish(pending);
+    return true;
+}
+
+void RaytracingBuilderKHR::submitAndWait(VkCommandBuffer cmdBuf)
+{
+    PendingSubmit pending = submitNoWait(cmdBuf);
+    finish(pending);
 }
 
 //--------------------------------------------------------------------------------------------------
@@ -27,6 +112,14 @@ void RaytracingBuilderKHR::destroy()
     
     m_tlas.bw.destroy(VK->m_device);
     vkDestroyAccelerationStructureKHR(VK->m_device, m_tlas.accel, nullptr);
+    m_tlasBack.bw.destroy(VK->m_device);
+    vkDestroyAccelerationStructureKHR(VK->m_device, m_tlasBack.accel, nullptr);
+    m_tlasScratch.destroy(VK->m_device);
+    m_updateScratch.destroy(VK->m_device);
+    m_instanceBuffer.destroy(VK->m_device);
+    vkDestroyQueryPool(VK->m_device, m_tlasTimestamps, nullptr);
+    vkDestroyCommandPool(VK->m_device, m_buildPool, nullptr);
+    m_hostPool.reset();
 
     m_blas.clear();
 }
@@ -47,6 +140,8 @@ VkDeviceAddress RaytracingBuilderKHR::getBlasDeviceAddress(uint32_t blasId)
 {
     //printf("RaytracingBuilderKHR::getBlasDeviceAddress (4)\n");
     assert(size_t(blasId) < m_blas.size());
+    if (m_blas[blasId].accel == VK_NULL_HANDLE)
+        return 0;  // Evicted
     VkAccelerationStructureDeviceAddressInfoKHR addressInfo{VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR};
     addressInfo.accelerationStructure = m_blas[blasId].accel;
     return vkGetAccelerationStructureDeviceAddressKHR(m_device, &addressInfo);
@@ -58,28 +153,70 @@ VkDeviceAddress RaytracingBuilderKHR::getBlasDeviceAddress(uint32_t blasId)
 // - There will be as many BLAS as input.size()
 // - The resulting BLAS (along with the inputs used to build) are stored in m_blas,
 //   and can be referenced by index.
-// - if flag has the 'Compact' flag, the BLAS will be compacted
+// - BLASes whose flags have the 'Compact' flag are compacted
+// - with m_useCache, BLASes found in the cache are read instead of built
 //
 void RaytracingBuilderKHR::buildBlas(const std::vector<BlasInput>& input,
                                      VkBuildAccelerationStructureFlagsKHR flags)
+{
+    BlasBuild built = buildBlasDetached(input, flags);
+    commitBlas(built);
+}
+
+void RaytracingBuilderKHR::commitBlas(BlasBuild& built)
+{
+    m_blas.insert(m_blas.end(), built.blas.begin(), built.blas.end());
+    m_blasStats.insert(m_blasStats.end(), built.stats.begin(), built.stats.end());
+    for (const AsStats& s : built.stats)
+        m_stats.blasBytes += s.compactSize ? s.compactSize : s.buildSize;
+    m_stats.blasCount += static_cast<uint32_t>(built.blas.size());
+    m_stats.blasCached += built.cached;
+    m_stats.blasSeconds += built.seconds;
+}
+
+RaytracingBuilderKHR::BlasBuild RaytracingBuilderKHR::buildBlasDetached(const std::vector<BlasInput>& input,
+                                                                        VkBuildAccelerationStructureFlagsKHR flags)
 {
     //printf("RaytracingBuilderKHR::buildBlas (110)\n");
     auto         nbBlas = static_cast<uint32_t>(input.size());
+    if (nbBlas == 0)
+        return {};
+    auto startTime = std::chrono::steady_clock::now();
     VkDeviceSize asTotalSize{0};     // Memory size of all allocated BLAS
     uint32_t     nbCompactions{0};   // Nb of BLAS requesting compaction
     VkDeviceSize maxScratchSize{0};  // Largest scratch size
 
+    std::vector<WrapAccelerationStructure> cached(nbBlas);
+    std::vector<AsStats> stats(nbBlas);
+    for (uint32_t idx = 0; idx < nbBlas; idx++)
+        {
+            stats[idx].flags = input[idx].flags | flags;
+            for (const auto& range : input[idx].asBuildOffsetInfo)
+                stats[idx].primitives += range.primitiveCount;
+        }
+    uint32_t nbCached = m_useCache ? loadCachedBlas(input, flags, cached, stats) : 0;
+    std::vector<uint32_t> toBuild;
+    for(uint32_t idx = 0; idx < nbBlas; idx++)
+        if (cached[idx].accel == VK_NULL_HANDLE)
+            toBuild.push_back(idx);
+
     // Preparing the information for the acceleration build commands.
+    // With m_hostThreads, those with host copies of their inputs are
+    // built on the host instead, by hostBuildBlas.
     std::vector<BuildAccelerationStructure> buildAs(nbBlas);
-    for(uint32_t idx = 0; idx < nbBlas; idx++)
+    std::vector<uint32_t> hostBuild, deviceBuild;
+    for(uint32_t idx : toBuild)
         {
+            bool host = m_hostThreads > 0 && !input[idx].hostGeometry.empty();
+            (host ? hostBuild : deviceBuild).push_back(idx);
+
             // Filling partially the VkAccelerationStructureBuildGeometryInfoKHR for querying the build sizes.
             // Other information will be filled in the createBlas (see #2)
             buildAs[idx].buildInfo.type          = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
             buildAs[idx].buildInfo.mode          = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
             buildAs[idx].buildInfo.flags         = input[idx].flags | flags;
             buildAs[idx].buildInfo.geometryCount = static_cast<uint32_t>(input[idx].asGeometry.size());
-            buildAs[idx].buildInfo.pGeometries   = input[idx].asGeometry.data();
+            buildAs[idx].buildInfo.pGeometries   = host ? input[idx].hostGeometry.data() : input[idx].asGeometry.data();
 
             // Build range information
             buildAs[idx].rangeInfo = input[idx].asBuildOffsetInfo.data();
@@ -89,92 +226,172 @@ void RaytracingBuilderKHR::buildBlas(const std::vector<BlasInput>& input,
             for(auto tt = 0; tt < input[idx].asBuildOffsetInfo.size(); tt++)
                 maxPrimCount[tt] = input[idx].asBuildOffsetInfo[tt].primitiveCount; //# of triangles
             vkGetAccelerationStructureBuildSizesKHR(m_device,
-                                                    VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
+                                                    host ? VK_ACCELERATION_STRUCTURE_BUILD_TYPE_HOST_KHR
+                                                         : VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
                                                     &buildAs[idx].buildInfo, maxPrimCount.data(),
                                                     &buildAs[idx].sizeInfo);
 
             // Extra info
+            stats[idx].buildSize   = buildAs[idx].sizeInfo.accelerationStructureSize;
+            stats[idx].scratchSize = buildAs[idx].sizeInfo.buildScratchSize;
+            stats[idx].host        = host;
             asTotalSize += buildAs[idx].sizeInfo.accelerationStructureSize;
+            if (host)
+                continue;
             maxScratchSize = max(maxScratchSize, buildAs[idx].sizeInfo.buildScratchSize);
             nbCompactions += hasFlag(buildAs[idx].buildInfo.flags,
                                      VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR);
         }
 
-    // Allocate the scratch buffers holding the temporary data of the acceleration structure builder
-    VK->m_scratch1 = VK->createBufferWrap(maxScratchSize,
-                                    VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT
-                                    | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
-                                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-
-    //NAME(VK->m_scratch1.buffer, VK_OBJECT_TYPE_BUFFER, "buildBlas scratch buffer");
-  
-    VkBufferDeviceAddressInfo bufferInfo{VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO,
-        nullptr, VK->m_scratch1.buffer};
-    VkDeviceAddress           scratchAddress = vkGetBufferDeviceAddress(m_device, &bufferInfo);
+    // Batches of BLASes are built concurrently, each with its own
+    // aligned piece of one scratch arena.  A batch ends at batchLimit
+    // bytes of acceleration structures, which bounds the memory held
+    // before compaction, or when the arena is full.
+    const VkDeviceSize batchLimit{256'000'000};  // 256 MB
+    const VkDeviceSize arenaLimit{256'000'000};
+    auto align = [&](VkDeviceSize size) { return (size + m_scratchAlignment - 1) & ~(m_scratchAlignment - 1); };
+    VkDeviceSize totalScratch{0};
+    for (uint32_t idx : deviceBuild)
+        totalScratch += align(buildAs[idx].sizeInfo.buildScratchSize);
+    VkDeviceSize arenaSize = std::max(align(maxScratchSize), std::min(totalScratch, arenaLimit));
+
+    std::vector<std::vector<uint32_t>> batches;
+    std::vector<VkDeviceSize> scratchOffset(nbBlas);
+    VkDeviceSize batchSize{0}, batchScratch{0};
+    for (uint32_t idx : deviceBuild) {
+        VkDeviceSize scratch = align(buildAs[idx].sizeInfo.buildScratchSize);
+        if (batches.empty() || batchSize >= batchLimit || batchScratch + scratch > arenaSize) {
+            batches.emplace_back();
+            batchSize = batchScratch = 0; }
+        batches.back().push_back(idx);
+        scratchOffset[idx] = batchScratch;
+        batchSize += buildAs[idx].sizeInfo.accelerationStructureSize;
+        batchScratch += scratch; }
+
+    BufferWrap scratchArena{};
+    if (!batches.empty())
+        {
+            scratchArena = VK->createBufferWrap(arenaSize,
+                                                VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT
+                                                | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+            VkBufferDeviceAddressInfo bufferInfo{VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO,
+                nullptr, scratchArena.buffer};
+            VkDeviceAddress scratchAddress = vkGetBufferDeviceAddress(m_device, &bufferInfo);
+            for (uint32_t idx : deviceBuild)
+                buildAs[idx].buildInfo.scratchData.deviceAddress = scratchAddress + scratchOffset[idx];
+        }
 
-    // Allocate a query pool for storing the needed size for every BLAS compaction.
+    // Allocate a query pool for storing the needed size for every BLAS
+    // compaction.  Queries are numbered by BLAS index, so cached BLASes,
+    // and those not compacted, leave theirs unused.
     VkQueryPool queryPool{VK_NULL_HANDLE};
     if(nbCompactions > 0)  // Is compaction requested?
         {
-            assert(nbCompactions == nbBlas);  // Don't allow mix of on/off compaction
             VkQueryPoolCreateInfo qpci{VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO};
             qpci.queryCount = nbBlas;
             qpci.queryType  = VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR;
             vkCreateQueryPool(m_device, &qpci, nullptr, &queryPool);
         }
 
-    // Batching creation/compaction of BLAS to allow staying in restricted amount of memory
-    std::vector<uint32_t> indices;  // Indices of the BLAS to create
-    VkDeviceSize          batchSize{0};
-    VkDeviceSize          batchLimit{256'000'000};  // 256 MB
-    for(uint32_t idx = 0; idx < nbBlas; idx++)
+    // And two timestamps bracketing each batch's build.
+    VkQueryPool timestampPool{VK_NULL_HANDLE};
+    if (!batches.empty())
+        {
+            VkQueryPoolCreateInfo qpci{VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO};
+            qpci.queryCount = 2*static_cast<uint32_t>(batches.size());
+            qpci.queryType  = VK_QUERY_TYPE_TIMESTAMP;
+            vkCreateQueryPool(m_device, &qpci, nullptr, &timestampPool);
+            vkResetQueryPool(m_device, timestampPool, 0, qpci.queryCount);
+        }
+
+    // Pipelined: batch b is submitted before the host waits for batch
+    // b-1, so the queue never idles while the host reads b-1's compacted
+    // sizes and records its compaction.  Batch b-1's uncompacted
+    // structures are destroyed once that compaction has run.
+    PendingSubmit building, previousBuild, compacting;
+    for (size_t b = 0; b <= batches.size(); b++)
         {
-            indices.push_back(idx);
-            batchSize += buildAs[idx].sizeInfo.accelerationStructureSize;
-            // Over the limit or last BLAS element
-            if(batchSize >= batchLimit || idx == nbBlas - 1)
+            previousBuild = building;
+            building = PendingSubmit{};
+            if (b < batches.size())
                 {
-                    VkCommandBuffer cmdBuf = VK->createTempCmdBuffer();
-                    cmdCreateBlas(cmdBuf, indices, buildAs, scratchAddress, queryPool);
-                    VK->submitTempCmdBuffer(cmdBuf);
-
-                    if (queryPool)
-                        {
-                            VkCommandBuffer cmdBuf = VK->createTempCmdBuffer();
-                            cmdCompactBlas(cmdBuf, indices, buildAs, queryPool);
-                            VK->submitTempCmdBuffer(cmdBuf);
-
-                            // Destroy the non-compacted version
-                            destroyNonCompacted(indices, buildAs);
-                        }
-                    // Reset
-
-                    batchSize = 0;
-                    indices.clear();
+                    VkCommandBuffer cmdBuf = createCmdBuffer();
+                    cmdCreateBlas(cmdBuf, batches[b], buildAs, b > 0, queryPool,
+                                  timestampPool, 2*static_cast<uint32_t>(b));
+                    building = submitNoWait(cmdBuf);
                 }
-        }
+            if (b == 0)
+                continue;
 
-    // Logging reduction
-    if(queryPool)
+            finish(previousBuild);
+            if (queryPool)
+                {
+                    finish(compacting);
+                    if (b >= 2)
+                        destroyNonCompacted(batches[b-2], buildAs);
+                    VkCommandBuffer cmdBuf = createCmdBuffer();
+                    cmdCompactBlas(cmdBuf, batches[b-1], buildAs, queryPool);
+                    compacting = submitNoWait(cmdBuf);
+                }
+        }
+    if (queryPool)
         {
-            VkDeviceSize compactSize = std::accumulate(buildAs.begin(), buildAs.end(), 0ULL, [](const auto& a, const auto& b) {
-                return a + b.sizeInfo.accelerationStructureSize;
-            });
+            finish(compacting);
+            destroyNonCompacted(batches.back(), buildAs);
         }
 
-    // Keeping all the created acceleration structures
-    for(auto& b : buildAs)
+    // Each BLAS is charged its share, by primitives, of its batch's
+    // GPU time, since the batch's builds run concurrently.
+    if (timestampPool)
         {
-            m_blas.emplace_back(b.as);
+            std::vector<uint64_t> ticks(2*batches.size());
+            vkGetQueryPoolResults(m_device, timestampPool, 0, static_cast<uint32_t>(ticks.size()),
+                                  ticks.size()*sizeof(uint64_t), ticks.data(), sizeof(uint64_t),
+                                  VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT);
+            for (size_t b = 0; b < batches.size(); b++)
+                {
+                    double batchMs = (ticks[2*b+1] - ticks[2*b]) * VK->m_timestampPeriod * 1e-6;
+                    uint64_t batchPrims{0};
+                    for (uint32_t idx : batches[b])
+                        batchPrims += stats[idx].primitives;
+                    for (uint32_t idx : batches[b])
+                        stats[idx].buildMs = batchPrims ? batchMs*stats[idx].primitives/batchPrims
+                                                        : batchMs/batches[b].size();
+                }
         }
 
     // Clean up
     vkDestroyQueryPool(m_device, queryPool, nullptr);
-    //scratch.destroy(m_device);
+    vkDestroyQueryPool(m_device, timestampPool, nullptr);
+    scratchArena.destroy(m_device);  // Every batch above was waited on
+
+    if (!hostBuild.empty())
+        hostBuildBlas(hostBuild, buildAs, stats);
+
+    if (m_useCache && !toBuild.empty())
+        saveCachedBlas(input, flags, toBuild, buildAs);
+
+    // Keeping all the created acceleration structures, in input order
+    BlasBuild built;
+    for (uint32_t idx = 0; idx < nbBlas; idx++)
+        built.blas.emplace_back(cached[idx].accel ? cached[idx] : buildAs[idx].as);
+    for (uint32_t idx : toBuild)
+        if (hasFlag(stats[idx].flags, VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR))
+            stats[idx].compactSize = buildAs[idx].sizeInfo.accelerationStructureSize;
+    built.stats = std::move(stats);
+    built.cached = nbCached;
+
+    built.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    printf("BLAS: %zu built in %zu batches, %zu on the host, %u read from cache, %.1f MB scratch arena, %.3f s\n",
+           toBuild.size(), batches.size(), hostBuild.size(), nbCached,
+           batches.empty() ? 0.0 : arenaSize/1048576.0, built.seconds);
+    return built;
 }
 
 WrapAccelerationStructure createAcceleration(VkApp* VK,
-                                              VkAccelerationStructureCreateInfoKHR& accel_)
+                                              VkAccelerationStructureCreateInfoKHR& accel_,
+                                              VkMemoryPropertyFlags properties = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)
 {
     //printf("createAcceleration (6)\n");
     WrapAccelerationStructure result;
@@ -182,7 +399,7 @@ WrapAccelerationStructure createAcceleration(VkApp* VK,
     result.bw = VK->createBufferWrap(accel_.size,
                                      VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR
                                      | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
-                                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+                                     properties);
 
     // Create the acceleration structure
     accel_.buffer = result.bw.buffer;
@@ -191,21 +408,35 @@ WrapAccelerationStructure createAcceleration(VkApp* VK,
     return result;
 }
 
-// Creating the bottom level acceleration structure for all indices of `buildAs` vector.
-// The array of BuildAccelerationStructure was created in buildBlas and the vector of
-// indices limits the number of BLAS to create at once. This limits the amount of
-// memory needed when compacting the BLAS.
+// Creating the bottom level acceleration structures for one batch of
+// consecutive indices of the `buildAs` vector, all in one build command.
+// Each already has its own piece of the scratch arena, so they build
+// concurrently.  The arena was used by the previous batch, so if
+// afterPrevious a barrier first waits for that batch's builds.  The
+// compacted sizes of those to compact land in queries numbered by BLAS
+// index, and timestamps firstTimestamp and firstTimestamp+1 bracket
+// the builds.
 void RaytracingBuilderKHR::cmdCreateBlas(VkCommandBuffer                          cmdBuf,
-                                         std::vector<uint32_t>                    indices,
+                                         const std::vector<uint32_t>&             indices,
                                          std::vector<BuildAccelerationStructure>& buildAs,
-                                         VkDeviceAddress                          scratchAddress,
-                                         VkQueryPool                              queryPool)
+                                         bool                                     afterPrevious,
+                                         VkQueryPool                              queryPool,
+                                         VkQueryPool                              timestampPool,
+                                         uint32_t                                 firstTimestamp)
 {
     //printf("RaytracingBuilderKHR::cmdCreateBlas (40)\n");
-    if(queryPool)  // For querying the compaction size
-        vkResetQueryPool(m_device, queryPool, 0, static_cast<uint32_t>(indices.size()));
-    uint32_t queryCnt{0};
-
+    VkMemoryBarrier barrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+    barrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+    barrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR
+        | VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+    if (afterPrevious)
+        vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                             VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                             0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+    std::vector<VkAccelerationStructureBuildGeometryInfoKHR> buildInfos;
+    std::vector<const VkAccelerationStructureBuildRangeInfoKHR*> rangeInfos;
+    std::vector<uint32_t> compacting;
     for(const auto& idx : indices)
         {
             // Actual allocation of buffer and acceleration structure.
@@ -218,31 +449,29 @@ void RaytracingBuilderKHR::cmdCreateBlas(VkCommandBuffer
             // BuildInfo #2 part
             // Setting where the build lands
             buildAs[idx].buildInfo.dstAccelerationStructure  = buildAs[idx].as.accel;
-            // All build use the same scratch buffer
-            buildAs[idx].buildInfo.scratchData.deviceAddress = scratchAddress;
-
-            // Building the bottom-level-acceleration-structure
-            vkCmdBuildAccelerationStructuresKHR(cmdBuf, 1, &buildAs[idx].buildInfo,
-                                                &buildAs[idx].rangeInfo);
-
-            // Since the scratch buffer is reused across builds, we
-            // need a barrier to ensure one build is finished before
-            // starting the next one.
-            VkMemoryBarrier barrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER};
-            barrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
-            barrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
+            buildInfos.push_back(buildAs[idx].buildInfo);
+            rangeInfos.push_back(buildAs[idx].rangeInfo);
+            if (hasFlag(buildAs[idx].buildInfo.flags, VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR))
+                compacting.push_back(idx);
+        }
+
+    // Building the whole batch of bottom-level-acceleration-structures
+    vkCmdWriteTimestamp(cmdBuf, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, timestampPool, firstTimestamp);
+    vkCmdBuildAccelerationStructuresKHR(cmdBuf, static_cast<uint32_t>(buildInfos.size()),
+                                        buildInfos.data(), rangeInfos.data());
+    vkCmdWriteTimestamp(cmdBuf, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, timestampPool, firstTimestamp + 1);
+
+    if(queryPool && !compacting.empty())
+        {
+            // Add queries to find the 'real' amount of memory needed, use for compaction
+            vkResetQueryPool(m_device, queryPool, indices.front(), indices.back() - indices.front() + 1);
             vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
                                  VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
                                  0, 1, &barrier, 0, nullptr, 0, nullptr);
-
-            if(queryPool)
-                {
-                    // Add a query to find the 'real' amount of memory needed, use for compaction
-                    vkCmdWriteAccelerationStructuresPropertiesKHR(cmdBuf, 1,
-                               &buildAs[idx].buildInfo.dstAccelerationStructure,
-                               VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR,
-                               queryPool, queryCnt++);
-                }
+            for(auto idx : compacting)
+                vkCmdWriteAccelerationStructuresPropertiesKHR(cmdBuf, 1, &buildAs[idx].as.accel,
+                                   VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR,
+                                   queryPool, idx);
         }
 }
 
@@ -250,22 +479,37 @@ void RaytracingBuilderKHR::cmdCreateBlas(VkCommandBuffer
 // Create and replace a new acceleration structure and buffer based on the size retrieved by the
 // Query.
 void RaytracingBuilderKHR::cmdCompactBlas(VkCommandBuffer                          cmdBuf,
-                                          std::vector<uint32_t>                    indices,
+                                          const std::vector<uint32_t>&             indices,
                                           std::vector<BuildAccelerationStructure>& buildAs,
                                           VkQueryPool                              queryPool)
 {
     //printf("RaytracingBuilderKHR::cmdCompactBlas\n");
-    uint32_t queryCtn{0};
+    std::vector<uint32_t> compacting;
+    for(auto idx : indices)
+        if (hasFlag(buildAs[idx].buildInfo.flags, VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR))
+            compacting.push_back(idx);
+    if (compacting.empty())
+        return;
 
-    // Get the compacted size result back
-    std::vector<VkDeviceSize> compactSizes(static_cast<uint32_t>(indices.size()));
-    vkGetQueryPoolResults(m_device, queryPool, 0, (uint32_t)compactSizes.size(), compactSizes.size() * sizeof(VkDeviceSize),
-                          compactSizes.data(), sizeof(VkDeviceSize), VK_QUERY_RESULT_WAIT_BIT);
+    // The builds were in an earlier submission; the host waited for them,
+    // but the copies still need their writes made visible.
+    VkMemoryBarrier barrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+    barrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+    barrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
+    vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                         VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                         0, 1, &barrier, 0, nullptr, 0, nullptr);
 
-    for(auto idx : indices)
+    for(auto idx : compacting)
         {
+            // Get the compacted size result back
+            VkDeviceSize compactSize{0};
+            vkGetQueryPoolResults(m_device, queryPool, idx, 1, sizeof(VkDeviceSize), &compactSize,
+                                  sizeof(VkDeviceSize), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT);
+
             buildAs[idx].cleanupAS                          = buildAs[idx].as.accel;           // previous AS to destroy
-            buildAs[idx].sizeInfo.accelerationStructureSize = compactSizes[queryCtn++];  // new reduced size
+            buildAs[idx].cleanup                            = buildAs[idx].as.bw;              // and its buffer
+            buildAs[idx].sizeInfo.accelerationStructureSize = compactSize;                     // new reduced size
 
             // Creating a compact version of the AS
             VkAccelerationStructureCreateInfoKHR asCreateInfo{VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR};
@@ -285,15 +529,515 @@ void RaytracingBuilderKHR::cmdCompactBlas(VkCommandBuffer
 //--------------------------------------------------------------------------------------------------
 // Destroy all the non-compacted acceleration structures
 //
-void RaytracingBuilderKHR::destroyNonCompacted(std::vector<uint32_t> indices, std::vector<BuildAccelerationStructure>& buildAs)
+void RaytracingBuilderKHR::destroyNonCompacted(const std::vector<uint32_t>& indices, std::vector<BuildAccelerationStructure>& buildAs)
 {
     //printf("RaytracingBuilderKHR::destroyNonCompacted\n");
     for(auto& i : indices)
+        if (buildAs[i].cleanupAS != VK_NULL_HANDLE)
         {
+            buildAs[i].cleanup.destroy(VK->m_device);
             vkDestroyAccelerationStructureKHR(VK->m_device, buildAs[i].cleanupAS, nullptr);
         }
 }
 
+//--------------------------------------------------------------------------------------------------
+// Host builds (-hostbuild).  The BLASes of indices are built by
+// vkBuildAccelerationStructuresKHR from their inputs' host copies, as
+// deferred operations joined by m_hostThreads threads, leaving the GPU
+// free while loading.  Host commands need the structures in host
+// visible memory, and compaction is a host copy too.  On a discrete GPU
+// each BLAS is then cloned into device local memory, the only device
+// work; with unified memory host visible memory is device local, and
+// they stay where they were built.  Each BLAS's buildMs is its share,
+// by primitives, of its batch's wall time.
+//
+void RaytracingBuilderKHR::hostBuildBlas(const std::vector<uint32_t>&             indices,
+                                         std::vector<BuildAccelerationStructure>& buildAs,
+                                         std::vector<AsStats>&                    stats)
+{
+    if (!m_hostPool)
+        m_hostPool = std::make_unique<ThreadPool>(std::max(m_hostThreads, 2u) - 1);  // The caller joins too
+    VkMemoryPropertyFlags hostMemory = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT
+        | (m_unifiedMemory ? VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT : 0);
+
+    // Batches bounded by their scratch, which is plain host memory.
+    const VkDeviceSize scratchLimit{256'000'000};
+    auto align = [&](VkDeviceSize size) { return (size + m_scratchAlignment - 1) & ~(m_scratchAlignment - 1); };
+    std::vector<std::vector<uint32_t>> batches;
+    VkDeviceSize batchScratch{0};
+    for (uint32_t idx : indices)
+        {
+            VkDeviceSize scratch = align(buildAs[idx].sizeInfo.buildScratchSize);
+            if (batches.empty() || batchScratch + scratch > scratchLimit)
+                {
+                    batches.emplace_back();
+                    batchScratch = 0;
+                }
+            batches.back().push_back(idx);
+            batchScratch += scratch;
+        }
+
+    std::vector<uint8_t> scratchArena;
+    for (const std::vector<uint32_t>& batch : batches)
+        {
+            VkDeviceSize scratchSize{0};
+            for (uint32_t idx : batch)
+                scratchSize += align(buildAs[idx].sizeInfo.buildScratchSize);
+            scratchArena.resize(std::max<size_t>(scratchArena.size(), scratchSize + m_scratchAlignment));
+            uint8_t* scratch = scratchArena.data() + (m_scratchAlignment - uintptr_t(scratchArena.data()) % m_scratchAlignment) % m_scratchAlignment;
+
+            std::vector<VkAccelerationStructureBuildGeometryInfoKHR> buildInfos;
+            std::vector<const VkAccelerationStructureBuildRangeInfoKHR*> rangeInfos;
+            for (uint32_t idx : batch)
+                {
+                    VkAccelerationStructureCreateInfoKHR createInfo{VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR};
+                    createInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+                    createInfo.size = buildAs[idx].sizeInfo.accelerationStructureSize;
+                    buildAs[idx].as = createAcceleration(VK, createInfo, hostMemory);
+                    buildAs[idx].buildInfo.dstAccelerationStructure = buildAs[idx].as.accel;
+                    buildAs[idx].buildInfo.scratchData.hostAddress  = scratch;
+                    scratch += align(buildAs[idx].sizeInfo.buildScratchSize);
+                    buildInfos.push_back(buildAs[idx].buildInfo);
+                    rangeInfos.push_back(buildAs[idx].rangeInfo);
+                }
+
+            auto startTime = std::chrono::steady_clock::now();
+            VkDeferredOperationKHR operation;
+            vkCreateDeferredOperationKHR(m_device, nullptr, &operation);
+            VkResult result = vkBuildAccelerationStructuresKHR(m_device, operation, static_cast<uint32_t>(buildInfos.size()),
+                                                               buildInfos.data(), rangeInfos.data());
+            result = joinDeferred(operation, result);
+            vkDestroyDeferredOperationKHR(m_device, operation, nullptr);
+            if (result != VK_SUCCESS)
+                printf("Host BLAS build failed: %d\n", result);
+
+            double batchMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+            uint64_t batchPrims{0};
+            for (uint32_t idx : batch)
+                batchPrims += stats[idx].primitives;
+            for (uint32_t idx : batch)
+                stats[idx].buildMs = batchPrims ? batchMs*stats[idx].primitives/batchPrims : batchMs/batch.size();
+
+            // Compaction: the compacted sizes are written straight to the
+            // host, and each copy is another deferred operation.
+            std::vector<uint32_t> compacting;
+            std::vector<VkAccelerationStructureKHR> structures;
+            for (uint32_t idx : batch)
+                if (hasFlag(buildAs[idx].buildInfo.flags, VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR))
+                    {
+                        compacting.push_back(idx);
+                        structures.push_back(buildAs[idx].as.accel);
+                    }
+            if (compacting.empty())
+                continue;
+            std::vector<VkDeviceSize> compactSizes(compacting.size());
+            vkWriteAccelerationStructuresPropertiesKHR(m_device, static_cast<uint32_t>(structures.size()), structures.data(),
+                                                       VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR,
+                                                       compactSizes.size()*sizeof(VkDeviceSize), compactSizes.data(),
+                                                       sizeof(VkDeviceSize));
+            for (size_t c = 0; c < compacting.size(); c++)
+                {
+                    uint32_t idx = compacting[c];
+                    VkAccelerationStructureCreateInfoKHR createInfo{VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR};
+                    createInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+                    createInfo.size = compactSizes[c];
+                    WrapAccelerationStructure compact = createAcceleration(VK, createInfo, hostMemory);
+
+                    VkCopyAccelerationStructureInfoKHR copyInfo{VK_STRUCTURE_TYPE_COPY_ACCELERATION_STRUCTURE_INFO_KHR};
+                    copyInfo.src  = buildAs[idx].as.accel;
+                    copyInfo.dst  = compact.accel;
+                    copyInfo.mode = VK_COPY_ACCELERATION_STRUCTURE_MODE_COMPACT_KHR;
+                    vkCreateDeferredOperationKHR(m_device, nullptr, &operation);
+                    joinDeferred(operation, vkCopyAccelerationStructureKHR(m_device, operation, &copyInfo));
+                    vkDestroyDeferredOperationKHR(m_device, operation, nullptr);
+
+                    buildAs[idx].as.bw.destroy(m_device);
+                    vkDestroyAccelerationStructureKHR(m_device, buildAs[idx].as.accel, nullptr);
+                    buildAs[idx].as = compact;
+                    buildAs[idx].sizeInfo.accelerationStructureSize = compactSizes[c];
+                }
+        }
+
+    if (m_unifiedMemory)
+        return;
+
+    // Host writes to coherent memory before a submission are visible to it.
+    std::vector<WrapAccelerationStructure> built;
+    VkCommandBuffer cmdBuf = createCmdBuffer();
+    for (uint32_t idx : indices)
+        {
+            VkAccelerationStructureCreateInfoKHR createInfo{VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR};
+            createInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+            createInfo.size = buildAs[idx].sizeInfo.accelerationStructureSize;
+            built.push_back(buildAs[idx].as);
+            buildAs[idx].as = createAcceleration(VK, createInfo);
+
+            VkCopyAccelerationStructureInfoKHR copyInfo{VK_STRUCTURE_TYPE_COPY_ACCELERATION_STRUCTURE_INFO_KHR};
+            copyInfo.src  = built.back().accel;
+            copyInfo.dst  = buildAs[idx].as.accel;
+            copyInfo.mode = VK_COPY_ACCELERATION_STRUCTURE_MODE_CLONE_KHR;
+            vkCmdCopyAccelerationStructureKHR(cmdBuf, &copyInfo);
+        }
+    submitAndWait(cmdBuf);
+    for (WrapAccelerationStructure& as : built)
+        {
+            as.bw.destroy(m_device);
+            vkDestroyAccelerationStructureKHR(m_device, as.accel, nullptr);
+        }
+}
+
+// Joins the deferred operation that produced result, on the calling
+// thread and as many pool threads as it can use, and returns its result.
+VkResult RaytracingBuilderKHR::joinDeferred(VkDeferredOperationKHR operation, VkResult result)
+{
+    // Not deferred: already done on this thread, or failed.
+    if (result != VK_OPERATION_DEFERRED_KHR)
+        return result;
+
+    auto join = [this, operation]() {
+        while (vkDeferredOperationJoinKHR(m_device, operation) == VK_THREAD_IDLE_KHR)
+            std::this_thread::yield(); };
+    uint32_t concurrency = std::max(vkGetDeferredOperationMaxConcurrencyKHR(m_device, operation), 1u);
+    uint32_t helpers = std::min(concurrency, std::max(m_hostThreads, 1u)) - 1;
+    std::vector<std::future<void>> joins;
+    for (uint32_t t = 0; t < helpers; t++)
+        joins.push_back(m_hostPool->submit(join));
+    join();
+    for (auto& j : joins)
+        j.wait();
+    return vkGetDeferredOperationResultKHR(m_device, operation);
+}
+
+//--------------------------------------------------------------------------------------------------
+// BLAS cache (-ascache).  Each file in ascache/ holds one BLAS as
+// serialized by vkCmdCopyAccelerationStructureToMemoryKHR, after a
+// header naming its key.  The serialized data starts with the driver
+// and compatibility UUIDs, which vkGetDeviceAccelerationStructureCompatibilityKHR
+// checks against this device; an incompatible entry is rebuilt and
+// overwritten.
+//
+namespace {
+
+const char BLAS_CACHE_MAGIC[8] = {'R','T','B','L','A','S','0','1'};
+// Bump when what a BLAS is built from changes, so stale entries miss.
+const uint64_t BLAS_CACHE_VERSION = 1;
+const VkDeviceSize SERIALIZED_ALIGNMENT = 256;    // Of the serialized data's device address
+const VkDeviceSize CACHE_STAGING_LIMIT{256'000'000};
+
+struct BlasCacheHeader
+{
+    char     magic[8];
+    uint64_t key;
+    uint64_t asSize;        // Size to create the deserialized structure with
+    uint64_t serializedSize;
+};
+
+// The key also covers the build flags, which change the structure.
+uint64_t blasCacheKey(const BlasInput& input, VkBuildAccelerationStructureFlagsKHR flags)
+{
+    uint64_t parts[3] = {input.cacheKey, uint64_t(input.flags | flags), BLAS_CACHE_VERSION};
+    return contentHash(parts, sizeof(parts));
+}
+
+std::string blasCachePath(uint64_t key)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "ascache/%016llx.blas", (unsigned long long)key);
+    return name;
+}
+
+VkDeviceAddress bufferAddress(VkDevice device, VkBuffer buffer)
+{
+    VkBufferDeviceAddressInfo info{VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO, nullptr, buffer};
+    return vkGetBufferDeviceAddress(device, &info);
+}
+
+}
+
+// Reads the cached BLASes of input into cached, leaving misses empty,
+// and returns the hit count.  All hits are deserialized by one
+// submission from one host visible staging buffer.
+uint32_t RaytracingBuilderKHR::loadCachedBlas(const std::vector<BlasInput>& input,
+                                              VkBuildAccelerationStructureFlagsKHR flags,
+                                              std::vector<WrapAccelerationStructure>& cached,
+                                              std::vector<AsStats>& stats)
+{
+    struct Hit { uint32_t idx; BlasCacheHeader header; std::vector<char> file; VkDeviceSize offset; };
+    std::vector<Hit> hits;
+    VkDeviceSize stagingSize{0};
+    uint32_t incompatible{0};
+    for (uint32_t idx = 0; idx < input.size(); idx++)
+        {
+            if (input[idx].cacheKey == 0)
+                continue;
+            Hit hit{idx};
+            uint64_t key = blasCacheKey(input[idx], flags);
+            if (!readFile(blasCachePath(key), hit.file) || hit.file.size() < sizeof(BlasCacheHeader))
+                continue;
+            memcpy(&hit.header, hit.file.data(), sizeof(BlasCacheHeader));
+            if (memcmp(hit.header.magic, BLAS_CACHE_MAGIC, sizeof(BLAS_CACHE_MAGIC)) != 0
+                || hit.header.key != key
+                || hit.header.serializedSize < 2*VK_UUID_SIZE
+                || hit.file.size() != sizeof(BlasCacheHeader) + hit.header.serializedSize)
+                continue;
+
+            VkAccelerationStructureVersionInfoKHR version{VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_VERSION_INFO_KHR};
+            version.pVersionData = (const uint8_t*)hit.file.data() + sizeof(BlasCacheHeader);
+            VkAccelerationStructureCompatibilityKHR compatibility;
+            vkGetDeviceAccelerationStructureCompatibilityKHR(m_device, &version, &compatibility);
+            if (compatibility != VK_ACCELERATION_STRUCTURE_COMPATIBILITY_COMPATIBLE_KHR) {
+                incompatible++;
+                continue; }
+
+            hit.offset = stagingSize;
+            stagingSize += (hit.header.serializedSize + SERIALIZED_ALIGNMENT - 1) & ~(SERIALIZED_ALIGNMENT - 1);
+            hits.push_back(std::move(hit));
+        }
+    if (incompatible > 0)
+        printf("BLAS cache: %u entries built by an incompatible driver or device, rebuilding\n", incompatible);
+    if (hits.empty())
+        return 0;
+
+    BufferWrap staging = VK->createBufferWrap(stagingSize,
+                                              VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT
+                                              | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR,
+                                              VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+                                              | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    char* mapped;
+    vkMapMemory(m_device, staging.memory, 0, stagingSize, 0, (void**)&mapped);
+    for (Hit& hit : hits) {
+        memcpy(mapped + hit.offset, hit.file.data() + sizeof(BlasCacheHeader), hit.header.serializedSize);
+        hit.file = std::vector<char>(); }
+    vkUnmapMemory(m_device, staging.memory);
+    VkDeviceAddress stagingAddress = bufferAddress(m_device, staging.buffer);
+
+    VkCommandBuffer cmdBuf = createCmdBuffer();
+    for (const Hit& hit : hits)
+        {
+            VkAccelerationStructureCreateInfoKHR createInfo{VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR};
+            createInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+            createInfo.size = hit.header.asSize;
+            cached[hit.idx] = createAcceleration(VK, createInfo);
+            stats[hit.idx].buildSize = hit.header.asSize;
+            stats[hit.idx].cached    = true;
+
+            VkCopyMemoryToAccelerationStructureInfoKHR copyInfo{VK_STRUCTURE_TYPE_COPY_MEMORY_TO_ACCELERATION_STRUCTURE_INFO_KHR};
+            copyInfo.src.deviceAddress = stagingAddress + hit.offset;
+            copyInfo.dst  = cached[hit.idx].accel;
+            copyInfo.mode = VK_COPY_ACCELERATION_STRUCTURE_MODE_DESERIALIZE_KHR;
+            vkCmdCopyMemoryToAccelerationStructureKHR(cmdBuf, &copyInfo);
+        }
+    submitAndWait(cmdBuf);
+    staging.destroy(m_device);
+    return uint32_t(hits.size());
+}
+
+// Serializes the just built BLASes at indices into the cache, each
+// written with a temp file and rename, so an interrupted run never
+// leaves a partial entry.
+void RaytracingBuilderKHR::saveCachedBlas(const std::vector<BlasInput>& input,
+                                          VkBuildAccelerationStructureFlagsKHR flags,
+                                          const std::vector<uint32_t>& indices,
+                                          const std::vector<BuildAccelerationStructure>& buildAs)
+{
+    std::vector<uint32_t> keyed;
+    std::vector<VkAccelerationStructureKHR> structures;
+    for (uint32_t idx : indices)
+        if (input[idx].cacheKey != 0) {
+            keyed.push_back(idx);
+            structures.push_back(buildAs[idx].as.accel); }
+    if (keyed.empty())
+        return;
+
+    std::error_code ec;
+    std::filesystem::create_directories("ascache", ec);
+    size_t written{0};
+    serializeStructures(structures, [&](size_t k, const char* data, VkDeviceSize size)
+        {
+            uint32_t idx = keyed[k];
+            BlasCacheHeader header;
+            memcpy(header.magic, BLAS_CACHE_MAGIC, sizeof(BLAS_CACHE_MAGIC));
+            header.key = blasCacheKey(input[idx], flags);
+            header.asSize = buildAs[idx].sizeInfo.accelerationStructureSize;
+            header.serializedSize = size;
+
+            std::string path = blasCachePath(header.key);
+            std::string temp = tempPath(path);
+            FILE* file = fopen(temp.c_str(), "wb");
+            if (!file)
+                return;
+            bool ok = fwrite(&header, sizeof(header), 1, file) == 1
+                && fwrite(data, 1, size, file) == size;
+            ok = fclose(file) == 0 && ok;
+            if (ok)
+                std::filesystem::rename(temp, path, ec);
+            if (!ok || ec)
+                std::filesystem::remove(temp, ec);
+            else
+                written++;
+        });
+    printf("BLAS cache: %zu of %zu written\n", written, keyed.size());
+}
+
+// Serializes structures, handing each one's data to consume with its
+// index in structures.  Their serialized sizes come from one query per
+// structure; the data is copied out through a host visible buffer in
+// rounds of at most CACHE_STAGING_LIMIT bytes.
+void RaytracingBuilderKHR::serializeStructures(const std::vector<VkAccelerationStructureKHR>& structures,
+                                               const std::function<void(size_t, const char*, VkDeviceSize)>& consume)
+{
+    VkQueryPoolCreateInfo qpci{VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO};
+    qpci.queryCount = uint32_t(structures.size());
+    qpci.queryType  = VK_QUERY_TYPE_ACCELERATION_STRUCTURE_SERIALIZATION_SIZE_KHR;
+    VkQueryPool queryPool;
+    vkCreateQueryPool(m_device, &qpci, nullptr, &queryPool);
+    vkResetQueryPool(m_device, queryPool, 0, qpci.queryCount);
+
+    // The builds and compactions were waited on, but their writes still
+    // need to be made visible.
+    VkMemoryBarrier barrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+    barrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+    barrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
+    VkCommandBuffer cmdBuf = createCmdBuffer();
+    vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                         VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                         0, 1, &barrier, 0, nullptr, 0, nullptr);
+    vkCmdWriteAccelerationStructuresPropertiesKHR(cmdBuf, qpci.queryCount, structures.data(),
+                                                  VK_QUERY_TYPE_ACCELERATION_STRUCTURE_SERIALIZATION_SIZE_KHR,
+                                                  queryPool, 0);
+    submitAndWait(cmdBuf);
+    std::vector<VkDeviceSize> sizes(structures.size());
+    vkGetQueryPoolResults(m_device, queryPool, 0, qpci.queryCount, sizes.size()*sizeof(VkDeviceSize),
+                          sizes.data(), sizeof(VkDeviceSize), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT);
+    vkDestroyQueryPool(m_device, queryPool, nullptr);
+
+    auto align = [](VkDeviceSize size) { return (size + SERIALIZED_ALIGNMENT - 1) & ~(SERIALIZED_ALIGNMENT - 1); };
+    VkDeviceSize stagingSize{0}, total{0};
+    for (VkDeviceSize size : sizes) {
+        stagingSize = std::max(stagingSize, align(size));
+        total += align(size); }
+    stagingSize = std::max(stagingSize, std::min(total, CACHE_STAGING_LIMIT));
+    BufferWrap staging = VK->createBufferWrap(stagingSize,
+                                              VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
+                                              VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+                                              | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    VkDeviceAddress stagingAddress = bufferAddress(m_device, staging.buffer);
+    const char* mapped;
+    vkMapMemory(m_device, staging.memory, 0, stagingSize, 0, (void**)&mapped);
+
+    for (size_t first = 0; first < structures.size(); )
+        {
+            // One round: as many BLASes as fit in the staging buffer.
+            size_t last = first;
+            std::vector<VkDeviceSize> offsets;
+            VkDeviceSize used{0};
+            VkCommandBuffer cmdBuf = createCmdBuffer();
+            for (; last < structures.size() && used + align(sizes[last]) <= stagingSize; last++)
+                {
+                    VkCopyAccelerationStructureToMemoryInfoKHR copyInfo{VK_STRUCTURE_TYPE_COPY_ACCELERATION_STRUCTURE_TO_MEMORY_INFO_KHR};
+                    copyInfo.src = structures[last];
+                    copyInfo.dst.deviceAddress = stagingAddress + used;
+                    copyInfo.mode = VK_COPY_ACCELERATION_STRUCTURE_MODE_SERIALIZE_KHR;
+                    vkCmdCopyAccelerationStructureToMemoryKHR(cmdBuf, &copyInfo);
+                    offsets.push_back(used);
+                    used += align(sizes[last]);
+                }
+            VkMemoryBarrier hostBarrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+            hostBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            hostBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+            vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                                 VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &hostBarrier, 0, nullptr, 0, nullptr);
+            submitAndWait(cmdBuf);
+
+            for (size_t k = first; k < last; k++)
+                consume(k, mapped + offsets[k - first], sizes[k]);
+            first = last;
+        }
+    vkUnmapMemory(m_device, staging.memory);
+    staging.destroy(m_device);
+}
+
+//--------------------------------------------------------------------------------------------------
+// BLAS residency, for geometry streaming.  An evicted BLAS keeps its
+// id and statistics; its slot holds no structure until restored.
+//
+std::vector<std::vector<char>> RaytracingBuilderKHR::serializeBlas(const std::vector<uint32_t>& blasIds)
+{
+    std::vector<std::vector<char>> serialized(blasIds.size());
+    std::vector<VkAccelerationStructureKHR> structures;
+    for (uint32_t id : blasIds)
+        structures.push_back(m_blas[id].accel);
+    if (!structures.empty())
+        serializeStructures(structures, [&](size_t k, const char* data, VkDeviceSize size) {
+            serialized[k].assign(data, data + size); });
+    return serialized;
+}
+
+void RaytracingBuilderKHR::evictBlas(uint32_t blasId)
+{
+    WrapAccelerationStructure& blas = m_blas[blasId];
+    vkDestroyAccelerationStructureKHR(m_device, blas.accel, nullptr);
+    blas.bw.destroy(m_device);
+    blas = WrapAccelerationStructure{};
+}
+
+// Deserializes what serializeBlas returned for each of blasIds back
+// into its slot, by one submission from one host visible staging buffer.
+void RaytracingBuilderKHR::restoreBlas(const std::vector<uint32_t>&                 blasIds,
+                                       const std::vector<const std::vector<char>*>& serialized)
+{
+    if (blasIds.empty())
+        return;
+    std::vector<VkDeviceSize> offsets;
+    VkDeviceSize stagingSize{0};
+    for (const std::vector<char>* data : serialized) {
+        offsets.push_back(stagingSize);
+        stagingSize += (data->size() + SERIALIZED_ALIGNMENT - 1) & ~(SERIALIZED_ALIGNMENT - 1); }
+
+    BufferWrap staging = VK->createBufferWrap(stagingSize,
+                                              VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT
+                                              | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR,
+                                              VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+                                              | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    char* mapped;
+    vkMapMemory(m_device, staging.memory, 0, stagingSize, 0, (void**)&mapped);
+    for (size_t k = 0; k < serialized.size(); k++)
+        memcpy(mapped + offsets[k], serialized[k]->data(), serialized[k]->size());
+    vkUnmapMemory(m_device, staging.memory);
+    VkDeviceAddress stagingAddress = bufferAddress(m_device, staging.buffer);
+
+    VkCommandBuffer cmdBuf = createCmdBuffer();
+    for (size_t k = 0; k < blasIds.size(); k++)
+        {
+            const AsStats& stats = m_blasStats[blasIds[k]];
+            VkAccelerationStructureCreateInfoKHR createInfo{VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR};
+            createInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+            createInfo.size = stats.compactSize ? stats.compactSize : stats.buildSize;
+            m_blas[blasIds[k]] = createAcceleration(VK, createInfo);
+
+            VkCopyMemoryToAccelerationStructureInfoKHR copyInfo{VK_STRUCTURE_TYPE_COPY_MEMORY_TO_ACCELERATION_STRUCTURE_INFO_KHR};
+            copyInfo.src.deviceAddress = stagingAddress + offsets[k];
+            copyInfo.dst  = m_blas[blasIds[k]].accel;
+            copyInfo.mode = VK_COPY_ACCELERATION_STRUCTURE_MODE_DESERIALIZE_KHR;
+            vkCmdCopyMemoryToAccelerationStructureKHR(cmdBuf, &copyInfo);
+        }
+    submitAndWait(cmdBuf);
+    staging.destroy(m_device);
+}
+
+// Puts BLASes from buildBlasDetached, one per id, into their slots.
+void RaytracingBuilderKHR::replaceBlas(const std::vector<uint32_t>& blasIds, BlasBuild& built)
+{
+    assert(built.blas.size() == blasIds.size());
+    for (size_t k = 0; k < blasIds.size(); k++)
+        {
+            evictBlas(blasIds[k]);
+            m_blas[blasIds[k]]      = built.blas[k];
+            m_blasStats[blasIds[k]] = built.stats[k];
+        }
+}
+
+
 //--------------------------------------------------------------------------------------------------
 // Low level of Tlas creation 
 //
@@ -302,9 +1046,14 @@ void RaytracingBuilderKHR::cmdCreateTlas(VkCommandBuffer                      cm
                                          VkDeviceAddress                      instBufferAddr,
                                          VkBuildAccelerationStructureFlagsKHR flags,
                                          bool                                 update,
-                                         bool                                 motion)
+                                         bool                                 motion,
+                                         bool                                 back)
 {
     //printf("RaytracingBuilderKHR::cmdCreateTlas (75)\n");
+    WrapAccelerationStructure& tlas      = back ? m_tlasBack : m_tlas;
+    VkDeviceSize&              tlasBytes = back ? m_tlasBackBytes : m_stats.tlasBytes;
+    AsStats&                   tlasStats = back ? m_tlasBackStats : m_tlasStats;
+
     // Wraps a device pointer to the above uploaded instances.
     VkAccelerationStructureGeometryInstancesDataKHR instancesVk{VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR};
     instancesVk.data.deviceAddress = instBufferAddr;
@@ -328,30 +1077,39 @@ void RaytracingBuilderKHR::cmdCreateTlas(VkCommandBuffer                      cm
                                             &countInstance, &sizeInfo);
 
     // Create TLAS
-    if(update == false)
+    if(update == false && sizeInfo.accelerationStructureSize > tlasBytes)
         {
+            // A rebuild that outgrows the previous TLAS replaces it;
+            // callers only rebuild once the GPU is done with it.
+            tlas.bw.destroy(m_device);
+            vkDestroyAccelerationStructureKHR(m_device, tlas.accel, nullptr);
 
             VkAccelerationStructureCreateInfoKHR createInfo{VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR};
             createInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
             createInfo.size = sizeInfo.accelerationStructureSize;
-            m_tlas = createAcceleration(VK, createInfo);
+            tlas = createAcceleration(VK, createInfo);
+            tlasBytes = createInfo.size;
         }
 
-    // Allocate the scratch memory
-    VK->m_scratch2 = VK->createBufferWrap(sizeInfo.buildScratchSize,
-                                              VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT
-                                              | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
-                                              VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-
-    //NAME(VK->m_scratch2.buffer, VK_OBJECT_TYPE_BUFFER, "cmdCreateTlas scratch buffer");
+    // The scratch buffer persists, sized for both builds and refits.
+    VkDeviceSize scratchSize = std::max(sizeInfo.buildScratchSize, sizeInfo.updateScratchSize);
+    if (scratchSize > m_tlasScratchSize)
+        {
+            m_tlasScratch.destroy(m_device);
+            m_tlasScratch = VK->createBufferWrap(scratchSize,
+                                                 VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT
+                                                 | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+            m_tlasScratchSize = scratchSize;
+        }
 
     VkBufferDeviceAddressInfo bufferInfo{VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO,
-        nullptr, VK->m_scratch2.buffer};
+        nullptr, m_tlasScratch.buffer};
     VkDeviceAddress scratchAddress = vkGetBufferDeviceAddress(m_device, &bufferInfo);
 
     // Update build information
-    buildInfo.srcAccelerationStructure  = update ? m_tlas.accel : VK_NULL_HANDLE;
-    buildInfo.dstAccelerationStructure  = m_tlas.accel;
+    buildInfo.srcAccelerationStructure  = update ? tlas.accel : VK_NULL_HANDLE;
+    buildInfo.dstAccelerationStructure  = tlas.accel;
     buildInfo.scratchData.deviceAddress = scratchAddress;
 
     // Build Offsets info: n instances
@@ -360,57 +1118,92 @@ void RaytracingBuilderKHR::cmdCreateTlas(VkCommandBuffer                      cm
 
     // Build the TLAS
     vkCmdBuildAccelerationStructuresKHR(cmdBuf, 1, &buildInfo, &pBuildOffsetInfo);
-    //scratch.destroy(VK->m_device);
+    (back ? m_tlasBackInstanceCount : m_tlasInstanceCount) = countInstance;
+
+    tlasStats.primitives  = countInstance;
+    tlasStats.buildSize   = sizeInfo.accelerationStructureSize;
+    tlasStats.scratchSize = update ? sizeInfo.updateScratchSize : sizeInfo.buildScratchSize;
+    tlasStats.flags       = flags;
 }
 
 //--------------------------------------------------------------------------------------------------
-// Refit BLAS number blasIdx from updated buffer contents.
+// Records, into cmdBuf, a refit of each BLAS in blasIds from its input's
+// updated buffer contents, or where rebuild says so, a rebuild in place.
+// Refits need the BLASes built with ALLOW_UPDATE, and rebuilds in place
+// need them uncompacted.  The refits are one build command and the
+// rebuilds another, each BLAS with its own piece of a persistent scratch
+// arena; if queryPool, timestamps firstQuery to firstQuery+2 bracket
+// the two.  The caller must know the GPU is done with the arena.
 //
-void RaytracingBuilderKHR::updateBlas(uint32_t blasIdx, BlasInput& blas, VkBuildAccelerationStructureFlagsKHR flags)
-{
-    assert (false && "Not used; Not maintained;  Probably leaks a VkDeviceMemory");
-    //printf("RaytracingBuilderKHR::updateBlas\n");
-    assert(size_t(blasIdx) < m_blas.size());
-
-    // Preparing all build information, acceleration is filled later
-    VkAccelerationStructureBuildGeometryInfoKHR buildInfos{VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR};
-    buildInfos.flags                    = flags;
-    buildInfos.geometryCount            = (uint32_t)blas.asGeometry.size();
-    buildInfos.pGeometries              = blas.asGeometry.data();
-    buildInfos.mode                     = VK_BUILD_ACCELERATION_STRUCTURE_MODE_UPDATE_KHR;  // UPDATE
-    buildInfos.type                     = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
-    buildInfos.srcAccelerationStructure = m_blas[blasIdx].accel;  // UPDATE
-    buildInfos.dstAccelerationStructure = m_blas[blasIdx].accel;
-
-    // Find size to build on the device
-    std::vector<uint32_t> maxPrimCount(blas.asBuildOffsetInfo.size());
-    for(auto tt = 0; tt < blas.asBuildOffsetInfo.size(); tt++)
-        maxPrimCount[tt] = blas.asBuildOffsetInfo[tt].primitiveCount;  // Number of primitives/triangles
-    VkAccelerationStructureBuildSizesInfoKHR sizeInfo{VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR};
-    vkGetAccelerationStructureBuildSizesKHR(m_device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &buildInfos,
-                                            maxPrimCount.data(), &sizeInfo);
-
-    // Allocate the scratch buffer and setting the scratch info
-    BufferWrap scratch = VK->createBufferWrap(sizeInfo.buildScratchSize,
-                                              VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT
-                                              | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
-                                              VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-    VkBufferDeviceAddressInfo bufferInfo{VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO};
-    bufferInfo.buffer = scratch.buffer;
-    buildInfos.scratchData.deviceAddress = vkGetBufferDeviceAddress(m_device, &bufferInfo);
-
-    std::vector<const VkAccelerationStructureBuildRangeInfoKHR*> pBuildOffset(blas.asBuildOffsetInfo.size());
-    for(size_t i = 0; i < blas.asBuildOffsetInfo.size(); i++)
-        pBuildOffset[i] = &blas.asBuildOffsetInfo[i];
-
-    VkCommandBuffer cmdBuf = VK->createTempCmdBuffer();
+void RaytracingBuilderKHR::cmdUpdateBlas(VkCommandBuffer                      cmdBuf,
+                                         const std::vector<uint32_t>&         blasIds,
+                                         const std::vector<BlasInput>&        inputs,
+                                         const std::vector<bool>&             rebuild,
+                                         VkBuildAccelerationStructureFlagsKHR flags,
+                                         VkQueryPool                          queryPool,
+                                         uint32_t                             firstQuery)
+{
+    auto align = [&](VkDeviceSize size) { return (size + m_scratchAlignment - 1) & ~(m_scratchAlignment - 1); };
+    std::vector<VkAccelerationStructureBuildGeometryInfoKHR> buildInfos(blasIds.size());
+    std::vector<VkDeviceSize> scratchOffset(blasIds.size());
+    VkDeviceSize scratchSize{0};
+    for(size_t b = 0; b < blasIds.size(); b++)
+        {
+            assert(size_t(blasIds[b]) < m_blas.size());
+            VkAccelerationStructureBuildGeometryInfoKHR& info = buildInfos[b];
+            info = {VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR};
+            info.type          = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+            info.mode          = rebuild[b] ? VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR
+                                            : VK_BUILD_ACCELERATION_STRUCTURE_MODE_UPDATE_KHR;
+            info.flags         = inputs[b].flags | flags;
+            info.geometryCount = static_cast<uint32_t>(inputs[b].asGeometry.size());
+            info.pGeometries   = inputs[b].asGeometry.data();
+            info.srcAccelerationStructure = rebuild[b] ? VK_NULL_HANDLE : m_blas[blasIds[b]].accel;
+            info.dstAccelerationStructure = m_blas[blasIds[b]].accel;
+
+            std::vector<uint32_t> maxPrimCount(inputs[b].asBuildOffsetInfo.size());
+            for(size_t tt = 0; tt < maxPrimCount.size(); tt++)
+                maxPrimCount[tt] = inputs[b].asBuildOffsetInfo[tt].primitiveCount;
+            VkAccelerationStructureBuildSizesInfoKHR sizeInfo{VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR};
+            vkGetAccelerationStructureBuildSizesKHR(m_device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
+                                                    &info, maxPrimCount.data(), &sizeInfo);
+            scratchOffset[b] = scratchSize;
+            scratchSize += align(rebuild[b] ? sizeInfo.buildScratchSize : sizeInfo.updateScratchSize);
+        }
 
-    // Update the instance buffer on the device side and build the TLAS
-    // Update the acceleration structure. Note the VK_TRUE parameter to trigger the update,
-    // and the existing BLAS being passed and updated in place
-    vkCmdBuildAccelerationStructuresKHR(cmdBuf, 1, &buildInfos, pBuildOffset.data());
+    if (scratchSize > m_updateScratchSize)
+        {
+            m_updateScratch.destroy(m_device);
+            m_updateScratch = VK->createBufferWrap(scratchSize,
+                                                   VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT
+                                                   | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                                   VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+            m_updateScratchSize = scratchSize;
+        }
+    VkBufferDeviceAddressInfo bufferInfo{VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO, nullptr,
+        m_updateScratch.buffer};
+    VkDeviceAddress scratchAddress = vkGetBufferDeviceAddress(m_device, &bufferInfo);
 
-    VK->submitTempCmdBuffer(cmdBuf);
+    // Refits first, then rebuilds
+    for (bool rebuilds : {false, true})
+        {
+            if (queryPool)
+                vkCmdWriteTimestamp(cmdBuf, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, queryPool, firstQuery++);
+            std::vector<VkAccelerationStructureBuildGeometryInfoKHR> batch;
+            std::vector<const VkAccelerationStructureBuildRangeInfoKHR*> ranges;
+            for(size_t b = 0; b < blasIds.size(); b++)
+                if (rebuild[b] == rebuilds)
+                    {
+                        buildInfos[b].scratchData.deviceAddress = scratchAddress + scratchOffset[b];
+                        batch.push_back(buildInfos[b]);
+                        ranges.push_back(inputs[b].asBuildOffsetInfo.data());
+                    }
+            if (!batch.empty())
+                vkCmdBuildAccelerationStructuresKHR(cmdBuf, static_cast<uint32_t>(batch.size()),
+                                                    batch.data(), ranges.data());
+        }
+    if (queryPool)
+        vkCmdWriteTimestamp(cmdBuf, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, queryPool, firstQuery);
 }
     
 void RaytracingBuilderKHR::buildTlas(
@@ -419,38 +1212,89 @@ void RaytracingBuilderKHR::buildTlas(
                                  bool update, bool motion)
 {
     //printf("RaytracingBuilderKHR::buildTlas (30)\n");
-    // Cannot call buildTlas twice except to update.
-    //assert(m_tlas.accel == VK_NULL_HANDLE || update);
-    uint32_t countInstance = static_cast<uint32_t>(instances.size());
+    auto startTime = std::chrono::steady_clock::now();
 
     // Command buffer to create the TLAS
+    vkResetQueryPool(m_device, m_tlasTimestamps, 0, 2);
     VkCommandBuffer    cmdBuf = VK->createTempCmdBuffer();
+    vkCmdWriteTimestamp(cmdBuf, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, m_tlasTimestamps, 0);
+    cmdBuildTlas(cmdBuf, instances, flags, update);
+    vkCmdWriteTimestamp(cmdBuf, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, m_tlasTimestamps, 1);
+    VK->submitTempCmdBuffer(cmdBuf);
+
+    uint64_t ticks[2];
+    vkGetQueryPoolResults(m_device, m_tlasTimestamps, 0, 2, sizeof(ticks), ticks, sizeof(uint64_t),
+                          VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT);
+    m_tlasStats.buildMs = (ticks[1] - ticks[0]) * VK->m_timestampPeriod * 1e-6;
+
+    m_stats.tlasSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+//--------------------------------------------------------------------------------------------------
+// Records a TLAS build, or with update a refit, into cmdBuf.  The
+// instances are written into a persistent host visible buffer, mapped
+// once, so nothing is staged or waited for here; the caller must know
+// that no earlier build still reads the buffer (the frame fence).  A
+// refit needs the same instance count as the last build and
+// ALLOW_UPDATE in both builds' flags; otherwise this rebuilds.  Returns
+// true if it refit.  With back it always rebuilds, into the back TLAS,
+// leaving m_tlas to be traced meanwhile; only the acceleration
+// structure itself is double buffered, as the instances and scratch are
+// read by builds alone.
+//
+bool RaytracingBuilderKHR::cmdBuildTlas(VkCommandBuffer                                        cmdBuf,
+                                        const std::vector<VkAccelerationStructureInstanceKHR>& instances,
+                                        VkBuildAccelerationStructureFlagsKHR                   flags,
+                                        bool                                                   update,
+                                        bool                                                   back)
+{
+    uint32_t countInstance = static_cast<uint32_t>(instances.size());
+    update = update && !back && m_tlas.accel != VK_NULL_HANDLE && countInstance == m_tlasInstanceCount
+        && hasFlag(flags, VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR);
+
+    // An empty TLAS is legal (the scene may still be loading), but its
+    // instance buffer still needs a nonzero size.
+    uint32_t capacity = std::max(countInstance, 1u);
+    if (capacity > m_instanceCapacity)
+        {
+            m_instanceBuffer.destroy(m_device);  // Unmaps it too
+            m_instanceBuffer = VK->createBufferWrap(capacity*sizeof(VkAccelerationStructureInstanceKHR),
+                                                    VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT
+                                                    | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR,
+                                                    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+                                                    | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+            vkMapMemory(m_device, m_instanceBuffer.memory, 0, VK_WHOLE_SIZE, 0, (void**)&m_instanceMapped);
+            m_instanceCapacity = capacity;
+        }
+    // Host writes before the submission are visible to it without a barrier.
+    if (countInstance > 0)
+        memcpy(m_instanceMapped, instances.data(), countInstance*sizeof(VkAccelerationStructureInstanceKHR));
 
-    // Create a buffer holding the actual instance data (matrices++) for use by the AS builder
-    BufferWrap instancesBuffer = VK->createStagedBufferWrap(cmdBuf, instances,
-                                                      VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT
-                                                  | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR);
     VkBufferDeviceAddressInfo bufferInfo{VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO, nullptr,
-        instancesBuffer.buffer};
+        m_instanceBuffer.buffer};
     VkDeviceAddress           instBufferAddr = vkGetBufferDeviceAddress(m_device, &bufferInfo);
-    
-    // Make sure the copy of the instance buffer are copied before triggering the acceleration structure build
-    VkMemoryBarrier barrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER};
-    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-    barrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
-    vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_TRANSFER_BIT,
-                         VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
-                         0, 1, &barrier, 0, nullptr, 0, nullptr);
 
     // Creating the TLAS
-    cmdCreateTlas(cmdBuf, countInstance, instBufferAddr, flags, update, motion);
-
-    // Finalizing and destroying temporary data
-    VK->submitTempCmdBuffer(cmdBuf);
-    
-    instancesBuffer.destroy(VK->m_device);
- }
+    cmdCreateTlas(cmdBuf, countInstance, instBufferAddr, flags, update, false, back);
+    return update;
+}
 
+//--------------------------------------------------------------------------------------------------
+// Makes the back TLAS current, once its build has finished and no
+// submitted work still traces the current one.
+//
+void RaytracingBuilderKHR::swapTlas()
+{
+    uint64_t ticks[2];
+    if (vkGetQueryPoolResults(m_device, m_tlasTimestamps, 0, 2, sizeof(ticks), ticks, sizeof(uint64_t),
+                              VK_QUERY_RESULT_64_BIT) == VK_SUCCESS)
+        m_tlasBackStats.buildMs = (ticks[1] - ticks[0]) * VK->m_timestampPeriod * 1e-6;
+
+    std::swap(m_tlas, m_tlasBack);
+    std::swap(m_stats.tlasBytes, m_tlasBackBytes);
+    std::swap(m_tlasInstanceCount, m_tlasBackInstanceCount);
+    std::swap(m_tlasStats, m_tlasBackStats);
+}
 
 //-------------------------------------------------------------------------------------------------
 //-------------------------------------------------------------------------------------------------
@@ -469,42 +1313,65 @@ BlasInput VkApp::objectToVkGeometryKHR(const ObjData& model)
         nullptr, model.indexBuffer.buffer};
     VkDeviceAddress indexAddress  = vkGetBufferDeviceAddress(m_device, &_b2);
 
-    uint32_t maxPrimitiveCount = model.nbIndices / 3;
-
-
-    // Describe buffer as array of Vertex.
+    // Describe buffer as array of Vertex, or as the compact layout's
+    // tightly packed position stream.
     VkAccelerationStructureGeometryTrianglesDataKHR triangles{VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_TRIANGLES_DATA_KHR};
     triangles.vertexFormat             = VK_FORMAT_R32G32B32_SFLOAT;  // vec3 vertex position data.
     triangles.vertexData.deviceAddress = vertexAddress;
-    triangles.vertexStride             = sizeof(Vertex);
-    // Describe index data (32-bit unsigned int)
-    triangles.indexType               = VK_INDEX_TYPE_UINT32;
+    triangles.vertexStride             = m_compactVertices ? sizeof(glm::vec3) : sizeof(Vertex);
+    // Describe index data (32-bit or, for small compact meshes, 16-bit unsigned int)
+    triangles.indexType               = model.indexType;
     triangles.indexData.deviceAddress = indexAddress;
     // Indicate identity transform by setting transformData to null device pointer.
     //triangles.transformData = {};
     triangles.maxVertex = model.nbVertices;
 
-    // Identify the above data as containing opaque triangles.
     VkAccelerationStructureGeometryKHR asGeom{VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR};
     asGeom.geometryType       = VK_GEOMETRY_TYPE_TRIANGLES_KHR;
-    asGeom.flags              = VK_GEOMETRY_OPAQUE_BIT_KHR;
     asGeom.geometry.triangles = triangles;
 
-    // The entire array will be used to build the BLAS.
-    VkAccelerationStructureBuildRangeInfoKHR offset;
-    offset.firstVertex     = 0;
-    offset.primitiveCount  = maxPrimitiveCount;
-    offset.primitiveOffset = 0;
-    offset.transformOffset = 0;
-
-    // Our blas is made from only one geometry, but could be made of many geometries
+    // One geometry per material range, so gl_GeometryIndexEXT identifies
+    // the material.  Each range starts primitiveOffset bytes into the
+    // shared index buffer.
+    VkDeviceSize triangleBytes = 3 * (model.indexType == VK_INDEX_TYPE_UINT16
+                                      ? sizeof(uint16_t) : sizeof(uint32_t));
     BlasInput input;
-    input.asGeometry.emplace_back(asGeom);
-    input.asBuildOffsetInfo.emplace_back(offset);
+    input.cacheKey = model.blasKey;
+    input.flags    = blasPolicy(model);
+    for (size_t g=0;  g+1<model.firstTriangle.size();  g++) {
+        // Opaque triangles skip the any-hit shader; alpha-tested ones
+        // invoke it once per candidate hit.
+        asGeom.flags = g < model.alphaTested.size() && model.alphaTested[g]
+            ? VK_GEOMETRY_NO_DUPLICATE_ANY_HIT_INVOCATION_BIT_KHR
+            : VK_GEOMETRY_OPAQUE_BIT_KHR;
+        VkAccelerationStructureBuildRangeInfoKHR offset;
+        offset.firstVertex     = 0;
+        offset.primitiveCount  = model.firstTriangle[g+1] - model.firstTriangle[g];
+        offset.primitiveOffset = static_cast<uint32_t>(model.firstTriangle[g] * triangleBytes);
+        offset.transformOffset = 0;
+        input.asGeometry.emplace_back(asGeom);
+        input.asBuildOffsetInfo.emplace_back(offset); }
+
+    // With -hostbuild, the same from the host copies, until they are
+    // released once the BLAS is built.
+    if (!model.hostPositions.empty())
+        for (VkAccelerationStructureGeometryKHR geom : input.asGeometry) {
+            geom.geometry.triangles.vertexData.hostAddress = model.hostPositions.data();
+            geom.geometry.triangles.vertexStride           = sizeof(glm::vec3);
+            geom.geometry.triangles.indexData.hostAddress  = model.hostIndices.data();
+            input.hostGeometry.push_back(geom); }
 
     return input;
 }
 
+// Frees the host copies of objects [first, last), whose BLASes are built.
+void VkApp::releaseHostGeometry(uint32_t first, uint32_t last)
+{
+    for (uint32_t o=first;  o<last;  o++) {
+        std::vector<glm::vec3>().swap(m_objData[o].hostPositions);
+        std::vector<uint8_t>().swap(m_objData[o].hostIndices); }
+}
+
 void VkApp::createRtAccelerationStructure()
 {
     //printf("VkApp::createRtAccelerationStructure (25)\n");
@@ -516,22 +1383,78 @@ void VkApp::createRtAccelerationStructure()
         // We could add more geometry in each BLAS, but we add only one for now
         allBlas.emplace_back(blas); }
 
-    m_rtBuilder.buildBlas(allBlas, VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR);
+    m_rtBuilder.buildBlas(allBlas, 0);
+    m_rtObjects   = uint32_t(m_objData.size());
+    m_rtInstances = uint32_t(m_objInst.size());
+    releaseHostGeometry(0, m_rtObjects);
+
+    createTopLevelAS();
+}
+
+// (Re)builds the TLAS over the first m_rtInstances instances, and
+// waits for it.
+void VkApp::createTopLevelAS()
+{
+    m_rtBuilder.buildTlas(tlasInstances(m_rtObjects, m_rtInstances), tlasFlags(), false, false);
+    resetRefitDrift();
+}
+
+// With -motion or -deform the TLAS is refit in place most frames.
+VkBuildAccelerationStructureFlagsKHR VkApp::tlasFlags() const
+{
+    return VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR
+        | (tlasPerFrame() ? VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR : 0);
+}
+
+// Build flags per BLAS.  One that is never updated is built for fast
+// tracing, and compacted unless it is too small to be worth the copy.
+// With -deform every BLAS is refit each frame, and rebuilt in place now
+// and then, so it allows updates and keeps its full size; it is built
+// for fast building once its rebuilds would average more than
+// FAST_BUILD_TRIANGLES triangles a frame, fast tracing otherwise.
+VkBuildAccelerationStructureFlagsKHR VkApp::blasPolicy(const ObjData& model) const
+{
+    const uint32_t COMPACT_MIN_TRIANGLES = 4096;
+    const double   FAST_BUILD_TRIANGLES  = 250000;  // Rebuilt per frame, on average
+
+    uint32_t triangles = model.nbIndices/3;
+    if (!m_deform)
+        return VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR
+            | (triangles >= COMPACT_MIN_TRIANGLES ? VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR : 0);
+
+    uint32_t period = deformRebuildPeriod();
+    if (m_deformRebuildFrames > 0)
+        period = std::min(period, m_deformRebuildFrames);
+    return VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR
+        | (double(triangles)/period > FAST_BUILD_TRIANGLES
+           ? VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_BUILD_BIT_KHR
+           : VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR);
+}
+
+// The TLAS instances of m_objInst, in order, each referencing the BLAS
+// of its current LOD.
+// The first nbInstances instances, whose objects are among the first
+// nbObjects.
+std::vector<VkAccelerationStructureInstanceKHR> VkApp::tlasInstances(uint32_t nbObjects, uint32_t nbInstances)
+{
+    // One address lookup per object rather than per instance
+    std::vector<VkDeviceAddress> blasAddress(nbObjects);
+    for (uint32_t b=0;  b<blasAddress.size();  b++)
+        blasAddress[b] = m_rtBuilder.getBlasDeviceAddress(b);
 
-    // TLAS 
     std::vector<VkAccelerationStructureInstanceKHR> tlas;
-    tlas.reserve(m_objInst.size());
-    for(const ObjInst& inst : m_objInst) {
+    tlas.reserve(nbInstances);
+    for (uint32_t i=0;  i<nbInstances;  i++) {
+        const ObjInst& inst = m_objInst[i];
+        uint32_t objIndex = lodObject(inst.objIndex, inst.lod);  // The BLAS of the instance's LOD
         VkAccelerationStructureInstanceKHR _i{};
         _i.transform = toTransformMatrixKHR(inst.transform);  // Position of the instance
-        _i.instanceCustomIndex = inst.objIndex; 
-        _i.accelerationStructureReference = m_rtBuilder.getBlasDeviceAddress(inst.objIndex);
+        _i.instanceCustomIndex = objIndex; 
+        _i.accelerationStructureReference = blasAddress[objIndex];
         _i.flags = VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR;
         _i.mask  = 0xFF;       //  Only be hit if rayMask & instance.mask != 0
         _i.instanceShaderBindingTableRecordOffset = 0; // Use the same hit group for all objects
         tlas.emplace_back(_i); }
-    
-    m_rtBuilder.buildTlas(tlas, VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR,
-                          false, false);
+    return tlas;
 }
 
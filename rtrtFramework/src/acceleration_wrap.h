@@ -1,6 +1,8 @@
 
 #pragma once
 
+#include <functional>
+#include <memory>
 #include <mutex>
 #include <vector>
 #include <vulkan/vulkan_core.h>
@@ -17,6 +19,7 @@
 
 #include "buffer_wrap.h"
 #include "image_wrap.h"
+#include "thread_pool.h"
 
 // Convert a Mat4x4 to the matrix required by acceleration structures
 inline VkTransformMatrixKHR toTransformMatrixKHR(glm::mat4 matrix)
@@ -32,8 +35,8 @@ inline VkTransformMatrixKHR toTransformMatrixKHR(glm::mat4 matrix)
 
 struct WrapAccelerationStructure
 {
-    VkAccelerationStructureKHR accel;
-    BufferWrap bw;
+    VkAccelerationStructureKHR accel{VK_NULL_HANDLE};
+    BufferWrap bw{};
 };
 
 
@@ -46,6 +49,10 @@ struct BlasInput
     std::vector<VkAccelerationStructureGeometryKHR>       asGeometry;
     std::vector<VkAccelerationStructureBuildRangeInfoKHR> asBuildOffsetInfo;
     VkBuildAccelerationStructureFlagsKHR                  flags{0};
+    uint64_t cacheKey{0};  // Hash of everything the build reads; 0 is never cached
+    // The same geometry by host address, for host builds; empty if the
+    // data is on the device only.  Shares asBuildOffsetInfo.
+    std::vector<VkAccelerationStructureGeometryKHR>       hostGeometry;
 };
 
 
@@ -55,8 +62,9 @@ class RaytracingBuilderKHR
 {
 public:
     VkApp* VK;
-    // Initializing the allocator and querying the raytracing properties
-    void setup(VkApp* _VK, const VkDevice& device, uint32_t queueIndex);
+    // Initializing the allocator and querying the raytracing properties.
+    // BLAS builds, and background TLAS builds, are submitted to buildQueue.
+    void setup(VkApp* _VK, const VkDevice& device, uint32_t queueIndex, VkQueue buildQueue);
 
     // Destroying all allocations
     void destroy();
@@ -64,15 +72,82 @@ public:
     // Returning the constructed top-level acceleration structure
     VkAccelerationStructureKHR getAccelerationStructure() const;
 
+    // With -ascache, buildBlas reads BLASes serialized by an earlier run
+    // from ascache/, and serializes the ones it builds there.
+    bool m_useCache{false};
+
+    // With -hostbuild, BLASes whose inputs have hostGeometry are built,
+    // and compacted, by host commands that this many threads join.
+    unsigned m_hostThreads{0};
+
+    // Accumulated by buildBlas; the TLAS figures are from the latest buildTlas.
+    struct Stats
+    {
+        uint32_t     blasCount{0};
+        uint32_t     blasCached{0};   // Of blasCount, read from the cache rather than built
+        double       blasSeconds{0};  // Wall time of all BLAS builds, GPU waits included
+        VkDeviceSize blasBytes{0};    // Final sizes, after compaction if requested
+        double       tlasSeconds{0};  // Of the latest blocking buildTlas
+        VkDeviceSize tlasBytes{0};    // Allocated; a rebuild that fits reuses it
+    } m_stats;
+
+    // Per acceleration structure: each BLAS as built, by id, and the
+    // TLAS as of its latest build or refit.
+    struct AsStats
+    {
+        uint32_t     primitives{0};   // Triangles, or instances for the TLAS
+        VkDeviceSize buildSize{0};    // Before compaction
+        VkDeviceSize compactSize{0};  // After compaction; 0 if not compacted
+        VkDeviceSize scratchSize{0};
+        double       buildMs{0};      // GPU time; a BLAS's share, by primitives, of its batch's
+        VkBuildAccelerationStructureFlagsKHR flags{0};
+        bool         cached{false};   // Read from the cache: buildSize is as read, and nothing else is known
+        bool         host{false};     // Built on the host: buildMs is wall time
+    };
+    std::vector<AsStats> m_blasStats;
+    AsStats              m_tlasStats;
+
     // Return the Acceleration Structure Device Address of a BLAS Id
     VkDeviceAddress getBlasDeviceAddress(uint32_t blasId);
 
-    // Create all the BLAS from the vector of BlasInput
+    // Create all the BLAS from the vector of BlasInput.  Each input's
+    // flags are combined with flags, and those requesting compaction are
+    // compacted.
     void buildBlas(const std::vector<BlasInput>&        input,
                    VkBuildAccelerationStructureFlagsKHR flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR);
 
-    // Refit BLAS number blasIdx from updated buffer contents.
-    void updateBlas(uint32_t blasIdx, BlasInput& blas, VkBuildAccelerationStructureFlagsKHR flags);
+    // The same in two steps: buildBlasDetached builds, touching nothing
+    // another thread may use, so it can run on a worker thread while
+    // frames are drawn; commitBlas, on the render thread, then appends
+    // the result to the BLASes and statistics.
+    struct BlasBuild
+    {
+        std::vector<WrapAccelerationStructure> blas;
+        std::vector<AsStats>                   stats;
+        uint32_t                               cached{0};
+        double                                 seconds{0};
+    };
+    BlasBuild buildBlasDetached(const std::vector<BlasInput>& input, VkBuildAccelerationStructureFlagsKHR flags);
+    void      commitBlas(BlasBuild& built);
+
+    // BLAS residency, for geometry streaming: serializeBlas copies
+    // BLASes out to host memory, evictBlas destroys one, leaving its id
+    // empty, and restoreBlas deserializes them back into their ids.
+    // replaceBlas puts builds from buildBlasDetached, one per id, there
+    // instead.  The address of an empty id is 0.
+    std::vector<std::vector<char>> serializeBlas(const std::vector<uint32_t>& blasIds);
+    void evictBlas(uint32_t blasId);
+    void restoreBlas(const std::vector<uint32_t>& blasIds, const std::vector<const std::vector<char>*>& serialized);
+    void replaceBlas(const std::vector<uint32_t>& blasIds, BlasBuild& built);
+
+    // Record refits, or rebuilds in place, of BLASes from updated buffer contents.
+    void cmdUpdateBlas(VkCommandBuffer                      cmdBuf,
+                       const std::vector<uint32_t>&         blasIds,
+                       const std::vector<BlasInput>&        inputs,   // One per blasIds entry
+                       const std::vector<bool>&             rebuild,  // Else refit
+                       VkBuildAccelerationStructureFlagsKHR flags,
+                       VkQueryPool                          queryPool = VK_NULL_HANDLE,
+                       uint32_t                             firstQuery = 0);
 
     // Build TLAS from an array of VkAccelerationStructureInstanceKHR
     // - Use motion=true with VkAccelerationStructureMotionInstanceNV
@@ -84,23 +159,65 @@ public:
                    bool                                 update = false,
                    bool                                 motion = false);
 
+    // Records the same into cmdBuf instead of submitting and waiting.
+    // With back, builds the back TLAS, which swapTlas makes current.
+    bool cmdBuildTlas(VkCommandBuffer                                        cmdBuf,
+                      const std::vector<VkAccelerationStructureInstanceKHR>& instances,
+                      VkBuildAccelerationStructureFlagsKHR                   flags,
+                      bool                                                   update,
+                      bool                                                   back = false);
+    void swapTlas();
+
+    // Submissions to the build queue, from command buffers of the
+    // builder's own pool.  signal, if given, is signaled on completion.
+    struct PendingSubmit
+    {
+        VkCommandBuffer cmdBuf{VK_NULL_HANDLE};
+        VkFence         fence{VK_NULL_HANDLE};
+    };
+    VkCommandBuffer createCmdBuffer();
+    PendingSubmit   submitNoWait(VkCommandBuffer cmdBuf, VkSemaphore signal = VK_NULL_HANDLE);
+    void            finish(PendingSubmit& pending);
+    bool            poll(PendingSubmit& pending);  // Finishes it if done, without waiting
+    VkQueryPool     m_tlasTimestamps{VK_NULL_HANDLE};  // Two, bracketing a blocking or back TLAS build
+
     // Creating the TLAS, called by buildTlas
     void cmdCreateTlas(VkCommandBuffer                      cmdBuf,          // Command buffer
                        uint32_t                             countInstance,   // number of instances
                        VkDeviceAddress                      instBufferAddr,  // Buffer address of instances
                        VkBuildAccelerationStructureFlagsKHR flags,           // Build creation flag
                        bool                                 update,          // Update == animation
-                       bool                                 motion           // Motion Blur
+                       bool                                 motion,          // Motion Blur
+                       bool                                 back = false     // Into the back TLAS
                        );
 
 
 protected:
     std::vector<WrapAccelerationStructure> m_blas;  // Bottom-level acceleration structure
     WrapAccelerationStructure              m_tlas;  // Top-level acceleration structure
+    uint32_t                               m_tlasInstanceCount{0};  // Of m_tlas's latest build
+
+    // The back TLAS, built while m_tlas is traced, and its counterparts
+    // of m_stats.tlasBytes, m_tlasInstanceCount and m_tlasStats.
+    WrapAccelerationStructure              m_tlasBack;
+    VkDeviceSize                           m_tlasBackBytes{0};
+    uint32_t                               m_tlasBackInstanceCount{0};
+    AsStats                                m_tlasBackStats;
+
+    // Persistent TLAS build resources, grown as needed
+    BufferWrap                         m_instanceBuffer{};  // Host visible, mapped
+    VkAccelerationStructureInstanceKHR* m_instanceMapped{nullptr};
+    uint32_t                           m_instanceCapacity{0};
+    BufferWrap                         m_tlasScratch{};
+    VkDeviceSize                       m_tlasScratchSize{0};
+    BufferWrap                         m_updateScratch{};  // For cmdUpdateBlas
+    VkDeviceSize                       m_updateScratchSize{0};
     
     // Setup
     VkDevice                 m_device{VK_NULL_HANDLE};
     uint32_t                 m_queueIndex{0};
+    VkQueue                  m_buildQueue{VK_NULL_HANDLE};
+    VkCommandPool            m_buildPool{VK_NULL_HANDLE};
 
     struct BuildAccelerationStructure
     {
@@ -108,17 +225,34 @@ protected:
         VkAccelerationStructureBuildSizesInfoKHR sizeInfo{VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR};
         const VkAccelerationStructureBuildRangeInfoKHR* rangeInfo;
         WrapAccelerationStructure as;  // result acceleration structure
-        VkAccelerationStructureKHR cleanupAS;
+        VkAccelerationStructureKHR cleanupAS{VK_NULL_HANDLE};
+        BufferWrap cleanup;            // cleanupAS's buffer
     };
 
+    VkDeviceSize m_scratchAlignment{256};  // minAccelerationStructureScratchOffsetAlignment
+    bool         m_unifiedMemory{false};   // Integrated GPU: host visible memory is device local too
+    std::unique_ptr<ThreadPool> m_hostPool;  // Joins deferred host operations; made on first use
+
+    void submitAndWait(VkCommandBuffer cmdBuf);
 
     void cmdCreateBlas(VkCommandBuffer                          cmdBuf,
-                       std::vector<uint32_t>                    indices,
+                       const std::vector<uint32_t>&             indices,
                        std::vector<BuildAccelerationStructure>& buildAs,
-                       VkDeviceAddress                          scratchAddress,
-                       VkQueryPool                              queryPool);
-    void cmdCompactBlas(VkCommandBuffer cmdBuf, std::vector<uint32_t> indices, std::vector<BuildAccelerationStructure>& buildAs, VkQueryPool queryPool);
-    void destroyNonCompacted(std::vector<uint32_t> indices, std::vector<BuildAccelerationStructure>& buildAs);
+                       bool                                     afterPrevious,
+                       VkQueryPool                              queryPool,
+                       VkQueryPool                              timestampPool,
+                       uint32_t                                 firstTimestamp);
+    void cmdCompactBlas(VkCommandBuffer cmdBuf, const std::vector<uint32_t>& indices, std::vector<BuildAccelerationStructure>& buildAs, VkQueryPool queryPool);
+    uint32_t loadCachedBlas(const std::vector<BlasInput>& input, VkBuildAccelerationStructureFlagsKHR flags,
+                            std::vector<WrapAccelerationStructure>& cached, std::vector<AsStats>& stats);
+    void saveCachedBlas(const std::vector<BlasInput>& input, VkBuildAccelerationStructureFlagsKHR flags,
+                        const std::vector<uint32_t>& indices, const std::vector<BuildAccelerationStructure>& buildAs);
+    void serializeStructures(const std::vector<VkAccelerationStructureKHR>& structures,
+                             const std::function<void(size_t, const char*, VkDeviceSize)>& consume);
+    void destroyNonCompacted(const std::vector<uint32_t>& indices, std::vector<BuildAccelerationStructure>& buildAs);
+    void hostBuildBlas(const std::vector<uint32_t>& indices, std::vector<BuildAccelerationStructure>& buildAs,
+                       std::vector<AsStats>& stats);
+    VkResult joinDeferred(VkDeferredOperationKHR operation, VkResult result);
     bool hasFlag(VkFlags item, VkFlags flag) { return (item & flag) == flag; }
 };
 
@@ -0,0 +1,134 @@
+//////////////////////////////////////////////////////////////////////
+// Alpha-tested materials.
+//
+// A textured material whose texture has an alpha channel is alpha
+// tested: texels with alpha below ALPHA_CUTOFF are holes.  Any-hit
+// shaders make holes work in the ray tracer, but they slow traversal
+// down, so at load time each such triangle is classified by
+// rasterizing its texture coordinate footprint over the alpha channel.
+// Triangles over only opaque texels stay opaque geometry, triangles
+// over only holes are dropped, and only the mixed ones, in BLAS
+// geometries of their own, invoke the any-hit shader.  See
+// ModelData::sortByMaterial.
+////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <cmath>
+
+#include "modeldata.h"
+#include "fileio.h"
+#include "stb_image.h"
+
+using namespace glm;
+
+namespace {
+
+bool isHole(uint8_t alpha) { return alpha < ALPHA_CUTOFF*255.0f; }
+
+int wrap(int i, int n) { return ((i % n) + n) % n; }
+
+// Classifies one triangle by the texels bilinear filtering could read
+// anywhere on it: those whose centers are within a texel, on each
+// axis, of a point of the triangle.  Texture coordinates repeat.
+uint8_t classifyTriangle(const AlphaMap& map, vec2 t0, vec2 t1, vec2 t2)
+{
+    vec2 size(float(map.width), float(map.height));
+    vec2 p[3] = {t0*size, t1*size, t2*size};  // Texel i spans [i, i+1)
+    vec2 lo = min(min(p[0], p[1]), p[2]);
+    vec2 hi = max(max(p[0], p[1]), p[2]);
+    int x0 = int(std::floor(lo.x - 1.5f)), x1 = int(std::ceil(hi.x + 0.5f));
+    int y0 = int(std::floor(lo.y - 1.5f)), y1 = int(std::ceil(hi.y + 0.5f));
+
+    // Footprints larger than the texture are judged by the whole texture.
+    if (int64_t(x1 - x0 + 1)*(y1 - y0 + 1) > int64_t(map.width)*map.height) {
+        if (isHole(map.maxAlpha)) return ALPHA_TRANSPARENT;
+        if (!isHole(map.minAlpha)) return ALPHA_OPAQUE;
+        return ALPHA_MIXED; }
+
+    // Edge normals pointing inwards; a degenerate triangle is tested by
+    // its bounding box alone.
+    float area = (p[1].x - p[0].x)*(p[2].y - p[0].y) - (p[2].x - p[0].x)*(p[1].y - p[0].y);
+    float orient = area > 0.0f ? 1.0f : -1.0f;
+    bool degenerate = std::abs(area) < 1e-12f;
+    vec2 n[3];
+    for (int k=0;  k<3;  k++) {
+        vec2 d = p[(k+1)%3] - p[k];
+        n[k] = orient*vec2(-d.y, d.x); }
+
+    bool sawOpaque = false, sawHole = false;
+    for (int y=y0;  y<=y1;  y++)
+        for (int x=x0;  x<=x1;  x++) {
+            // Does the square of half width 1 about the texel center
+            // reach inside all three edges?
+            vec2 c(x + 0.5f, y + 0.5f);
+            bool inside = true;
+            for (int k=0;  k<3 && inside && !degenerate;  k++)
+                inside = dot(n[k], c - p[k]) + std::abs(n[k].x) + std::abs(n[k].y) >= 0.0f;
+            if (!inside) continue;
+
+            if (isHole(map.alpha[size_t(wrap(y, map.height))*map.width + wrap(x, map.width)]))
+                sawHole = true;
+            else
+                sawOpaque = true;
+            if (sawHole && sawOpaque)
+                return ALPHA_MIXED; }
+    return sawHole && !sawOpaque ? ALPHA_TRANSPARENT : ALPHA_OPAQUE;
+}
+
+}
+
+// Reads only the image header unless the image has an alpha channel.
+AlphaMap readAlphaMap(const std::string& path)
+{
+    AlphaMap map;
+    MappedFile file;
+    int width, height, channels;
+    if (!file.open(path) || file.size == 0
+        || !stbi_info_from_memory((const stbi_uc*)file.data, int(file.size), &width, &height, &channels)
+        || (channels != 2 && channels != 4))
+        return map;
+
+    stbi_uc* pixels = stbi_load_from_memory((const stbi_uc*)file.data, int(file.size),
+                                            &width, &height, &channels, STBI_rgb_alpha);
+    if (!pixels)
+        return map;
+    map.alpha.resize(size_t(width)*height);
+    map.minAlpha = 255;
+    map.maxAlpha = 0;
+    for (size_t i=0;  i<map.alpha.size();  i++) {
+        map.alpha[i] = pixels[4*i+3];
+        map.minAlpha = std::min(map.minAlpha, map.alpha[i]);
+        map.maxAlpha = std::max(map.maxAlpha, map.alpha[i]); }
+    stbi_image_free(pixels);
+
+    // Alpha that never reaches the cutoff is as good as none.
+    if (!isHole(map.minAlpha))
+        map.alpha.clear();
+    else {
+        map.width = width;
+        map.height = height; }
+    return map;
+}
+
+std::vector<uint8_t> ModelData::classifyAlpha(const std::vector<AlphaMap>& alphaMaps) const
+{
+    auto mapOf = [&](int32_t m) -> const AlphaMap* {
+        int32_t t = materials[m].textureId;
+        if (t < 0 || size_t(t) >= alphaMaps.size() || alphaMaps[t].alpha.empty())
+            return nullptr;
+        return &alphaMaps[t]; };
+
+    bool any = false;
+    for (size_t m=0;  m<materials.size() && !any;  m++)
+        any = mapOf(int32_t(m)) != nullptr;
+    if (!any)
+        return {};
+
+    std::vector<uint8_t> alphaClass(matIndx.size(), ALPHA_OPAQUE);
+    for (size_t t=0;  t<matIndx.size();  t++)
+        if (const AlphaMap* map = mapOf(matIndx[t]))
+            alphaClass[t] = classifyTriangle(*map, vertices[indicies[3*t]].texCoord,
+                                             vertices[indicies[3*t+1]].texCoord,
+                                             vertices[indicies[3*t+2]].texCoord);
+    return alphaClass;
+}
@@ -1,5 +1,6 @@
 #include <iostream>
 #include <array>
+#include <algorithm>
 
 #ifdef __WIN32__
 #else
@@ -18,11 +19,83 @@ static void onErrorCallback(int error, const char* description)
 }
 
 #ifdef GUI
+// Acceleration structure sizes, build times and flags: totals, and a
+// row per BLAS.
+static void drawAsStats(VkApp& VK)
+{
+    const std::vector<RaytracingBuilderKHR::AsStats>& blas = VK.m_rtBuilder.m_blasStats;
+    const RaytracingBuilderKHR::AsStats& tlas = VK.m_rtBuilder.m_tlasStats;
+    if (!ImGui::CollapsingHeader("Acceleration structures"))
+        return;
+
+    VkDeviceSize built = 0, kept = 0, scratch = 0;
+    double ms = 0.0;
+    for (const RaytracingBuilderKHR::AsStats& s : blas) {
+        built += s.buildSize;
+        kept += s.compactSize ? s.compactSize : s.buildSize;
+        scratch = std::max(scratch, s.scratchSize);
+        ms += s.buildMs; }
+    ImGui::Text("BLAS: %zu, %.1f MB built, %.1f MB kept, %.1f MB largest scratch, %.2f ms GPU",
+                blas.size(), built/1048576.0, kept/1048576.0, scratch/1048576.0, ms);
+    ImGui::Text("TLAS: %u instances, %.1f MB, %.1f MB scratch, %.3f ms GPU",
+                tlas.primitives, tlas.buildSize/1048576.0, tlas.scratchSize/1048576.0, tlas.buildMs);
+
+    // A scrolling list; only the visible rows are formatted.
+    ImGui::Text("%6s %10s %10s %10s %9s  %s", "BLAS", "triangles", "built KB", "kept KB", "build ms", "flags");
+    ImGui::BeginChild("blasStats", ImVec2(0.0f, 160.0f), true);
+    ImGuiListClipper clipper;
+    clipper.Begin(int(blas.size()));
+    while (clipper.Step())
+        for (int b = clipper.DisplayStart; b < clipper.DisplayEnd; b++) {
+            const RaytracingBuilderKHR::AsStats& s = blas[b];
+            ImGui::Text("%6d %10u %10.1f %10.1f %9.3f  %s%s", b, s.primitives, s.buildSize/1024.0,
+                        (s.compactSize ? s.compactSize : s.buildSize)/1024.0, s.buildMs,
+                        asFlagNames(s.flags).c_str(), s.cached ? " (cached)" : s.host ? " (host)" : ""); }
+    ImGui::EndChild();
+}
+
 void drawGUI(VkApp& VK)
 {
     ImGui::Text("Rate %.3f ms/frame (%.1f FPS)",
                 1000.0f / ImGui::GetIO().Framerate, ImGui::GetIO().Framerate);
 
+    ImGui::Text("Vertex layout: %s%s", VK.m_compactVertices ? "compact" : "full",
+                VK.m_triAttribs ? ", triangle attributes" : "");
+    ImGui::Text("Ray traced texture LOD: %s", VK.m_rayCones ? "ray cones" : "level 0");
+    ImGui::Text("Pipelines: %.3f s to create, %s cache", VK.m_pipelineSeconds,
+                VK.m_pipelineCacheWarm ? "warm" : "cold");
+    size_t rasterDraws = 0;
+    for (const InstanceRun& run : VK.m_instanceRuns)
+        rasterDraws += VK.m_objData[run.objIndex].firstTriangle.size() - 1;
+    ImGui::Text("Objects %zu, instances %zu, raster draws %zu, emitters %zu",
+                VK.m_objData.size(), VK.m_objInst.size(),
+                rasterDraws, VK.m_emitters.size());
+    if (VK.m_instanceMotion)
+        ImGui::Text("TLAS: %u refits at %.3f ms, %u rebuilds at %.3f ms",
+                    VK.m_tlasRefits, VK.m_tlasRefits ? VK.m_tlasRefitMs/VK.m_tlasRefits : 0.0,
+                    VK.m_tlasRebuilds, VK.m_tlasRebuilds ? VK.m_tlasRebuildMs/VK.m_tlasRebuilds : 0.0);
+    if (VK.m_deform)
+        ImGui::Text("BLAS: %u refits at %.3f ms, %u rebuilds at %.3f ms each",
+                    VK.m_blasRefits, VK.m_blasRefits ? VK.m_blasRefitMs/VK.m_blasRefits : 0.0,
+                    VK.m_blasRebuilds, VK.m_blasRebuilds ? VK.m_blasRebuildMs/VK.m_blasRebuilds : 0.0);
+    drawAsStats(VK);
+    if (VK.m_lodLevels > 0)
+        ImGui::Text("LOD: %llu instanced triangles drawn", (unsigned long long)VK.m_lodTriangles);
+    if (VK.m_textureBudget > 0)
+        ImGui::Text("Texture residency: %.1f of %.1f MB",
+                    VK.m_streamedBytes/1048576.0, VK.m_textureBudget/1048576.0);
+    if (VK.m_geometryBudget > 0)
+        ImGui::Text("Geometry residency: %.1f of %.1f MB, %u evictions, %u restores",
+                    VK.m_geomResidentBytes/1048576.0, VK.m_geometryBudget/1048576.0,
+                    VK.m_geomEvictions, VK.m_geomRestores);
+    if (VK.m_editBenchCount > 0)
+        ImGui::Text("Scene edits: %u at %.3f ms, %.3f ms max", VK.m_editBenchCount,
+                    VK.m_editBenchMs/VK.m_editBenchCount, VK.m_editBenchMaxMs);
+    if (VK.m_fullyLoadedTime > 0.0)
+        ImGui::Text("Scene: first frame %.2f s, fully loaded %.2f s",
+                    VK.m_firstFrameTime, VK.m_fullyLoadedTime);
+    else
+        ImGui::Text("Scene: loading (%d pending)", VK.m_loadsInFlight.load());
     ImGui::Checkbox("Ray Tracer Mode", &VK.useRaytracer);
     ImGui::Checkbox("Denoise Mode", &VK.doDenoise);
     ImGui::SliderFloat("depthFactor", &VK.m_pcDenoise.depthFactor, 0.f, 0.01f);
@@ -177,12 +250,75 @@ void App::updateCamera(VkApp* app)
 App::App(int argc, char** argv)
 {
     doApiDump = false;
+    compactVertices = false;
+    triAttribs = false;
+    compressTextures = false;
+    asCache = false;
+    hostBuildThreads = 0;
+    rayCones = true;
+    pipelineCache = true;
+    instanceMotion = false;
+    deform = false;
+    deformRebuildFrames = 0;
+    textureBudgetMB = 0;
+    geometryBudgetMB = 0;
+    benchFrames = 0;
+    editBench = 0;
+    splitTris = 0;
+    lodLevels = 0;
+    loadThreads = 0;
 
     int argi = 1;
     while (argi<argc) {
         std::string arg = argv[argi++];
         if (arg == "-d")
             doApiDump = true;
+        else if (arg == "-compact")
+            compactVertices = true;
+        else if (arg == "-triattribs")
+            triAttribs = true;
+        else if (arg == "-bc")
+            compressTextures = true;
+        else if (arg == "-ascache")
+            asCache = true;
+        else if (arg == "-asstats" && argi<argc)
+            asStatsPath = argv[argi++];
+        else if (arg == "-hostbuild" && argi<argc)
+            hostBuildThreads = unsigned(std::stoul(argv[argi++]));
+        else if (arg == "-nocones")
+            rayCones = false;
+        else if (arg == "-nopipecache")
+            pipelineCache = false;
+        else if (arg == "-motion")
+            instanceMotion = true;
+        else if (arg == "-deform" && argi<argc) {
+            deform = true;
+            deformRebuildFrames = uint32_t(std::stoul(argv[argi++])); }
+        else if (arg == "-texbudget" && argi<argc)
+            textureBudgetMB = std::stoul(argv[argi++]);
+        else if (arg == "-geombudget" && argi<argc)
+            geometryBudgetMB = std::stoul(argv[argi++]);
+        else if (arg == "-scene" && argi<argc)
+            sceneFile = argv[argi++];
+        else if (arg == "-gen" && argi<argc)
+            genSpec = argv[argi++];
+        else if (arg == "-bench" && argi<argc)
+            benchFrames = atoi(argv[argi++]);
+        else if (arg == "-edits" && argi<argc)
+            editBench = uint32_t(std::stoul(argv[argi++]));
+        else if (arg == "-split" && argi<argc)
+            splitTris = uint32_t(std::stoul(argv[argi++]));
+        else if (arg == "-lod" && argi<argc)
+            lodLevels = atoi(argv[argi++]);
+        else if (arg == "-loadthreads" && argi<argc)
+            loadThreads = unsigned(std::stoul(argv[argi++]));
+        else if (arg == "-writeobj" && argi+1<argc) {
+            uint64_t tris = std::stoull(argv[argi]);
+            writeGeneratedObj(tris, argv[argi+1]);
+            exit(0); }
+        else if (arg == "-loadbench" && argi<argc) {
+            benchmarkModelLoaders(argv[argi]);
+            exit(0); }
         else {
             printf("Unknown argument: %s\n", arg.c_str());
             exit(-1); } }
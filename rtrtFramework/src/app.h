@@ -1,4 +1,5 @@
 
+#include <string>
 #include "camera.h"
 
 
@@ -8,6 +9,26 @@ public:
     GLFWwindow* GLFW_window;
     App(int argc, char** argv);
     bool doApiDump;
+    bool compactVertices;
+    bool triAttribs;
+    bool compressTextures;  // -bc
+    bool asCache;           // -ascache
+    std::string asStatsPath;  // -asstats file.json
+    unsigned hostBuildThreads;  // -hostbuild thread count; 0 builds BLASes on the device
+    bool rayCones;          // False with -nocones
+    bool pipelineCache;     // False with -nopipecache
+    bool instanceMotion;    // -motion
+    bool deform;            // -deform
+    uint32_t deformRebuildFrames;  // -deform BLAS rebuild period; 0 for rebuilds on deformation only
+    size_t textureBudgetMB; // -texbudget; 0 for no texture streaming
+    size_t geometryBudgetMB;  // -geombudget; 0 for no geometry streaming
+    std::string sceneFile;  // Empty for the default model
+    std::string genSpec;    // -gen parameters; non-empty to generate the scene
+    int benchFrames;        // -bench frame count; 0 for interactive use
+    uint32_t editBench;     // -edits count of scene edits to time once loaded
+    uint32_t splitTris;     // -split cluster size; 0 for one BLAS per model
+    int lodLevels;          // -lod level count; 0 for full detail only
+    unsigned loadThreads;   // -loadthreads loader pool size; 0 for one per core
     
     Camera myCamera;
     bool m_show_gui = true;
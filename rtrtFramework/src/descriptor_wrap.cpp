@@ -84,14 +84,15 @@ void DescriptorWrap::write(VkDevice& device, uint index, const VkBuffer& buffer)
 
 }
 
-void DescriptorWrap::write(VkDevice& device, uint index, const VkDescriptorImageInfo& textureDesc)
+void DescriptorWrap::write(VkDevice& device, uint index, const VkDescriptorImageInfo& textureDesc,
+                           uint arrayElement)
 {
     //VkDescriptorBufferInfo desBuf{nvbuffer.buffer, 0, VK_WHOLE_SIZE};
 
     VkWriteDescriptorSet writeSet{VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET};
     writeSet.dstSet          = descSet;
     writeSet.dstBinding      = index;
-    writeSet.dstArrayElement = 0;
+    writeSet.dstArrayElement = arrayElement;
     writeSet.descriptorCount = 1;
     writeSet.descriptorType  = bindingTable[index].descriptorType;
     writeSet.pImageInfo      = &textureDesc;
@@ -20,7 +20,8 @@ public:
 
     // Any data can be written into a descriptor set.  Apparently I need only these few types:
     void write(VkDevice& device, uint index, const VkBuffer& buffer);
-    void write(VkDevice& device, uint index, const VkDescriptorImageInfo& textureDesc);
+    void write(VkDevice& device, uint index, const VkDescriptorImageInfo& textureDesc,
+               uint arrayElement=0);
     void write(VkDevice& device, uint index, const std::vector<ImageWrap>& textures);
     void write(VkDevice& device, uint index, const VkAccelerationStructureKHR& tlas);
 };
@@ -0,0 +1,183 @@
+//////////////////////////////////////////////////////////////////////
+// The asset I/O layer: memory maps, whole-file reads, read-ahead, and
+// per-file statistics.
+////////////////////////////////////////////////////////////////////////
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <mutex>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "fileio.h"
+#include "thread_pool.h"
+
+namespace {
+
+std::mutex            statsMutex;
+std::vector<FileStat> stats;
+
+// Reads are latency bound, not CPU bound, so a few more threads than a
+// compute pool would use keep several requests outstanding.
+ThreadPool& ioPool()
+{
+    static ThreadPool pool(4);
+    return pool;
+}
+
+double secondsSince(std::chrono::high_resolution_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+void record(const std::string& path, const char* method, size_t bytes, double seconds)
+{
+    std::lock_guard<std::mutex> lock(statsMutex);
+    stats.push_back({path, method, bytes, seconds});
+}
+
+}
+
+bool MappedFile::open(const std::string& path)
+{
+    auto start = std::chrono::high_resolution_clock::now();
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                              OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE) return false;
+    m_file = file;
+    LARGE_INTEGER fileSize;
+    GetFileSizeEx(file, &fileSize);
+    size = size_t(fileSize.QuadPart);
+    if (size > 0) {
+        m_mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!m_mapping) return false;
+        data = (const char*)MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+        if (!data) return false;
+
+        // Touch every page, so the parser never waits on a page fault.
+        volatile char sink = 0;
+        for (size_t i=0;  i<size;  i+=4096)
+            sink += data[i]; }
+#else
+    m_fd = ::open(path.c_str(), O_RDONLY);
+    if (m_fd < 0) return false;
+    struct stat st;
+    if (fstat(m_fd, &st) != 0) return false;
+    size = size_t(st.st_size);
+    if (size > 0) {
+        // MAP_POPULATE reads the whole file in before returning, so the
+        // parser never waits on a page fault.
+        void* p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, m_fd, 0);
+        if (p == MAP_FAILED) return false;
+        madvise(p, size, MADV_SEQUENTIAL);
+        data = (const char*)p; }
+#endif
+    record(path, "map", size, secondsSince(start));
+    return true;
+}
+
+MappedFile::~MappedFile()
+{
+#ifdef _WIN32
+    if (data) UnmapViewOfFile(data);
+    if (m_mapping) CloseHandle(m_mapping);
+    if (m_file) CloseHandle(m_file);
+#else
+    if (data) munmap((void*)data, size);
+    if (m_fd >= 0) close(m_fd);
+#endif
+}
+
+bool fileExists(const std::string& path)
+{
+    std::error_code ec;
+    return std::filesystem::is_regular_file(path, ec);
+}
+
+bool readFile(const std::string& path, std::vector<char>& out)
+{
+    auto start = std::chrono::high_resolution_clock::now();
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file) return false;
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    out.resize(size > 0 ? size_t(size) : 0);
+    size_t got = out.empty() ? 0 : fread(out.data(), 1, out.size(), file);
+    fclose(file);
+    out.resize(got);
+
+    record(path, "read", got, secondsSince(start));
+    return true;
+}
+
+std::string tempPath(const std::string& path)
+{
+    static std::atomic<uint32_t> count{0};
+#ifdef _WIN32
+    unsigned long pid = GetCurrentProcessId();
+#else
+    unsigned long pid = (unsigned long)getpid();
+#endif
+    return path + "." + std::to_string(pid) + "." + std::to_string(count++) + ".tmp";
+}
+
+void readAhead(const std::string& path)
+{
+#if defined(_WIN32) || defined(__APPLE__)
+    // No fadvise: read the file on an I/O thread to pull it into the
+    // OS cache, and drop the bytes.
+    ioPool().submit([path]() {
+        auto start = std::chrono::high_resolution_clock::now();
+        FILE* file = fopen(path.c_str(), "rb");
+        if (!file) return;
+        static thread_local std::vector<char> block(1 << 20);
+        size_t bytes = 0, got;
+        while ((got = fread(block.data(), 1, block.size(), file)) > 0)
+            bytes += got;
+        fclose(file);
+        record(path, "readahead", bytes, secondsSince(start)); });
+#else
+    auto start = std::chrono::high_resolution_clock::now();
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return;
+    struct stat st;
+    fstat(fd, &st);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);  // Queues the reads and returns
+    close(fd);
+    record(path, "readahead", size_t(st.st_size), secondsSince(start));
+#endif
+}
+
+std::vector<FileStat> fileStats()
+{
+    std::lock_guard<std::mutex> lock(statsMutex);
+    return stats;
+}
+
+void printFileStats()
+{
+    std::vector<FileStat> all = fileStats();
+    size_t totalBytes = 0;
+    double totalSeconds = 0.0;
+    printf("File I/O:\n");
+    for (const FileStat& s : all) {
+        printf("  %-9s %10zu bytes %8.2f ms  %s\n", s.method, s.bytes, 1000.0*s.seconds,
+               s.path.c_str());
+        if (std::string(s.method) != "readahead") {
+            totalBytes += s.bytes;
+            totalSeconds += s.seconds; } }
+    printf("  %zu accesses, %zu bytes read or mapped, %.2f ms\n", all.size(), totalBytes, 1000.0*totalSeconds);
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// All asset bytes come from disk through here: shaders, scenes, models
+// (both the OBJ parser and Assimp) and textures.  Whole-file reads use
+// one sized read, large inputs are memory mapped, and readAhead lets
+// the OS fetch files that will be needed soon.  Every access is
+// recorded for printFileStats.
+
+// Read-only memory map of a whole file, paged in by open so that its
+// time is the file's read time; unmapped on destruction.
+struct MappedFile
+{
+    const char* data{nullptr};
+    size_t      size{0};
+
+    MappedFile() = default;
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool open(const std::string& path);
+
+private:
+#ifdef _WIN32
+    void* m_file{nullptr};
+    void* m_mapping{nullptr};
+#else
+    int m_fd{-1};
+#endif
+};
+
+bool fileExists(const std::string& path);
+
+// Reads a whole file into out; false if it cannot be opened.
+bool readFile(const std::string& path, std::vector<char>& out);
+
+// Hints that path will be read soon, without waiting for it.
+void readAhead(const std::string& path);
+
+// A temporary file name beside path, unique to this process and call,
+// to write to and then rename over path.
+std::string tempPath(const std::string& path);
+
+struct FileStat
+{
+    std::string path;
+    const char* method;   // "read", "map" or "readahead"
+    size_t      bytes;
+    double      seconds;  // Open to last byte, for maps too
+};
+
+std::vector<FileStat> fileStats();
+void printFileStats();
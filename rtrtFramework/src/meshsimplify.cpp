@@ -0,0 +1,217 @@
+//////////////////////////////////////////////////////////////////////
+// Quadric error mesh simplification (Garland and Heckbert, "Surface
+// Simplification Using Quadric Error Metrics", 1997), used to build the
+// LOD chains of VkApp::queueLoadedModel.
+//
+// The loaders emit a vertex per triangle corner, so corners are first
+// welded by position.  Edges of the welded mesh are then collapsed in
+// order of quadric error until the target triangle count is reached,
+// refusing collapses that would flip a neighbouring triangle.  Each
+// surviving corner keeps its original normal and texture coordinate and
+// takes the moved position, so UV seams and hard edges survive.
+////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <queue>
+#include <utility>
+#include <unordered_map>
+#include <vector>
+
+#include "modeldata.h"
+
+using namespace glm;
+
+namespace {
+
+// Symmetric 4x4 quadric, upper triangle only.
+struct Quadric
+{
+    double a[10] = {};
+
+    static Quadric plane(dvec3 n, double d)
+    {
+        Quadric q;
+        q.a[0] = n.x*n.x;  q.a[1] = n.x*n.y;  q.a[2] = n.x*n.z;  q.a[3] = n.x*d;
+        q.a[4] = n.y*n.y;  q.a[5] = n.y*n.z;  q.a[6] = n.y*d;
+        q.a[7] = n.z*n.z;  q.a[8] = n.z*d;
+        q.a[9] = d*d;
+        return q;
+    }
+
+    Quadric& operator+=(const Quadric& o)
+    {
+        for (int i=0;  i<10;  i++) a[i] += o.a[i];
+        return *this;
+    }
+
+    double error(const vec3& p) const
+    {
+        double x = p.x, y = p.y, z = p.z;
+        return a[0]*x*x + 2*a[1]*x*y + 2*a[2]*x*z + 2*a[3]*x
+            + a[4]*y*y + 2*a[5]*y*z + 2*a[6]*y
+            + a[7]*z*z + 2*a[8]*z + a[9];
+    }
+};
+
+const size_t MAX_VALENCE = 24;  // Triangles around a collapsed vertex, counted before
+
+struct Collapse
+{
+    double   cost;
+    uint32_t u, v;        // Collapse u into v
+    uint32_t uVer, vVer;  // Vertex versions when queued; stale if changed
+    vec3     pos;
+    bool operator<(const Collapse& o) const { return cost > o.cost; }  // Min heap
+};
+
+}
+
+ModelData ModelData::simplify(size_t targetTris) const
+{
+    size_t nbTris = matIndx.size();
+
+    // Weld corners by exact position.
+    struct PosHash {
+        size_t operator()(const vec3& p) const {
+            vec3 q = p + vec3(0.0f);  // -0 and +0 compare equal, so must hash equal
+            uint32_t b[3];
+            memcpy(b, &q, sizeof(b));
+            return size_t(b[0])*73856093u ^ size_t(b[1])*19349663u ^ size_t(b[2])*83492791u; } };
+    std::unordered_map<vec3, uint32_t, PosHash> weldMap;
+    std::vector<uint32_t> weld(vertices.size());
+    std::vector<vec3> pos;
+    for (size_t k=0;  k<vertices.size();  k++) {
+        auto found = weldMap.emplace(vertices[k].pos, uint32_t(pos.size()));
+        if (found.second) pos.push_back(vertices[k].pos);
+        weld[k] = found.first->second; }
+    size_t nbWelded = pos.size();
+
+    std::vector<uint32_t> tri(3*nbTris);   // Welded vertex of each corner
+    std::vector<bool> triDead(nbTris, false);
+    std::vector<Quadric> quadric(nbWelded);
+    std::vector<std::vector<uint32_t>> vertTris(nbWelded);
+    size_t live = 0;
+    for (size_t t=0;  t<nbTris;  t++) {
+        for (int j=0;  j<3;  j++)
+            tri[3*t+j] = weld[indicies[3*t+j]];
+        uint32_t a = tri[3*t], b = tri[3*t+1], c = tri[3*t+2];
+        if (a == b || b == c || c == a) {
+            triDead[t] = true;
+            continue; }
+        dvec3 n = cross(dvec3(pos[b]) - dvec3(pos[a]), dvec3(pos[c]) - dvec3(pos[a]));
+        double len = length(n);
+        if (len > 0.0) {
+            // Area weighted plane
+            Quadric q = Quadric::plane(n/len, -dot(n/len, dvec3(pos[a])));
+            for (double& x : q.a) x *= 0.5*len;
+            quadric[a] += q;  quadric[b] += q;  quadric[c] += q; }
+        vertTris[a].push_back(uint32_t(t));
+        vertTris[b].push_back(uint32_t(t));
+        vertTris[c].push_back(uint32_t(t));
+        live++; }
+
+    std::vector<uint32_t> version(nbWelded, 0);
+    std::vector<bool> vertDead(nbWelded, false);
+    std::priority_queue<Collapse> heap;
+
+    auto queueEdge = [&](uint32_t u, uint32_t v) {
+        Quadric q = quadric[u];
+        q += quadric[v];
+        vec3 candidates[3] = {pos[u], pos[v], 0.5f*(pos[u] + pos[v])};
+        Collapse best{q.error(candidates[0]), u, v, version[u], version[v], candidates[0]};
+        for (int i=1;  i<3;  i++) {
+            double e = q.error(candidates[i]);
+            if (e < best.cost) { best.cost = e;  best.pos = candidates[i]; } }
+        heap.push(best); };
+
+    std::vector<std::pair<uint32_t,uint32_t>> edges;
+    for (size_t t=0;  t<nbTris;  t++)
+        if (!triDead[t])
+            for (int j=0;  j<3;  j++) {
+                uint32_t a = tri[3*t+j], b = tri[3*t+(j+1)%3];
+                edges.push_back({std::min(a, b), std::max(a, b)}); }
+    std::sort(edges.begin(), edges.end());
+    edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+    for (auto& edge : edges)
+        queueEdge(edge.first, edge.second);
+    edges = {};
+
+    // Would moving vertex w to p flip any of its triangles other than
+    // those containing both u and v (which collapse away)?
+    auto flips = [&](uint32_t w, uint32_t other, const vec3& p) {
+        for (uint32_t t : vertTris[w]) {
+            if (triDead[t]) continue;
+            const uint32_t* c = &tri[3*t];
+            if (c[0] == other || c[1] == other || c[2] == other) continue;
+            vec3 before = cross(pos[c[1]] - pos[c[0]], pos[c[2]] - pos[c[0]]);
+            vec3 q[3] = {pos[c[0]], pos[c[1]], pos[c[2]]};
+            for (int j=0;  j<3;  j++) if (c[j] == w) q[j] = p;
+            vec3 after = cross(q[1] - q[0], q[2] - q[0]);
+            if (dot(before, after) <= 0.0f) return true; }
+        return false; };
+
+    while (live > targetTris && !heap.empty()) {
+        Collapse e = heap.top();
+        heap.pop();
+        if (vertDead[e.u] || vertDead[e.v] || version[e.u] != e.uVer || version[e.v] != e.vVer)
+            continue;
+        // Flat regions have zero error everywhere; without a valence
+        // limit they collapse into huge fans, which are slow to update
+        // and make slivers.
+        if (vertTris[e.u].size() + vertTris[e.v].size() > MAX_VALENCE)
+            continue;
+        if (flips(e.u, e.v, e.pos) || flips(e.v, e.u, e.pos))
+            continue;
+
+        uint32_t u = e.u, v = e.v;
+        pos[v] = e.pos;
+        quadric[v] += quadric[u];
+        vertDead[u] = true;
+        version[v]++;
+
+        for (uint32_t t : vertTris[u]) {
+            if (triDead[t]) continue;
+            uint32_t* c = &tri[3*t];
+            for (int j=0;  j<3;  j++) if (c[j] == u) c[j] = v;
+            if (c[0] == c[1] || c[1] == c[2] || c[2] == c[0]) {
+                triDead[t] = true;
+                live--; }
+            else
+                vertTris[v].push_back(t); }
+        vertTris[u].clear();
+
+        // Drop dead triangles from v's list and requeue its edges.
+        auto& vt = vertTris[v];
+        vt.erase(std::remove_if(vt.begin(), vt.end(), [&](uint32_t t) { return triDead[t]; }), vt.end());
+        std::vector<uint32_t> neighbours;
+        for (uint32_t t : vt)
+            for (int j=0;  j<3;  j++)
+                if (tri[3*t+j] != v) neighbours.push_back(tri[3*t+j]);
+        std::sort(neighbours.begin(), neighbours.end());
+        neighbours.erase(std::unique(neighbours.begin(), neighbours.end()), neighbours.end());
+        for (uint32_t n : neighbours)
+            queueEdge(v, n); }
+
+    // Emit the survivors: each original corner vertex once, at its
+    // welded vertex's final position.  Every use of a corner was
+    // redirected by the same collapses, so they all agree on it.
+    ModelData lod;
+    lod.materials = materials;
+    lod.textures = textures;
+    std::vector<uint32_t> remap(vertices.size(), UINT32_MAX);
+    for (size_t t=0;  t<nbTris;  t++) {
+        if (triDead[t]) continue;
+        for (int j=0;  j<3;  j++) {
+            uint32_t k = indicies[3*t+j];
+            uint32_t w = tri[3*t+j];
+            if (remap[k] == UINT32_MAX) {
+                remap[k] = uint32_t(lod.vertices.size());
+                Vertex vert = vertices[k];
+                vert.pos = pos[w];
+                lod.vertices.push_back(vert); }
+            lod.indicies.push_back(remap[k]); }
+        lod.matIndx.push_back(matIndx[t]); }
+    return lod;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#define GLM_FORCE_RADIANS
+#define GLM_SWIZZLE
+#include <glm/glm.hpp>
+
+#include "shaders/shared_structs.h"
+
+// A texture's alpha channel, for classifying the triangles of
+// alpha-tested materials (alphatest.cpp).  Empty if no texel is a hole.
+struct AlphaMap
+{
+    int width{0}, height{0};
+    std::vector<uint8_t> alpha;
+    uint8_t minAlpha{255}, maxAlpha{255};
+};
+AlphaMap readAlphaMap(const std::string& path);
+
+enum AlphaClass : uint8_t { ALPHA_OPAQUE, ALPHA_MIXED, ALPHA_TRANSPARENT };
+
+// A model as read from disk: all meshes merged into one pre-transformed
+// triangle list.  Filled and sorted by material on a loader thread, then
+// handed to VkApp::uploadModel on the main thread.
+struct ModelData
+{
+    std::vector<Vertex> vertices;
+    std::vector<uint32_t> indicies;
+    std::vector<Material> materials;
+    std::vector<int32_t>     matIndx;
+    std::vector<std::string> textures;
+    std::vector<uint32_t>    firstTriangle;  // After sortByMaterial: materials[g]'s triangles start here, plus an end sentinel
+    std::vector<bool>        alphaTested;    // After sortByMaterial: true if range g needs the any-hit shader
+
+    void readModelFile(const std::string& path, const glm::mat4& M);  // OBJ natively, else Assimp
+    void readAssimpFile(const std::string& path, const glm::mat4& M);
+    bool readObjFile(const std::string& path, const glm::mat4& M);     // objloader.cpp
+    void sortByMaterial(const std::vector<AlphaMap>& alphaMaps = {});
+    std::vector<uint8_t> classifyAlpha(const std::vector<AlphaMap>& alphaMaps) const;  // alphatest.cpp; empty if nothing is alpha tested
+    std::vector<ModelData> splitSpatially(uint32_t maxTris) const;  // modelsplit.cpp
+    ModelData simplify(size_t targetTris) const;                    // meshsimplify.cpp
+    void packCompact(std::vector<glm::vec3>& positions, std::vector<VertexAttrib>& attribs) const;
+    void packTriAttribs(std::vector<TriAttrib>& triAttribs) const;
+};
+
+// Command line utilities (vkapp_benchmark.cpp), run by App in place of the renderer.
+void writeGeneratedObj(uint64_t tris, const std::string& path);
+void benchmarkModelLoaders(const std::string& path);
@@ -0,0 +1,146 @@
+//////////////////////////////////////////////////////////////////////
+// Splitting a merged model into spatially coherent clusters, each of
+// which becomes its own object, and so its own BLAS.
+//
+// The split is a top-down binned SAH partition of the triangles,
+// stopping once a cluster holds at most maxTris triangles.  Walls and
+// small props then land in separate, tighter hierarchies, and each
+// cluster can be refit or streamed on its own.
+////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <cfloat>
+#include <utility>
+#include <vector>
+
+#include "modeldata.h"
+
+using namespace glm;
+
+namespace {
+
+struct Bounds
+{
+    vec3 lo{FLT_MAX};
+    vec3 hi{-FLT_MAX};
+
+    void grow(const vec3& p) { lo = min(lo, p);  hi = max(hi, p); }
+    void grow(const Bounds& b) { lo = min(lo, b.lo);  hi = max(hi, b.hi); }
+    float area() const
+    {
+        if (lo.x > hi.x) return 0.0f;
+        vec3 d = hi - lo;
+        return 2.0f*(d.x*d.y + d.y*d.z + d.z*d.x);
+    }
+};
+
+const int NBINS = 16;
+
+}
+
+std::vector<ModelData> ModelData::splitSpatially(uint32_t maxTris) const
+{
+    size_t nbTris = matIndx.size();
+    std::vector<Bounds> triBounds(nbTris);
+    std::vector<vec3> centroids(nbTris);
+    for (size_t t=0;  t<nbTris;  t++) {
+        for (int j=0;  j<3;  j++)
+            triBounds[t].grow(vertices[indicies[3*t+j]].pos);
+        centroids[t] = 0.5f*(triBounds[t].lo + triBounds[t].hi); }
+
+    std::vector<uint32_t> order(nbTris);
+    for (size_t t=0;  t<nbTris;  t++)
+        order[t] = uint32_t(t);
+
+    // Partition order[] into leaves by repeatedly splitting the largest
+    // pending range where the SAH cost over NBINS centroid bins per axis
+    // is lowest.
+    std::vector<std::pair<size_t,size_t>> pending{{0, nbTris}}, leaves;
+    while (!pending.empty()) {
+        auto [begin, end] = pending.back();
+        pending.pop_back();
+        if (end - begin <= maxTris) {
+            leaves.push_back({begin, end});
+            continue; }
+
+        Bounds cb;
+        for (size_t i=begin;  i<end;  i++)
+            cb.grow(centroids[order[i]]);
+
+        float bestCost = FLT_MAX;
+        int bestAxis = -1, bestBin = 0;
+        for (int axis=0;  axis<3;  axis++) {
+            float extent = cb.hi[axis] - cb.lo[axis];
+            if (extent <= 0.0f) continue;
+            Bounds binBounds[NBINS];
+            size_t binCount[NBINS] = {};
+            for (size_t i=begin;  i<end;  i++) {
+                uint32_t t = order[i];
+                int b = std::min(NBINS-1, int(NBINS*(centroids[t][axis] - cb.lo[axis])/extent));
+                binBounds[b].grow(triBounds[t]);
+                binCount[b]++; }
+
+            // Sweep from the right for suffix areas, then from the left.
+            float rightArea[NBINS];
+            size_t rightCount[NBINS];
+            Bounds acc;
+            size_t count = 0;
+            for (int b=NBINS-1;  b>0;  b--) {
+                acc.grow(binBounds[b]);
+                count += binCount[b];
+                rightArea[b] = acc.area();
+                rightCount[b] = count; }
+            acc = Bounds();
+            count = 0;
+            for (int b=0;  b<NBINS-1;  b++) {
+                acc.grow(binBounds[b]);
+                count += binCount[b];
+                if (count == 0 || rightCount[b+1] == 0) continue;
+                float cost = acc.area()*count + rightArea[b+1]*rightCount[b+1];
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestBin = b; } } }
+
+        size_t mid;
+        if (bestAxis >= 0) {
+            float lo = cb.lo[bestAxis], extent = cb.hi[bestAxis] - lo;
+            auto* it = std::partition(order.data() + begin, order.data() + end, [&](uint32_t t) {
+                int b = std::min(NBINS-1, int(NBINS*(centroids[t][bestAxis] - lo)/extent));
+                return b <= bestBin; });
+            mid = it - order.data(); }
+        else {
+            // All centroids coincide: any even split is as good as another.
+            mid = begin + (end - begin)/2; }
+
+        pending.push_back({begin, mid});
+        pending.push_back({mid, end}); }
+
+    // Each leaf becomes a model holding just the vertices its triangles
+    // use.  Materials and textures are copied whole so textureIds and
+    // the shared texture slots stay valid; sortByMaterial later drops
+    // the unused materials.
+    std::vector<ModelData> clusters(leaves.size());
+    std::vector<uint32_t> remap(vertices.size(), UINT32_MAX);
+    for (size_t c=0;  c<leaves.size();  c++) {
+        ModelData& cluster = clusters[c];
+        cluster.materials = materials;
+        cluster.textures = textures;
+        for (size_t i=leaves[c].first;  i<leaves[c].second;  i++) {
+            uint32_t t = order[i];
+            for (int j=0;  j<3;  j++) {
+                uint32_t v = indicies[3*t+j];
+                if (remap[v] == UINT32_MAX) {
+                    remap[v] = uint32_t(cluster.vertices.size());
+                    cluster.vertices.push_back(vertices[v]); }
+                cluster.indicies.push_back(remap[v]); }
+            cluster.matIndx.push_back(matIndx[t]); }
+
+        // Clusters share vertices, so the next starts from a clean map,
+        // reset through the original vertex ids.
+        for (size_t i=leaves[c].first;  i<leaves[c].second;  i++)
+            for (int j=0;  j<3;  j++)
+                remap[indicies[3*order[i]+j]] = UINT32_MAX;
+    }
+    return clusters;
+}
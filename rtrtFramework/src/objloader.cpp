@@ -0,0 +1,420 @@
+//////////////////////////////////////////////////////////////////////
+// A native Wavefront OBJ/MTL reader, used instead of Assimp for .obj
+// files.  The file is memory mapped and cut into line-aligned chunks
+// which are parsed in parallel: a first pass counts each chunk's v, vt
+// and vn lines so a second pass can resolve face indices and write
+// attributes straight into their final place.  The result matches
+// readAssimpFile: one vertex per triangle corner, fan-triangulated
+// faces, smooth normals generated when the file has none, and the same
+// Material translation.
+////////////////////////////////////////////////////////////////////////
+
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <filesystem>
+namespace fs = std::filesystem;
+
+#include "fileio.h"
+#include "modeldata.h"
+#include "thread_pool.h"
+
+using namespace glm;
+
+////////////////////////////////////////////////////////////////////////
+// Low level scanning; p always stays within [p,end).
+
+static inline bool isSpace(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+static inline bool isDigit(char c) { return c >= '0' && c <= '9'; }
+
+static inline const char* skipSpace(const char* p, const char* end)
+{
+    while (p < end && isSpace(*p)) p++;
+    return p;
+}
+
+static inline const char* nextLine(const char* p, const char* end)
+{
+    const char* nl = (const char*)memchr(p, '\n', end - p);
+    return nl ? nl+1 : end;
+}
+
+// Parses [+-]digits[.digits][(e|E)[+-]digits] without locale or
+// allocation; far faster than strtof on large files.
+static float parseFloat(const char*& p, const char* end)
+{
+    static const double pow10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+                                   1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19,
+                                   1e20, 1e21, 1e22};
+    p = skipSpace(p, end);
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = *p++ == '-';
+
+    uint64_t mantissa = 0;
+    int scale = 0;
+    int digits = 0;
+    for (;  p < end && isDigit(*p);  p++)
+        if (digits < 19) { mantissa = mantissa*10 + (*p - '0');  digits++; }
+        else scale++;
+    if (p < end && *p == '.')
+        for (p++;  p < end && isDigit(*p);  p++)
+            if (digits < 19) { mantissa = mantissa*10 + (*p - '0');  digits++;  scale--; }
+
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        bool negExp = false;
+        if (p < end && (*p == '-' || *p == '+'))
+            negExp = *p++ == '-';
+        int exponent = 0;
+        for (;  p < end && isDigit(*p);  p++)
+            exponent = std::min(exponent*10 + (*p - '0'), 1000);
+        scale += negExp ? -exponent : exponent; }
+
+    double value = double(mantissa);
+    if (scale < 0)
+        value = -scale <= 22 ? value/pow10[-scale] : value*std::pow(10.0, scale);
+    else if (scale > 0)
+        value = scale <= 22 ? value*pow10[scale] : value*std::pow(10.0, scale);
+    return float(negative ? -value : value);
+}
+
+static int64_t parseInt(const char*& p, const char* end)
+{
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = *p++ == '-';
+    int64_t value = 0;
+    for (;  p < end && isDigit(*p);  p++)
+        value = value*10 + (*p - '0');
+    return negative ? -value : value;
+}
+
+// The rest of the line, trimmed.
+static std::string restOfLine(const char* p, const char* end)
+{
+    p = skipSpace(p, end);
+    const char* e = p;
+    while (e < end && *e != '\n') e++;
+    while (e > p && isSpace(e[-1])) e--;
+    return std::string(p, e);
+}
+
+// Does the line at p start with keyword followed by whitespace?
+static inline bool keyword(const char* p, const char* end, const char* word, size_t len)
+{
+    return size_t(end - p) > len && memcmp(p, word, len) == 0 && isSpace(p[len]);
+}
+
+////////////////////////////////////////////////////////////////////////
+// Parallel OBJ parsing
+
+struct ObjChunk
+{
+    const char* begin;
+    const char* end;
+
+    // Pass 1: attribute counts, then their prefix sums over earlier chunks
+    size_t nbV{0}, nbVt{0}, nbVn{0};
+    size_t baseV{0}, baseVt{0}, baseVn{0};
+
+    // Pass 2: (v, vt, vn) per triangle corner, 0-based, -1 if absent
+    std::vector<ivec3> corners;
+    std::vector<int>   triMaterial;   // Index into mtlNames; -1 until this chunk's first usemtl
+    std::vector<std::string> mtlNames;
+    std::vector<std::string> mtllibs;
+    size_t baseTri{0};
+    size_t badFaces{0};               // Skipped for an index of 0 or out of range
+};
+
+static void countChunk(ObjChunk& c)
+{
+    for (const char* p = c.begin;  p < c.end;  p = nextLine(p, c.end)) {
+        p = skipSpace(p, c.end);
+        if (p+1 >= c.end || *p != 'v') continue;
+        if (isSpace(p[1])) c.nbV++;
+        else if (p[1] == 't' && p+2 < c.end && isSpace(p[2])) c.nbVt++;
+        else if (p[1] == 'n' && p+2 < c.end && isSpace(p[2])) c.nbVn++; }
+}
+
+static void parseChunk(ObjChunk& c, std::vector<vec3>& positions,
+                       std::vector<vec2>& texCoords, std::vector<vec3>& normals)
+{
+    size_t v = c.baseV, vt = c.baseVt, vn = c.baseVn;
+    int material = -1;
+    std::vector<ivec3> face;
+
+    // OBJ indices are 1-based, or negative to count back from the
+    // latest attribute.  0, or one outside the file's attributes, makes
+    // the face bad.
+    bool bad = false;
+    auto resolve = [&bad](int64_t i, size_t current, size_t count) -> int {
+        int64_t k = i > 0 ? i-1 : int64_t(current) + i;
+        if (i == 0 || k < 0 || k >= int64_t(count)) {
+            bad = true;
+            return 0; }
+        return int(k); };
+
+    for (const char* p = c.begin;  p < c.end;  p = nextLine(p, c.end)) {
+        p = skipSpace(p, c.end);
+        if (p >= c.end) break;
+
+        if (*p == 'v' && p+1 < c.end) {
+            if (isSpace(p[1])) {
+                p += 1;
+                vec3& pos = positions[v++];
+                pos.x = parseFloat(p, c.end);
+                pos.y = parseFloat(p, c.end);
+                pos.z = parseFloat(p, c.end); }
+            else if (p[1] == 't') {
+                p += 2;
+                vec2& uv = texCoords[vt++];
+                uv.x = parseFloat(p, c.end);
+                uv.y = parseFloat(p, c.end); }
+            else if (p[1] == 'n') {
+                p += 2;
+                vec3& nrm = normals[vn++];
+                nrm.x = parseFloat(p, c.end);
+                nrm.y = parseFloat(p, c.end);
+                nrm.z = parseFloat(p, c.end); } }
+
+        else if (*p == 'f' && p+1 < c.end && isSpace(p[1])) {
+            p += 1;
+            face.clear();
+            bad = false;
+            for (;;) {
+                p = skipSpace(p, c.end);
+                if (p >= c.end || !(isDigit(*p) || *p == '-')) break;
+                ivec3 corner(-1);
+                corner.x = resolve(parseInt(p, c.end), v, positions.size());
+                if (p < c.end && *p == '/') {
+                    p++;
+                    if (p < c.end && *p != '/')
+                        corner.y = resolve(parseInt(p, c.end), vt, texCoords.size());
+                    if (p < c.end && *p == '/') {
+                        p++;
+                        corner.z = resolve(parseInt(p, c.end), vn, normals.size()); } }
+                face.push_back(corner);
+                while (p < c.end && !isSpace(*p) && *p != '\n') p++; }
+
+            if (bad) {
+                c.badFaces++;
+                continue; }
+            for (size_t i=2;  i<face.size();  i++) {
+                c.corners.push_back(face[0]);
+                c.corners.push_back(face[i-1]);
+                c.corners.push_back(face[i]);
+                c.triMaterial.push_back(material); } }
+
+        else if (keyword(p, c.end, "usemtl", 6)) {
+            std::string name = restOfLine(p+6, c.end);
+            material = -1;
+            for (size_t m=0;  m<c.mtlNames.size();  m++)
+                if (c.mtlNames[m] == name) material = int(m);
+            if (material < 0) {
+                material = int(c.mtlNames.size());
+                c.mtlNames.push_back(name); } }
+
+        else if (keyword(p, c.end, "mtllib", 6))
+            c.mtllibs.push_back(restOfLine(p+6, c.end));
+    }
+}
+
+////////////////////////////////////////////////////////////////////////
+// MTL parsing and translation to Material
+
+struct MtlRecord
+{
+    std::string name;
+    vec3 Kd{0.5f}, Ks{0.03f}, Ke{0.0f};
+    float Ns{20.0f};
+    std::string mapKd;
+};
+
+static void readMtlFile(const std::string& path, std::vector<MtlRecord>& records)
+{
+    MappedFile file;
+    if (!file.open(path)) {
+        printf("Material file not found: %s\n", path.c_str());
+        return; }
+    const char* end = file.data + file.size;
+    auto readVec3 = [end](const char* p) {
+        vec3 c;
+        c.x = parseFloat(p, end);  c.y = parseFloat(p, end);  c.z = parseFloat(p, end);
+        return c; };
+
+    for (const char* p = file.data;  p < end;  p = nextLine(p, end)) {
+        p = skipSpace(p, end);
+        if (keyword(p, end, "newmtl", 6)) {
+            records.emplace_back();
+            records.back().name = restOfLine(p+6, end);
+            continue; }
+        if (records.empty()) continue;
+        MtlRecord& r = records.back();
+        if      (keyword(p, end, "Kd", 2)) r.Kd = readVec3(p+2);
+        else if (keyword(p, end, "Ks", 2)) r.Ks = readVec3(p+2);
+        else if (keyword(p, end, "Ke", 2)) r.Ke = readVec3(p+2);
+        else if (keyword(p, end, "Ns", 2)) { p += 2;  r.Ns = parseFloat(p, end); }
+        else if (keyword(p, end, "map_Kd", 6)) {
+            // Options such as "-bm 1" may precede the file name.
+            std::string arg = restOfLine(p+6, end);
+            if (!arg.empty() && arg[0] == '-') {
+                size_t lastSpace = arg.find_last_of(" \t");
+                arg = lastSpace == std::string::npos ? "" : arg.substr(lastSpace+1); }
+            r.mapKd = arg; } }
+}
+
+// Same rules as readAssimpFile.
+static Material translateMaterial(const MtlRecord& r)
+{
+    Material newmat;
+    if (dot(r.Ke, r.Ke) > 0.0f) { // An emitter
+        newmat.diffuse = {1,1,1};
+        newmat.specular = {0,0,0};
+        newmat.shininess = 0.0;
+        newmat.emission = r.Ke;
+        newmat.textureId = -1; }
+    else {
+        newmat.diffuse = r.Kd;
+        newmat.specular = r.Ks;
+        newmat.shininess = r.Ns;
+        newmat.emission = {0,0,0};
+        newmat.textureId = -1; }
+    return newmat;
+}
+
+////////////////////////////////////////////////////////////////////////
+
+bool ModelData::readObjFile(const std::string& path, const mat4& M)
+{
+    printf("ReadObjFile File:  %s \n", path.c_str());
+    MappedFile file;
+    if (!file.open(path))
+        return false;
+    const char* end = file.data + file.size;
+
+    // Line-aligned chunks of about 4MB, at least one per thread.
+    size_t nbThreads = std::max(1u, std::thread::hardware_concurrency());
+    size_t chunkSize = std::max<size_t>(std::min<size_t>(file.size/nbThreads + 1, 4u<<20), 1u<<16);
+    std::vector<ObjChunk> chunks;
+    for (const char* p = file.data;  p < end; ) {
+        const char* e = p + std::min<size_t>(chunkSize, end - p);
+        if (e < end) e = nextLine(e, end);
+        chunks.push_back({p, e});
+        p = e; }
+
+    parallelFor(chunks.size(), [&](size_t i) { countChunk(chunks[i]); });
+
+    size_t nbV = 0, nbVt = 0, nbVn = 0;
+    for (ObjChunk& c : chunks) {
+        c.baseV = nbV;    nbV += c.nbV;
+        c.baseVt = nbVt;  nbVt += c.nbVt;
+        c.baseVn = nbVn;  nbVn += c.nbVn; }
+
+    std::vector<vec3> positions(nbV), normals(nbVn);
+    std::vector<vec2> texCoords(nbVt);
+    parallelFor(chunks.size(), [&](size_t i) {
+        parseChunk(chunks[i], positions, texCoords, normals); });
+
+    // Materials: from every mtllib, then a default for faces before any usemtl.
+    std::vector<MtlRecord> records;
+    for (const ObjChunk& c : chunks)
+        for (const std::string& lib : c.mtllibs) {
+            fs::path mtlPath = path;
+            mtlPath.replace_filename(lib);
+            readMtlFile(mtlPath.u8string(), records); }
+
+    std::unordered_map<std::string, int> materialByName;
+    std::unordered_map<std::string, int> textureByName;
+    for (const MtlRecord& r : records) {
+        Material mat = translateMaterial(r);
+        if (!r.mapKd.empty()) {
+            fs::path fullPath = path;
+            fullPath.replace_filename(r.mapKd);
+            std::string texName = fullPath.u8string();
+            auto found = textureByName.find(texName);
+            if (found == textureByName.end()) {
+                found = textureByName.emplace(texName, int(textures.size())).first;
+                textures.push_back(texName); }
+            mat.textureId = found->second; }
+        materialByName.emplace(r.name, int(materials.size()));
+        materials.push_back(mat); }
+
+    int defaultMaterial = -1;
+    auto getDefaultMaterial = [&]() {
+        if (defaultMaterial < 0) {
+            defaultMaterial = int(materials.size());
+            materials.push_back(translateMaterial(MtlRecord())); }
+        return defaultMaterial; };
+
+    // Chunk-local material indices to global ones.  A chunk's faces
+    // before its first usemtl continue the previous chunk's material.
+    int carried = -1;
+    size_t nbTris = 0;
+    std::vector<std::vector<int>> chunkMaterials(chunks.size());
+    for (size_t ci=0;  ci<chunks.size();  ci++) {
+        ObjChunk& c = chunks[ci];
+        for (const std::string& name : c.mtlNames) {
+            auto found = materialByName.find(name);
+            chunkMaterials[ci].push_back(found != materialByName.end() ? found->second
+                                                                        : getDefaultMaterial()); }
+        for (int& m : c.triMaterial) {
+            if (m >= 0)
+                carried = m = chunkMaterials[ci][m];
+            else
+                m = carried >= 0 ? carried : (carried = getDefaultMaterial()); }
+        c.baseTri = nbTris;
+        nbTris += c.triMaterial.size(); }
+
+    // Smooth normals for corners without one: the area weighted sum of
+    // the normals of all triangles sharing the position.
+    std::vector<vec3> smooth;
+    bool needSmooth = false;
+    for (const ObjChunk& c : chunks)
+        for (const ivec3& k : c.corners)
+            if (k.z < 0) { needSmooth = true;  break; }
+    if (needSmooth) {
+        smooth.assign(positions.size(), vec3(0.0f));
+        for (const ObjChunk& c : chunks)
+            for (size_t t=0;  t+2<c.corners.size();  t+=3) {
+                const ivec3* k = &c.corners[t];
+                vec3 n = cross(positions[k[1].x] - positions[k[0].x],
+                               positions[k[2].x] - positions[k[0].x]);
+                for (int j=0;  j<3;  j++)
+                    smooth[k[j].x] += n; }
+        for (vec3& n : smooth) {
+            float len = length(n);
+            n = len > 0.0f ? n/len : vec3(0,0,1); } }
+
+    // One vertex per corner, transformed like readAssimpFile does.
+    mat3 normalTr(M);
+    vertices.resize(3*nbTris);
+    indicies.resize(3*nbTris);
+    matIndx.resize(nbTris);
+    parallelFor(chunks.size(), [&](size_t ci) {
+        const ObjChunk& c = chunks[ci];
+        for (size_t t=0;  t<c.triMaterial.size();  t++) {
+            size_t tri = c.baseTri + t;
+            matIndx[tri] = c.triMaterial[t];
+            for (int j=0;  j<3;  j++) {
+                const ivec3& k = c.corners[3*t + j];
+                Vertex& vert = vertices[3*tri + j];
+                vert.pos = vec3(M * vec4(positions[k.x], 1.0f));
+                vert.nrm = normalTr * (k.z >= 0 ? normals[k.z] : smooth[k.x]);
+                vert.texCoord = k.y >= 0 ? texCoords[k.y] : vec2(0.0f);
+                indicies[3*tri + j] = uint32_t(3*tri + j); } } });
+
+    printf("OBJ: %zu positions, %zu triangles, %zu materials, %zu textures\n",
+           positions.size(), nbTris, materials.size(), textures.size());
+    size_t badFaces = 0;
+    for (const ObjChunk& c : chunks)
+        badFaces += c.badFaces;
+    if (badFaces > 0)
+        printf("OBJ: %s: %zu faces skipped for out of range indices\n", path.c_str(), badFaces);
+    return true;
+}
@@ -29,21 +29,19 @@ layout(location = 0) out vec4 fragColor;
 layout(buffer_reference, scalar) buffer Vertices {Vertex v[]; };    // Positions of an object
 layout(buffer_reference, scalar) buffer Indices {uint i[]; };       // Triangle indices
 layout(buffer_reference, scalar) buffer Materials {Material m[]; }; // Array of materials
-layout(buffer_reference, scalar) buffer MatIndices {int i[]; };     // Material ID for each triangle
 
 layout(binding=eObjDescs, scalar) buffer ObjDesc_ { ObjDesc i[]; } objDesc;
 layout(binding=eTextures) uniform sampler2D[] textureSamplers;
+layout(binding=eTexFeedback, scalar) buffer TexFeedback_ { uint width[]; } texFeedback;
 
 float pi = 3.14159;
 void main()
 {
   // Material of the object
   ObjDesc    obj = objDesc.i[pcRaster.objIndex];
-  MatIndices matIndices  = MatIndices(obj.materialIndexAddress);
   Materials  materials   = Materials(obj.materialAddress);
   
-  int               matIndex = matIndices.i[gl_PrimitiveID];
-  Material mat      = materials.m[matIndex];
+  Material mat      = materials.m[pcRaster.materialIndex];  // Drawn one material range at a time
   
   vec3 N = normalize(worldNrm);
   vec3 V = normalize(viewDir);
@@ -61,7 +59,20 @@ void main()
   {
     int  txtOffset  = obj.txtOffset;
     uint txtId      = txtOffset + mat.textureId;
-    Kd = texture(textureSamplers[nonuniformEXT(txtId)], texCoord).xyz;
+    vec4 texel = texture(textureSamplers[nonuniformEXT(txtId)], texCoord);
+    if (pcRaster.alphaTest != 0 && texel.a < ALPHA_CUTOFF)
+      discard;
+    Kd = texel.xyz;
+
+    // Texture streaming feedback: the width of the level that would be
+    // sampled here if every level were resident.  Level 0 of the bound
+    // image is the finest resident one, so a negative (unclamped) lod
+    // asks for a finer level.
+    float lod = textureQueryLod(textureSamplers[nonuniformEXT(txtId)], texCoord).y;
+    float size = float(textureSize(textureSamplers[nonuniformEXT(txtId)], 0).x);
+    uint width = uint(min(size*exp2(-lod), 65536.0));
+    if (width > texFeedback.width[txtId])
+      atomicMax(texFeedback.width[txtId], width);
   }
   
   // This very minimal lighting calculation should be replaced with a modern BRDF calculation. 
@@ -12,11 +12,18 @@ layout(binding = 0) uniform _MatrixUniforms
   MatrixUniforms mats;
 };
 
+// Transforms of all instances, grouped so each object is one instanced draw.
+layout(binding = eInstances, scalar) readonly buffer _Instances { mat4 m[]; } instances;
+
 layout(push_constant) uniform _PushConstantRaster
 {
   PushConstantRaster pcRaster;
 };
 
+// Set by the pipeline: true for the compact vertex layout, where
+// i_normal.xy holds an octahedral-encoded normal.
+layout(constant_id = 0) const bool compactVertices = false;
+
 layout(location = 0) in vec3 i_position;
 layout(location = 1) in vec3 i_normal;
 layout(location = 2) in vec2 i_texCoord;
@@ -36,11 +43,15 @@ out gl_PerVertex
 void main()
 {
   vec3 eye = vec3(mats.viewInverse * vec4(0, 0, 0, 1));
+  mat4 modelMatrix = instances.m[gl_InstanceIndex];
 
-  worldPos = vec3(pcRaster.modelMatrix * vec4(i_position, 1.0));
+  worldPos = vec3(modelMatrix * vec4(i_position, 1.0));
   viewDir  = vec3(eye - worldPos);
   texCoord = i_texCoord;
-  worldNrm = mat3(pcRaster.modelMatrix) * i_normal;
+  vec3 nrm = compactVertices ? octDecode(i_normal.xy) : i_normal;
+  // Normals take the inverse transpose, so non-uniform scales keep them
+  // perpendicular to the surface.
+  worldNrm = transpose(inverse(mat3(modelMatrix))) * nrm;
 
   gl_Position = mats.viewProj * vec4(worldPos, 1.0);
 }
@@ -8,6 +8,7 @@
 using vec2 = glm::vec2;
 using vec3 = glm::vec3;
 using vec4 = glm::vec4;
+using mat3 = glm::mat3;
 using mat4 = glm::mat4;
 using uint = unsigned int;
 #endif
@@ -24,7 +25,10 @@ using uint = unsigned int;
 START_ENUM(ScBindings)
   eMatrices  = 0,  // Global uniform containing camera matrices
   eObjDescs = 1,  // Access to the object descriptions
-  eTextures = 2   // Access to textures
+  eTextures = 2,  // Access to textures
+  eInstances = 3, // Instance transforms, indexed by gl_InstanceIndex
+  eTexFeedback = 4, // Per texture slot, the finest width sampled (texture streaming)
+  eObjHits = 5      // Per object, whether a ray hit it (geometry streaming)
 END_ENUM();
 
 START_ENUM(RtBindings)
@@ -40,10 +44,13 @@ END_ENUM();
 struct ObjDesc
 {
   int      txtOffset;             // Texture index offset in the array of textures
-  uint64_t vertexAddress;         // Address of the Vertex buffer
+  int      shortIndices;          // Non-zero if the index buffer holds uint16 indices
+  uint64_t vertexAddress;         // Address of the Vertex buffer (vec3 positions if compact)
   uint64_t indexAddress;          // Address of the index buffer
   uint64_t materialAddress;       // Address of the material buffer
-  uint64_t materialIndexAddress;  // Address of the triangle material index buffer
+  uint64_t firstTriangleAddress;  // Address of each geometry's first triangle (one material per geometry)
+  uint64_t attribAddress;         // Address of the VertexAttrib buffer (compact layout only)
+  uint64_t triAttribAddress;      // Address of the TriAttrib buffer (-triattribs only)
 };
 
 // Uniform buffer set at each frame
@@ -58,11 +65,12 @@ struct MatrixUniforms
 // Push constant structure for the raster
 struct PushConstantRaster
 {
-  mat4  modelMatrix;  // matrix of the instance
   vec3  lightPosition;
   uint  objIndex;
   float lightIntensity;
   int   lightType;
+  int   materialIndex;  // The draw's material range
+  int   alphaTest;      // Nonzero if the range's triangles are partly holes
 };
 
 #ifdef __cplusplus
@@ -81,6 +89,7 @@ struct PushConstantRay
 	int depth;
 	float rr;
 	int alignmentTest;
+	int numEmitters;    // Entries in the emitter buffer
 };
 
 // Push constant structure for the ray tracer
@@ -102,6 +111,50 @@ struct Vertex  // Created by readModel; used in shaders
   vec2 texCoord;
 };
 
+// The compact vertex layout (selected at load time) splits Vertex
+// into two streams: a tightly packed vec3 position stream (12 bytes,
+// all the AS builder and the shadow rays ever touch) and this 8 byte
+// attribute stream.
+struct VertexAttrib
+{
+  uint nrm;       // Octahedral normal as two snorm16 values (packSnorm2x16)
+  uint texCoord;  // Texture coordinate as two half floats (packHalf2x16)
+};
+
+// With -triattribs, one 28 byte record per triangle holding everything
+// the ray tracer shades with, so a hit needs one load rather than an
+// index fetch followed by three vertex fetches.  Same encodings as
+// VertexAttrib.
+struct TriAttrib
+{
+  uint nrm[3];       // Octahedral vertex normals
+  uint texCoord[3];  // Half float texture coordinates
+  float uvDensity;   // sqrt(texture coordinate area/object space area), for ray cones
+};
+
+#ifndef __cplusplus
+// Inverse of the octahedral mapping used when packing VertexAttrib::nrm.
+// Input is the already unpacked snorm pair in [-1,1].
+vec3 octDecode(vec2 e)
+{
+  vec3 v = vec3(e.xy, 1.0 - abs(e.x) - abs(e.y));
+  if (v.z < 0.0)
+    v.xy = (1.0 - abs(v.yx)) * vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);
+  return normalize(v);
+}
+
+// The octahedral mapping itself, as the loader's octEncode; for
+// normals computed on the device.
+uint octEncode(vec3 n)
+{
+  n /= abs(n.x) + abs(n.y) + abs(n.z);
+  vec2 e = n.xy;
+  if (n.z < 0.0)
+    e = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+  return packSnorm2x16(e);
+}
+#endif
+
 struct Material  // Created by readModel; used in shaders
 {
   vec3  diffuse;
@@ -111,6 +164,10 @@ struct Material  // Created by readModel; used in shaders
   int   textureId;
 };
 
+// Materials whose texture has an alpha channel are alpha tested: texels
+// with alpha below this are holes.
+#define ALPHA_CUTOFF 0.5
+
 
 // Push constant structure for the ray tracer
 struct PushConstantDenoise
@@ -122,13 +179,35 @@ struct PushConstantDenoise
   int stepWidth;
 };
 
+// With -deform, each object's rest pose, from which deform.comp
+// computes the positions it writes into the vertex buffer.
+struct DeformRest
+{
+  vec3 pos;
+  vec3 nrm;
+};
+
+struct PushConstantDeform
+{
+  uint64_t restAddress;    // The object's DeformRest buffer
+  uint64_t vertexAddress;  // The object's vertex buffer: Vertex, or vec3 positions if compact
+  uint64_t attribAddress;  // Its VertexAttrib buffer if compact, else 0
+  uint  vertexCount;
+  uint  vertexStride;      // In floats
+  float phase;             // Of the wave, in radians
+  float amplitude;         // In object space units
+  float waveNumber;        // Radians per object space unit
+};
+
 struct RayPayload
 {
 	bool hit; // Does the ray intersect anything or not?
 	vec3 hitPos; // The world coordinates of the hit point.
 	int instanceIndex; // Index of the object instance hit (we have only one, so =0)
-	int primitiveIndex; // Index of the hit triangle primitive within object
+	int primitiveIndex; // Index of the hit triangle primitive within its geometry
+	int geometryIndex; // Index of the hit geometry, i.e. material range, within object
 	vec3 bc; // Barycentric coordinates of the hit point within triangle
+	mat3 normalToWorld; // Takes the hit instance's object space normals to world space
 	uint seed;
 	bool occluded;
 	float hitDistance;
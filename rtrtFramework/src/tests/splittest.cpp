@@ -0,0 +1,86 @@
+//////////////////////////////////////////////////////////////////////
+// ModelData::splitSpatially on an indexed grid whose triangles share
+// vertices, as the -gen heightfield's and most Assimp meshes' do.
+// Every cluster's indices must be in range, and every triangle must
+// come out once, with its original corners and material.
+////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <vector>
+
+#include "../modeldata.h"
+
+using namespace glm;
+
+static ModelData grid(uint32_t n)
+{
+    ModelData model;
+    model.materials.resize(2);
+    for (uint32_t y=0;  y<=n;  y++)
+        for (uint32_t x=0;  x<=n;  x++) {
+            Vertex v{};
+            v.pos = vec3(float(x), float((x*7 + y*3) % 5), float(y));
+            model.vertices.push_back(v); }
+    for (uint32_t y=0;  y<n;  y++)
+        for (uint32_t x=0;  x<n;  x++) {
+            uint32_t i = y*(n + 1) + x;
+            for (uint32_t v : {i, i + 1, i + n + 2,  i, i + n + 2, i + n + 1})
+                model.indicies.push_back(v);
+            model.matIndx.push_back(int32_t(x & 1));
+            model.matIndx.push_back(int32_t(x & 1)); }
+    return model;
+}
+
+// A triangle as its corner positions and material, for comparison.
+typedef std::array<float, 10> Key;
+static Key key(const ModelData& model, size_t t)
+{
+    Key k;
+    for (int j=0;  j<3;  j++)
+        for (int a=0;  a<3;  a++)
+            k[3*j+a] = model.vertices[model.indicies[3*t+j]].pos[a];
+    k[9] = float(model.matIndx[t]);
+    return k;
+}
+
+int main()
+{
+    ModelData model = grid(64);
+    std::vector<Key> expected;
+    for (size_t t=0;  t<model.matIndx.size();  t++)
+        expected.push_back(key(model, t));
+
+    int failures = 0;
+    for (uint32_t maxTris : {4096u, 500u, 37u, 2u}) {
+        std::vector<ModelData> clusters = model.splitSpatially(maxTris);
+        std::vector<Key> found;
+        for (const ModelData& cluster : clusters) {
+            if (cluster.matIndx.size() > maxTris) {
+                printf("maxTris %u: cluster of %zu triangles\n", maxTris, cluster.matIndx.size());
+                failures++; }
+            if (cluster.indicies.size() != 3*cluster.matIndx.size()) {
+                printf("maxTris %u: %zu indices for %zu triangles\n", maxTris,
+                       cluster.indicies.size(), cluster.matIndx.size());
+                failures++;
+                continue; }
+            bool inRange = true;
+            for (uint32_t i : cluster.indicies)
+                inRange = inRange && i < cluster.vertices.size();
+            if (!inRange) {
+                printf("maxTris %u: index out of range\n", maxTris);
+                failures++;
+                continue; }
+            for (size_t t=0;  t<cluster.matIndx.size();  t++)
+                found.push_back(key(cluster, t)); }
+
+        std::sort(expected.begin(), expected.end());
+        std::sort(found.begin(), found.end());
+        if (found != expected) {
+            printf("maxTris %u: triangles differ from the original's\n", maxTris);
+            failures++; } }
+
+    printf("splittest: %s\n", failures ? "FAILED" : "passed");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,418 @@
+//////////////////////////////////////////////////////////////////////
+// BC1/BC3 texture compression and the compressed texture cache.
+//
+// Colour endpoints come from the principal axis of the block's colours,
+// refined once by least squares on the chosen indices; BC3 alpha uses
+// the block's alpha range with the eight-value palette.  Texels are held
+// one channel per array so the per-texel loops vectorize.  Each texture
+// is encoded on its own loader thread, so textures encode in parallel.
+////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+
+#include "texcompress.h"
+#include "fileio.h"
+
+namespace {
+
+// Bump when the encoder's output changes, so stale cache entries miss.
+const uint64_t ENCODER_VERSION = 1;
+
+const uint8_t KTX2_IDENTIFIER[12] = {0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n'};
+
+struct Ktx2Header
+{
+    uint8_t  identifier[12];
+    uint32_t vkFormat, typeSize, pixelWidth, pixelHeight, pixelDepth;
+    uint32_t layerCount, faceCount, levelCount, supercompressionScheme;
+    uint32_t dfdByteOffset, dfdByteLength, kvdByteOffset, kvdByteLength;
+    uint64_t sgdByteOffset, sgdByteLength;
+};
+
+struct Ktx2Level
+{
+    uint64_t byteOffset, byteLength, uncompressedByteLength;
+};
+
+// The 16 texels of a 4x4 block, one channel per array.
+struct Block
+{
+    float r[16], g[16], b[16], a[16];
+};
+
+size_t blockBytes(uint32_t vkFormat) { return vkFormat == BC1_RGB_UNORM ? 8 : 16; }
+
+size_t levelBytes(uint32_t vkFormat, uint32_t width, uint32_t height)
+{
+    if (vkFormat == RGBA8_UNORM)
+        return size_t(width)*height*4;
+    return size_t((width + 3)/4)*((height + 3)/4)*blockBytes(vkFormat);
+}
+
+// Edge blocks of images not a multiple of 4 repeat the last row and column.
+void loadBlock(const uint8_t* rgba, int width, int height, int bx, int by, Block& block)
+{
+    for (int j=0;  j<16;  j++) {
+        int x = std::min(4*bx + j%4, width-1);
+        int y = std::min(4*by + j/4, height-1);
+        const uint8_t* p = rgba + 4*(size_t(y)*width + x);
+        block.r[j] = p[0];
+        block.g[j] = p[1];
+        block.b[j] = p[2];
+        block.a[j] = p[3]; }
+}
+
+uint16_t to565(const float c[3])
+{
+    int r = std::clamp(int(c[0]*31.0f/255.0f + 0.5f), 0, 31);
+    int g = std::clamp(int(c[1]*63.0f/255.0f + 0.5f), 0, 63);
+    int b = std::clamp(int(c[2]*31.0f/255.0f + 0.5f), 0, 31);
+    return uint16_t(r << 11 | g << 5 | b);
+}
+
+void from565(uint16_t c, float out[3])
+{
+    int r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+    out[0] = float(r << 3 | r >> 2);
+    out[1] = float(g << 2 | g >> 4);
+    out[2] = float(b << 3 | b >> 2);
+}
+
+// Picks the nearest of the four palette colours for each texel; returns
+// the packed indices and adds the squared error to *error.
+uint32_t chooseIndices(const Block& block, uint16_t c0, uint16_t c1, uint8_t idx[16], float* error)
+{
+    float pal[4][3];
+    from565(c0, pal[0]);
+    from565(c1, pal[1]);
+    for (int k=0;  k<3;  k++) {
+        pal[2][k] = (2.0f*pal[0][k] + pal[1][k])/3.0f;
+        pal[3][k] = (pal[0][k] + 2.0f*pal[1][k])/3.0f; }
+
+    float dist[4][16];
+    for (int p=0;  p<4;  p++)
+        for (int j=0;  j<16;  j++) {
+            float dr = block.r[j] - pal[p][0], dg = block.g[j] - pal[p][1], db = block.b[j] - pal[p][2];
+            dist[p][j] = dr*dr + dg*dg + db*db; }
+
+    uint32_t bits = 0;
+    for (int j=0;  j<16;  j++) {
+        int best = 0;
+        for (int p=1;  p<4;  p++)
+            if (dist[p][j] < dist[best][j]) best = p;
+        idx[j] = uint8_t(best);
+        *error += dist[best][j];
+        bits |= uint32_t(best) << (2*j); }
+    return bits;
+}
+
+// Orders the endpoints for four-colour mode, then picks indices.  Equal
+// endpoints would select three-colour mode, so the block becomes solid.
+void finishColorBlock(const Block& block, uint16_t c0, uint16_t c1, uint16_t& outC0, uint16_t& outC1,
+                      uint32_t& outBits, uint8_t idx[16], float& outError)
+{
+    if (c0 < c1) std::swap(c0, c1);
+    outC0 = c0;
+    outC1 = c1;
+    outError = 0.0f;
+    if (c0 == c1) {
+        float solid[3];
+        from565(c0, solid);
+        for (int j=0;  j<16;  j++) {
+            float dr = block.r[j] - solid[0], dg = block.g[j] - solid[1], db = block.b[j] - solid[2];
+            outError += dr*dr + dg*dg + db*db;
+            idx[j] = 0; }
+        outBits = 0;
+        return; }
+    outBits = chooseIndices(block, c0, c1, idx, &outError);
+}
+
+void encodeColor(const Block& block, uint8_t* out)
+{
+    float mean[3] = {0, 0, 0};
+    for (int j=0;  j<16;  j++) {
+        mean[0] += block.r[j];
+        mean[1] += block.g[j];
+        mean[2] += block.b[j]; }
+    for (float& m : mean) m /= 16.0f;
+
+    float cov[6] = {0, 0, 0, 0, 0, 0};
+    for (int j=0;  j<16;  j++) {
+        float r = block.r[j] - mean[0], g = block.g[j] - mean[1], b = block.b[j] - mean[2];
+        cov[0] += r*r;  cov[1] += r*g;  cov[2] += r*b;
+        cov[3] += g*g;  cov[4] += g*b;  cov[5] += b*b; }
+
+    // Principal axis by power iteration.
+    float axis[3] = {1.0f, 1.0f, 1.0f};
+    for (int iter=0;  iter<4;  iter++) {
+        float x = cov[0]*axis[0] + cov[1]*axis[1] + cov[2]*axis[2];
+        float y = cov[1]*axis[0] + cov[3]*axis[1] + cov[4]*axis[2];
+        float z = cov[2]*axis[0] + cov[4]*axis[1] + cov[5]*axis[2];
+        float len = std::sqrt(x*x + y*y + z*z);
+        if (len < 1e-6f) break;
+        axis[0] = x/len;  axis[1] = y/len;  axis[2] = z/len; }
+
+    float tmin = 0.0f, tmax = 0.0f;
+    for (int j=0;  j<16;  j++) {
+        float t = (block.r[j] - mean[0])*axis[0] + (block.g[j] - mean[1])*axis[1] + (block.b[j] - mean[2])*axis[2];
+        tmin = std::min(tmin, t);
+        tmax = std::max(tmax, t); }
+    float e0[3], e1[3];
+    for (int k=0;  k<3;  k++) {
+        e0[k] = mean[k] + axis[k]*tmax;
+        e1[k] = mean[k] + axis[k]*tmin; }
+
+    uint16_t c0, c1;
+    uint32_t bits;
+    uint8_t idx[16];
+    float error;
+    finishColorBlock(block, to565(e0), to565(e1), c0, c1, bits, idx, error);
+
+    // Refit the endpoints to the chosen indices by least squares, and keep
+    // the refit if it lowers the error.
+    if (c0 != c1) {
+        static const float weight[4] = {1.0f, 0.0f, 2.0f/3.0f, 1.0f/3.0f};  // Share of c0
+        float aa = 0, ab = 0, bb = 0, ax[3] = {0, 0, 0}, bx[3] = {0, 0, 0};
+        for (int j=0;  j<16;  j++) {
+            float w0 = weight[idx[j]], w1 = 1.0f - w0;
+            aa += w0*w0;  ab += w0*w1;  bb += w1*w1;
+            ax[0] += w0*block.r[j];  ax[1] += w0*block.g[j];  ax[2] += w0*block.b[j];
+            bx[0] += w1*block.r[j];  bx[1] += w1*block.g[j];  bx[2] += w1*block.b[j]; }
+        float det = aa*bb - ab*ab;
+        if (std::fabs(det) > 1e-6f) {
+            float r0[3], r1[3];
+            for (int k=0;  k<3;  k++) {
+                r0[k] = (ax[k]*bb - bx[k]*ab)/det;
+                r1[k] = (bx[k]*aa - ax[k]*ab)/det; }
+            uint16_t d0, d1;
+            uint32_t refitBits;
+            uint8_t refitIdx[16];
+            float refitError;
+            finishColorBlock(block, to565(r0), to565(r1), d0, d1, refitBits, refitIdx, refitError);
+            if (refitError < error) {
+                c0 = d0;  c1 = d1;  bits = refitBits; } } }
+
+    out[0] = uint8_t(c0);  out[1] = uint8_t(c0 >> 8);
+    out[2] = uint8_t(c1);  out[3] = uint8_t(c1 >> 8);
+    for (int i=0;  i<4;  i++)
+        out[4+i] = uint8_t(bits >> (8*i));
+}
+
+// BC3 alpha: endpoints at the block's alpha extremes, alpha0 > alpha1
+// selecting the eight-value palette.
+void encodeAlpha(const Block& block, uint8_t* out)
+{
+    float lo = 255.0f, hi = 0.0f;
+    for (int j=0;  j<16;  j++) {
+        lo = std::min(lo, block.a[j]);
+        hi = std::max(hi, block.a[j]); }
+    uint8_t a0 = uint8_t(hi), a1 = uint8_t(lo);
+    out[0] = a0;
+    out[1] = a1;
+
+    uint64_t bits = 0;
+    if (a0 > a1) {
+        float pal[8] = {float(a0), float(a1)};
+        for (int i=2;  i<8;  i++)
+            pal[i] = ((8 - i)*float(a0) + (i - 1)*float(a1))/7.0f;
+        for (int j=0;  j<16;  j++) {
+            int best = 0;
+            for (int p=1;  p<8;  p++)
+                if (std::fabs(block.a[j] - pal[p]) < std::fabs(block.a[j] - pal[best])) best = p;
+            bits |= uint64_t(best) << (3*j); } }
+    for (int i=0;  i<6;  i++)
+        out[2+i] = uint8_t(bits >> (8*i));
+}
+
+void encodeLevel(const uint8_t* rgba, int width, int height, uint32_t vkFormat, uint8_t* out)
+{
+    int bw = (width + 3)/4, bh = (height + 3)/4;
+    size_t stride = blockBytes(vkFormat);
+    Block block;
+    for (int by=0;  by<bh;  by++)
+        for (int bx=0;  bx<bw;  bx++) {
+            loadBlock(rgba, width, height, bx, by, block);
+            uint8_t* dst = out + (size_t(by)*bw + bx)*stride;
+            if (vkFormat == BC3_UNORM) {
+                encodeAlpha(block, dst);
+                dst += 8; }
+            encodeColor(block, dst); }
+}
+
+// 2x2 box filter, matching the linear blits of the uncompressed path.
+std::vector<uint8_t> downsample(const std::vector<uint8_t>& src, int width, int height, int& newWidth, int& newHeight)
+{
+    newWidth = std::max(width/2, 1);
+    newHeight = std::max(height/2, 1);
+    std::vector<uint8_t> dst(size_t(newWidth)*newHeight*4);
+    for (int y=0;  y<newHeight;  y++)
+        for (int x=0;  x<newWidth;  x++) {
+            int x0 = std::min(2*x, width-1), x1 = std::min(2*x+1, width-1);
+            int y0 = std::min(2*y, height-1), y1 = std::min(2*y+1, height-1);
+            for (int c=0;  c<4;  c++) {
+                int sum = src[4*(size_t(y0)*width + x0) + c] + src[4*(size_t(y0)*width + x1) + c]
+                        + src[4*(size_t(y1)*width + x0) + c] + src[4*(size_t(y1)*width + x1) + c];
+                dst[4*(size_t(y)*newWidth + x) + c] = uint8_t((sum + 2)/4); } }
+    return dst;
+}
+
+}
+
+size_t CompressedTexture::bytes() const
+{
+    size_t total = 0;
+    for (const auto& level : levels)
+        total += level.size();
+    return total;
+}
+
+// Calls emit(level, width, height, rgba) for each level of the box
+// filtered mip chain, finest first.
+template <class F>
+static void forEachMip(const uint8_t* rgba, int width, int height, F&& emit)
+{
+    uint32_t mipLevels = uint32_t(std::floor(std::log2(std::max(width, height)))) + 1;
+    std::vector<uint8_t> level(rgba, rgba + size_t(width)*height*4);
+    int w = width, h = height;
+    for (uint32_t l=0;  l<mipLevels;  l++) {
+        if (l > 0) {
+            int nw, nh;
+            level = downsample(level, w, h, nw, nh);
+            w = nw;
+            h = nh; }
+        emit(l, w, h, level); }
+}
+
+CompressedTexture compressTexture(const uint8_t* rgba, int width, int height)
+{
+    CompressedTexture texture;
+    texture.width = uint32_t(width);
+    texture.height = uint32_t(height);
+    texture.vkFormat = BC1_RGB_UNORM;
+    for (size_t i=0;  i<size_t(width)*height;  i++)
+        if (rgba[4*i+3] != 255) {
+            texture.vkFormat = BC3_UNORM;
+            break; }
+
+    forEachMip(rgba, width, height, [&](uint32_t, int w, int h, std::vector<uint8_t>& level) {
+        std::vector<uint8_t> blocks(levelBytes(texture.vkFormat, w, h));
+        encodeLevel(level.data(), w, h, texture.vkFormat, blocks.data());
+        texture.levels.push_back(std::move(blocks)); });
+    return texture;
+}
+
+CompressedTexture buildMipChain(const uint8_t* rgba, int width, int height)
+{
+    CompressedTexture texture;
+    texture.width = uint32_t(width);
+    texture.height = uint32_t(height);
+    texture.vkFormat = RGBA8_UNORM;
+    forEachMip(rgba, width, height, [&](uint32_t, int, int, std::vector<uint8_t>& level) {
+        texture.levels.push_back(level); });
+    return texture;
+}
+
+size_t mipLevelBytes(uint32_t vkFormat, uint32_t width, uint32_t height, uint32_t level)
+{
+    return levelBytes(vkFormat, std::max(width >> level, 1u), std::max(height >> level, 1u));
+}
+
+uint64_t contentHash(const void* data, size_t size)
+{
+    uint64_t hash = 14695981039346656037ull;
+    const uint8_t* p = (const uint8_t*)data;
+    for (size_t i=0;  i<size;  i++) {
+        hash ^= p[i];
+        hash *= 1099511628211ull; }
+    return hash;
+}
+
+std::string textureCachePath(uint64_t hash)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "texcache/%016llx-v%llu.ktx2", (unsigned long long)hash,
+             (unsigned long long)ENCODER_VERSION);
+    return name;
+}
+
+bool readTextureCache(const std::string& path, CompressedTexture& out)
+{
+    if (!fileExists(path))
+        return false;
+    std::vector<char> bytes;
+    if (!readFile(path, bytes) || bytes.size() < sizeof(Ktx2Header))
+        return false;
+
+    Ktx2Header header;
+    memcpy(&header, bytes.data(), sizeof(header));
+    if (memcmp(header.identifier, KTX2_IDENTIFIER, sizeof(KTX2_IDENTIFIER)) != 0
+        || (header.vkFormat != BC1_RGB_UNORM && header.vkFormat != BC3_UNORM)
+        || header.levelCount == 0 || header.levelCount > 32
+        || sizeof(Ktx2Header) + header.levelCount*sizeof(Ktx2Level) > bytes.size())
+        return false;
+
+    CompressedTexture texture;
+    texture.vkFormat = header.vkFormat;
+    texture.width = header.pixelWidth;
+    texture.height = header.pixelHeight;
+    uint32_t w = texture.width, h = texture.height;
+    for (uint32_t l=0;  l<header.levelCount;  l++) {
+        Ktx2Level level;
+        memcpy(&level, bytes.data() + sizeof(Ktx2Header) + l*sizeof(Ktx2Level), sizeof(level));
+        if (level.byteLength != levelBytes(texture.vkFormat, w, h)
+            || level.byteOffset + level.byteLength > bytes.size())
+            return false;
+        const char* data = bytes.data() + level.byteOffset;
+        texture.levels.emplace_back(data, data + level.byteLength);
+        w = std::max(w/2, 1u);
+        h = std::max(h/2, 1u); }
+
+    texture.fromCache = true;
+    out = std::move(texture);
+    return true;
+}
+
+// Written to a temporary name of its own and renamed, so concurrent or
+// interrupted writes never leave a truncated entry.
+bool writeTextureCache(const std::string& path, const CompressedTexture& texture)
+{
+    std::error_code ec;
+    std::filesystem::create_directories(std::filesystem::path(path).parent_path(), ec);
+
+    Ktx2Header header{};
+    memcpy(header.identifier, KTX2_IDENTIFIER, sizeof(KTX2_IDENTIFIER));
+    header.vkFormat = texture.vkFormat;
+    header.typeSize = 1;
+    header.pixelWidth = texture.width;
+    header.pixelHeight = texture.height;
+    header.faceCount = 1;
+    header.levelCount = uint32_t(texture.levels.size());
+
+    std::vector<Ktx2Level> index(texture.levels.size());
+    uint64_t offset = sizeof(Ktx2Header) + index.size()*sizeof(Ktx2Level);
+    for (size_t l=0;  l<index.size();  l++) {
+        index[l].byteOffset = offset;
+        index[l].byteLength = texture.levels[l].size();
+        index[l].uncompressedByteLength = texture.levels[l].size();
+        offset += texture.levels[l].size(); }
+
+    std::string temp = tempPath(path);
+    FILE* file = fopen(temp.c_str(), "wb");
+    if (!file)
+        return false;
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1
+        && fwrite(index.data(), sizeof(Ktx2Level), index.size(), file) == index.size();
+    for (const auto& level : texture.levels)
+        ok = ok && fwrite(level.data(), 1, level.size(), file) == level.size();
+    ok = fclose(file) == 0 && ok;
+    if (ok)
+        std::filesystem::rename(temp, path, ec);
+    if (!ok || ec) {
+        std::filesystem::remove(temp, ec);
+        return false; }
+    return true;
+}
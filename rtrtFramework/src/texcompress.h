@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Block compressed textures for -bc: a CPU BC1/BC3 encoder with mips
+// precomputed on the CPU, and a cache of encoded textures keyed by a
+// hash of the source file, so each texture is encoded only once.  Mip
+// chains built on the CPU for texture streaming use the same struct,
+// uncompressed.
+
+// The VkFormat values of the block formats, kept here as plain numbers so
+// the encoder needs no Vulkan headers.
+const uint32_t BC1_RGB_UNORM = 131;   // VK_FORMAT_BC1_RGB_UNORM_BLOCK: 8 bytes per 4x4 block
+const uint32_t BC3_UNORM     = 137;   // VK_FORMAT_BC3_UNORM_BLOCK: 16 bytes per 4x4 block
+const uint32_t RGBA8_UNORM   = 37;    // VK_FORMAT_R8G8B8A8_UNORM: uncompressed
+
+struct CompressedTexture
+{
+    uint32_t vkFormat{0};        // BC1_RGB_UNORM, or BC3_UNORM if any texel is translucent; or RGBA8_UNORM
+    uint32_t width{0}, height{0};
+    std::vector<std::vector<uint8_t>> levels;  // Full mip chain, largest first
+    bool     fromCache{false};
+
+    size_t bytes() const;
+};
+
+// Box-filters the mip chain of an RGBA8 image and encodes every level.
+CompressedTexture compressTexture(const uint8_t* rgba, int width, int height);
+
+// The same mip chain left as RGBA8.
+CompressedTexture buildMipChain(const uint8_t* rgba, int width, int height);
+
+// Bytes of mip level l of a width x height image in vkFormat.
+size_t mipLevelBytes(uint32_t vkFormat, uint32_t width, uint32_t height, uint32_t level);
+
+// 64 bit FNV-1a of the source bytes, the cache key.  Also keys the BLAS
+// cache, so it must not depend on the texture encoder.
+uint64_t contentHash(const void* data, size_t size);
+
+// The cache is a directory of KTX2-style files: the KTX2 identifier and
+// header (format, size, level count), a level index of byte offsets and
+// lengths, then the levels.  No data format descriptor or key/value data
+// is written; only readTextureCache needs to read them.
+std::string textureCachePath(uint64_t hash);
+bool readTextureCache(const std::string& path, CompressedTexture& out);
+bool writeTextureCache(const std::string& path, const CompressedTexture& texture);
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+// A minimal fixed-size pool of worker threads.  Jobs are taken in
+// submission order by whichever worker is free; submit returns a
+// std::future for the job's result.
+class ThreadPool
+{
+public:
+    explicit ThreadPool(unsigned int threadCount = std::thread::hardware_concurrency())
+    {
+        threadCount = std::max(1u, threadCount);
+        for (unsigned int i=0;  i<threadCount;  i++)
+            m_workers.emplace_back([this] { workerLoop(); });
+    }
+
+    ~ThreadPool()
+    {
+        stop();
+    }
+
+    // Discards the jobs not yet started and waits for the running ones
+    // to finish.  Nothing may be submitted afterwards.
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopping = true;
+            m_jobs = {};
+        }
+        m_wake.notify_all();
+        for (auto& w : m_workers)
+            w.join();
+        m_workers.clear();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    unsigned int size() const { return static_cast<unsigned int>(m_workers.size()); }
+
+    template <class F>
+    auto submit(F&& f) -> std::future<decltype(f())>
+    {
+        auto task = std::make_shared<std::packaged_task<decltype(f())()>>(std::forward<F>(f));
+        std::future<decltype(f())> result = task->get_future();
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_jobs.emplace([task] { (*task)(); });
+            m_unfinished++;
+        }
+        m_wake.notify_one();
+        return result;
+    }
+
+    // Block until every job submitted so far has finished.
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_idle.wait(lock, [this] { return m_unfinished == 0; });
+    }
+
+private:
+    void workerLoop()
+    {
+        for (;;) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_wake.wait(lock, [this] { return m_stopping || !m_jobs.empty(); });
+                if (m_stopping && m_jobs.empty())
+                    return;
+                job = std::move(m_jobs.front());
+                m_jobs.pop();
+            }
+            job();
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (--m_unfinished == 0)
+                    m_idle.notify_all();
+            }
+        }
+    }
+
+    std::vector<std::thread>          m_workers;
+    std::queue<std::function<void()>> m_jobs;
+    std::mutex                        m_mutex;
+    std::condition_variable           m_wake;
+    std::condition_variable           m_idle;
+    size_t                            m_unfinished{0};
+    bool                              m_stopping{false};
+};
+
+// Runs fn(i) for every i in [0,count) on up to hardware_concurrency
+// short-lived threads, the caller's included.  Unlike waiting on
+// ThreadPool jobs, this is safe to call from inside a pool job.
+template <class F>
+void parallelFor(size_t count, F&& fn)
+{
+    size_t nbThreads = std::min<size_t>(count, std::max(1u, std::thread::hardware_concurrency()));
+    std::atomic<size_t> next{0};
+    auto worker = [&]() {
+        for (size_t i = next++;  i < count;  i = next++)
+            fn(i); };
+
+    std::vector<std::thread> threads;
+    for (size_t t=1;  t<nbThreads;  t++)
+        threads.emplace_back(worker);
+    worker();
+    for (auto& t : threads)
+        t.join();
+}
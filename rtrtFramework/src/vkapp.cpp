@@ -26,13 +26,58 @@ constexpr integral align_up(integral x, size_t a) noexcept
 #define GLM_SWIZZLE
 #include <glm/glm.hpp>
 
-VkApp::VkApp(App* _app) : app(_app)
+VkApp::VkApp(App* _app)
+	: app(_app),
+	  m_loadPool(_app->loadThreads ? _app->loadThreads : std::thread::hardware_concurrency())
 {
 	m_pcRay.rr = 0.8f;
 	m_pcRay.alignmentTest = 1234;
 	m_pcDenoise.normFactor = 0.003f;
 	m_pcDenoise.depthFactor = 0.007f;
 	m_pcDenoise.lumenFactor = 0.0f;
+	m_compactVertices = app->compactVertices;
+	m_triAttribs = app->triAttribs;
+	m_compressTextures = app->compressTextures;
+	m_asCache = app->asCache;
+	m_rayCones = app->rayCones;
+	m_usePipelineCache = app->pipelineCache;
+	m_instanceMotion = app->instanceMotion;
+	m_deform = app->deform;
+	m_asStatsPath = app->asStatsPath;
+	m_hostBuildThreads = app->hostBuildThreads;
+	m_deformRebuildFrames = app->deformRebuildFrames;
+	m_textureBudget = app->textureBudgetMB << 20;
+	m_geometryBudget = app->geometryBudgetMB << 20;
+	if (m_deform && m_geometryBudget > 0) {
+		printf("-geombudget: not with -deform; keeping all geometry resident\n");
+		m_geometryBudget = 0;
+	}
+	if (m_deform && m_triAttribs) {
+		printf("-triattribs: not with -deform, whose normals it would keep at rest\n");
+		m_triAttribs = false;
+	}
+	m_splitTris = app->splitTris;
+	m_lodLevels = app->lodLevels;
+	m_benchFrames = app->benchFrames;
+	m_editBench = app->editBench;
+
+	// Start reading the scene right away; it streams in on the loader
+	// threads while Vulkan initializes and the first frames are shown.
+	// stb_image keeps this flag in a global shared by all loader threads.
+	m_loadStartTime = glfwGetTime();
+	stbi_set_flip_vertically_on_load(true);
+	if (!app->genSpec.empty()) {
+		m_sceneName = "gen:" + app->genSpec;
+		generateScene(app->genSpec);
+	}
+	else if (!app->sceneFile.empty()) {
+		m_sceneName = app->sceneFile;
+		loadScene(app->sceneFile);
+	}
+	else {
+		m_sceneName = "models/living_room.obj";
+		myloadModel(m_sceneName, glm::mat4(1.f));
+	}
 
 	createInstance(app->doApiDump);
 	assert(m_instance);
@@ -45,6 +90,7 @@ VkApp::VkApp(App* _app) : app(_app)
 
 	getSurface();
 	createCommandPool();
+	createPipelineCache();
 
 	createSwapchain();
 	createDepthResource();
@@ -54,15 +100,20 @@ VkApp::VkApp(App* _app) : app(_app)
 	createScBuffer();
 	createPostDescriptor();
 	createPostPipeline();
-	myloadModel("models/living_room.obj", glm::mat4(1.f));
 	createMatrixBuffer();
 	createObjDescriptionBuffer();
+	createInstanceBuffer();
+	createLightBuffer();
+	createFallbackTexture();
+	createTextureFeedbackBuffer();
+	createObjectHitBuffer();
 	createScanlineRenderPass();
 	createScDescriptorSet();
 	createScPipeline();
 
 	createRtBuffers();
 	initRayTracing();
+	createTimestampQueries();
 	createRtAccelerationStructure();
 	createRtDescriptorSet();
 	createRtPipeline();
@@ -71,16 +122,36 @@ VkApp::VkApp(App* _app) : app(_app)
 	createDenoiseBuffer();
 	createDenoiseDescriptorSet();
 	createDenoiseCompPipeline();
+	if (m_deform)
+		createDeformPipeline();
 
 	#ifdef GUI
 	initGUI();
 	#endif
+	printf("Pipelines: %.3f s to create, %s cache\n", m_pipelineSeconds,
+		m_pipelineCacheWarm ? "warm" : "cold");
 }
 
 
 void VkApp::drawFrame()
 {
 	prepareFrame();
+	pollSceneLoad();  // Safe here: the previous frame's fence has been waited on
+	bool instancesEdited = applySceneEdits();
+	bool lodsChanged = updateLods();
+	bool residencyChanged = updateGeometryStreaming();
+	if ((lodsChanged || residencyChanged) && !tlasPerFrame()) {
+		if (m_asQueue)
+			m_tlasStale = true;  // Rebuilt in the background
+		else {
+			// Evicted BLASes must be out of the TLAS before it is traced again.
+			createTopLevelAS();
+			m_rtDesc.write(m_device, 0, m_rtBuilder.getAccelerationStructure());
+		}
+	}
+	if (m_asQueue)
+		pollAsBuilds();
+	readTimestamps();
 
 	VkCommandBufferBeginInfo beginInfo{ VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
 	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
@@ -88,6 +159,11 @@ void VkApp::drawFrame()
 
 	{ // Extra indent for recording commands into m_commandBuffer
 		updateCameraBuffer();
+		updateTextureStreaming();
+		if (m_deform)
+			deformObjects();
+		if (tlasPerFrame())
+			updateTopLevelAS(lodsChanged || residencyChanged || instancesEdited);
 
 		// Draw scene
 		if (useRaytracer) {
@@ -106,6 +182,12 @@ void VkApp::drawFrame()
 	} // Done recording; Execute!
 
 	submitFrame(); // Submit for display
+
+	if (m_firstFrameTime == 0.0) {
+		m_firstFrameTime = glfwGetTime() - m_loadStartTime;
+		printf("First frame: %.3f s\n", m_firstFrameTime);
+	}
+	benchmarkFrame();
 }
 
 VkCommandBuffer VkApp::createTempCmdBuffer()
@@ -157,14 +239,19 @@ void VkApp::submitFrame()
 	vkResetFences(m_device, 1, &m_waitFence);
 
 	// Pipeline stage at which the queue submission will wait (via pWaitSemaphores)
-	const VkPipelineStageFlags waitStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+	// The first frame after a background AS build also waits for its
+	// writes; see vkapp_asbuild.cpp.
+	const VkPipelineStageFlags waitStageMask[] = { VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+		VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR | VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR };
+	const VkSemaphore waitSemaphores[] = { m_readSemaphore, m_asDoneSemaphore };
 
 	// The submit info structure specifies a command buffer queue submission batch
 	VkSubmitInfo _si_{ VK_STRUCTURE_TYPE_SUBMIT_INFO };
 	_si_.pNext = nullptr;
-	_si_.pWaitDstStageMask = &waitStageMask; //  pipeline stages to wait for
-	_si_.waitSemaphoreCount = 1;
-	_si_.pWaitSemaphores = &m_readSemaphore;  // waited upon before execution
+	_si_.pWaitDstStageMask = waitStageMask; //  pipeline stages to wait for
+	_si_.waitSemaphoreCount = m_waitAsDone ? 2 : 1;
+	_si_.pWaitSemaphores = waitSemaphores;  // waited upon before execution
+	m_waitAsDone = false;
 	_si_.signalSemaphoreCount = 1;
 	_si_.pSignalSemaphores = &m_writtenSemaphore; // signaled when execution finishes
 	_si_.commandBufferCount = 1;
@@ -195,7 +282,7 @@ VkShaderModule VkApp::createShaderModule(std::string code)
 
 	VkShaderModule shaderModule = VK_NULL_HANDLE;
 	if (vkCreateShaderModule(m_device, &createInfo, nullptr, &shaderModule) != VK_SUCCESS)
-		assert(0 && "failed to create shader module!");
+		throw std::runtime_error("failed to create shader module!");
 
 	return shaderModule;
 }
@@ -19,6 +19,10 @@
 #include "GLFW/glfw3.h"
 #include "GLFW/glfw3native.h"
 
+#include <atomic>
+#include <future>
+#include <mutex>
+
 #include "shaders/shared_structs.h"
 #include "buffer_wrap.h"
 #include "image_wrap.h"
@@ -30,6 +34,9 @@
 #include <glm/glm.hpp>
 
 #include "acceleration_wrap.h"
+#include "modeldata.h"
+#include "thread_pool.h"
+#include "texcompress.h"
 
 // The OBJ model
 struct ObjData
@@ -37,18 +44,95 @@ struct ObjData
     uint32_t     nbIndices{0};
     uint32_t     nbVertices{0};
     glm::mat4 transform;      // Instance matrix of the object
-    BufferWrap vertexBuffer;    // Device buffer of all 'Vertex'
+    BufferWrap vertexBuffer;    // Device buffer of all 'Vertex' (or vec3 positions if compact)
+    BufferWrap attribBuffer{};  // Device buffer of all 'VertexAttrib' (compact layout only)
+    BufferWrap triAttribBuffer{};  // Device buffer of a 'TriAttrib' per triangle (-triattribs only)
+    BufferWrap restBuffer{};    // Device buffer of a 'DeformRest' per vertex (-deform only)
     BufferWrap indexBuffer;     // Device buffer of the indices forming triangles
     BufferWrap matColorBuffer;  // Device buffer of array of 'Wavefront material'
-    BufferWrap matIndexBuffer;  // Device buffer of array of 'Wavefront material'
+    BufferWrap firstTriBuffer;  // Device buffer of each material range's first triangle
+    std::vector<uint32_t> firstTriangle;  // Host copy: range g is [firstTriangle[g], firstTriangle[g+1])
+    std::vector<bool> alphaTested;        // Host copy: range g is alpha tested by the any-hit shader
+    std::vector<glm::vec3> hostPositions; // Host copies for -hostbuild, released once the BLAS is built
+    std::vector<uint8_t>   hostIndices;   // In indexType
+    uint64_t blasKey{0};                  // Hash of the BLAS build's inputs, for -ascache
+    VkIndexType indexType{VK_INDEX_TYPE_UINT32};  // UINT16 when compact and small enough
+    glm::vec3 center{0.0f};   // Bounding sphere in object space, for LOD selection
+    float     radius{0.0f};
+    std::vector<uint32_t> lodObjects;  // Objects holding LOD 1, 2, ... of this one; empty if none
+    std::vector<Emitter> emitters;     // Emissive triangles in object space; instances place copies
+    uint32_t  txtOffset{0}, nbTextures{0};  // Its texture slots, shared with its clusters and levels
+};
+
+// An object under -geombudget streaming: host copies of the buffers
+// that are evicted, to upload again, and once it has been evicted, its
+// BLAS serialized.  They are kept while the object is resident, so only
+// its first eviction copies anything out.
+struct StreamedGeometry
+{
+    struct Stream
+    {
+        BufferWrap ObjData::* buffer;  // Which of the object's buffers
+        VkBufferUsageFlags    usage;
+        std::vector<char>     bytes;
+    };
+    std::vector<Stream> streams;   // Empty unless the object can be evicted
+    uint32_t proxy{0};             // Drawn and traced in its place while evicted; itself if never evicted
+    bool     resident{true};
+    std::vector<char> blas;        // Empty if -ascache has it on disk instead
+    uint64_t lastHit{0};           // Frame a ray last hit it, or its proxy
+    float    priority{0};
 };
 
 struct ObjInst
 {
     glm::mat4 transform;    // Matrix of the instance
     uint32_t  objIndex;     // Model index
+    uint32_t  lod{0};       // Level of detail currently used; 0 is full detail
+};
+
+// A run of consecutive m_objInst entries sharing one object; the
+// rasterizer draws each run with a single instanced draw.
+struct InstanceRun
+{
+    uint32_t objIndex;
+    uint32_t firstInstance;
+    uint32_t instanceCount;
 };
 
+// A model parsed on a loader thread, waiting for upload by pollSceneLoad.
+struct LoadedModel
+{
+    ModelData meshdata;
+    std::vector<glm::mat4> transforms;  // One instance per transform
+    uint32_t  txtOffset;    // First texture slot reserved for this model
+    std::vector<ModelData> lods;        // With -lod: each a quarter of the previous level's triangles
+    std::vector<AlphaMap> alphaMaps;    // Per texture; consumed by queueLoadedModel
+};
+
+// A texture decoded to RGBA8 on a loader thread, waiting for upload.
+struct DecodedImage
+{
+    uint32_t slot{0};               // Index into m_objText and the texture descriptor array
+    int      width{0}, height{0};
+    unsigned char* pixels{nullptr}; // From stbi_load; freed by createTextureImages
+    CompressedTexture compressed;   // With -bc or -texbudget, the CPU-built mip chain instead of pixels
+};
+
+// A texture under -texbudget streaming: its full mip chain in host
+// memory, of which levels residentMip and coarser are on the GPU.
+struct StreamedTexture
+{
+    CompressedTexture source;
+    uint32_t residentMip{0};
+    uint32_t tailMip{0};            // Finest level of the always resident mip tail
+    std::vector<uint64_t> lastUse;  // Per level: the last frame feedback asked for it
+    size_t   residentBytes{0};
+};
+
+// "fastTrace|compact" and the like, for the AS statistics.
+std::string asFlagNames(VkBuildAccelerationStructureFlagsKHR flags);
+
 class App;
 
 class VkApp
@@ -93,12 +177,14 @@ public:
     void createPhysicalDevice();
 
     uint32_t m_graphicsQueueIndex{VK_QUEUE_FAMILY_IGNORED};
+    uint32_t m_graphicsQueueCount{1};
     void chooseQueueIndex();
 
     VkDevice m_device{};
     void createDevice();
 
     VkQueue m_queue{};
+    VkQueue m_asQueue{VK_NULL_HANDLE};  // Second queue of the family, for background AS builds
     void getCommandQueue();
     
     void loadExtensions();
@@ -167,17 +253,210 @@ public:
     ImageWrap m_denoiseBuffer{};
     void createDenoiseBuffer();
 
+    // Vertex layout chosen at load time: false is the 32 byte 'Vertex';
+    // true is a vec3 position stream plus a 'VertexAttrib' stream.
+    bool m_compactVertices = false;
+
+    // Also chosen at load time: true adds a per-triangle 'TriAttrib'
+    // buffer, which the ray tracer then shades from instead of vertices.
+    bool m_triAttribs = false;
+
+    // Ray cone texture LOD in raygen; -nocones samples level 0 everywhere,
+    // for comparison.
+    bool m_rayCones = true;
+
+    // With -bc, textures are BC1/BC3 encoded on the loader threads,
+    // cached in texcache/, and uploaded with their mips precomputed.
+    bool m_compressTextures = false;
+
+    // With -ascache, BLASes are serialized to ascache/ once built, and
+    // later runs on a compatible driver and device read them back.
+    bool m_asCache = false;
+
+    // Pipeline cache (vkapp_pipecache.cpp): every pipeline is created
+    // through m_pipelineCache, loaded from disk at startup and saved at
+    // shutdown, unless -nopipecache.
+    bool m_usePipelineCache = true;
+    VkPipelineCache m_pipelineCache{VK_NULL_HANDLE};
+    bool m_pipelineCacheWarm = false;  // Whether it started with data from a previous run
+    double m_pipelineSeconds = 0;      // Spent creating pipelines
+    void createPipelineCache();
+    void savePipelineCache();
+
+    // With -split, models are cut into clusters of at most this many
+    // triangles, each its own object and BLAS; 0 keeps one per model.
+    uint32_t m_splitTris = 0;
+
+    // Level of detail (vkapp_lod.cpp): with -lod N, up to N simplified
+    // levels per object, chosen per instance each frame by distance.
+    // Level l+1 is used beyond m_lodDistance*2^l bounding radii.
+    int   m_lodLevels = 0;
+    float m_lodDistance = 4.0f;
+    uint64_t m_lodTriangles = 0;   // Instanced triangles at the current levels
+    void buildLodChain(LoadedModel& loaded, const std::vector<AlphaMap>& alphaMaps);
+    bool updateLods();
+    // The object an instance's level uses, and the object drawn and
+    // traced for it: the same unless geometry streaming evicted the
+    // former, leaving its proxy.
+    uint32_t lodLevelObject(uint32_t objIndex, uint32_t lod) const
+    {
+        return lod == 0 ? objIndex : m_objData[objIndex].lodObjects[lod-1];
+    }
+    uint32_t lodObject(uint32_t objIndex, uint32_t lod) const
+    {
+        uint32_t o = lodLevelObject(objIndex, lod);
+        return o < m_geomStreamed.size() && !m_geomStreamed[o].resident ? m_geomStreamed[o].proxy : o;
+    }
+
     // Arrays of objects instances and textures in the scene
     std::vector<ObjData>  m_objData{};  // Obj data in Vulkan Buffers
     std::vector<ObjDesc>  m_objDesc{};  // Device-addresses of those buffers
     std::vector<ImageWrap>  m_objText{};  // All textures of the scene
     std::vector<ObjInst>  m_objInst{};  // Instances paring an object and a transform
     void myloadModel(const std::string& filename, glm::mat4 transform);
+    void myloadModel(const std::string& filename, const std::vector<glm::mat4>& transforms);
+    void uploadModel(ModelData& meshdata, const std::vector<glm::mat4>& transforms,
+                     uint32_t txtOffset);
+    void loadScene(const std::string& filename);
+
+    // These three buffers are rewritten in place as the scene changes.
+    // Each create function returns true if the contents outgrew the
+    // buffer and it was replaced, so its descriptors must be written.
+    BufferWrap m_instanceBW{};  // Device buffer of instance transforms, in m_objInst order
+    VkDeviceSize m_instanceCapacity{0};
+    glm::mat4* m_instanceTransforms = nullptr;  // m_instanceBW mapped, with -motion only
+    std::vector<InstanceRun> m_instanceRuns{};
+    bool createInstanceBuffer();
 
     BufferWrap m_objDescriptionBW{};  // Device buffer of the OBJ descriptions
-    void createObjDescriptionBuffer();
+    VkDeviceSize m_objDescCapacity{0};
+    bool createObjDescriptionBuffer(uint32_t first = 0);  // Entries before first are unchanged
 
+    std::vector<Emitter> m_emitters{};  // Emissive triangles of all instances, in world space
+    std::vector<uint32_t> m_emitterInstance{};  // Per emitter, its instance
     BufferWrap m_lightBuff{};
+    VkDeviceSize m_lightCapacity{0};
+    bool createLightBuffer();
+    void placeEmitters(uint32_t instIndex);
+    void writeSceneBuffers(uint32_t firstChanged);
+
+    // Runtime scene editing (vkapp_edit.cpp).  Models are added with
+    // myloadModel; these queue the other edits, which drawFrame applies
+    // in order, between frames, once no background AS build is under
+    // way.  Indices are as of when an edit is applied: removing an
+    // instance renumbers those after it.  Thread safe.
+    void addInstances(uint32_t objIndex, const std::vector<glm::mat4>& transforms);
+    void moveInstance(uint32_t instIndex, const glm::mat4& transform);
+    void removeInstance(uint32_t instIndex);
+    void removeModel(uint32_t objIndex);  // A model's object, with its LODs, and all its instances
+    struct SceneEdit
+    {
+        enum Kind { eAddInstances, eMoveInstance, eRemoveInstance, eRemoveModel } kind;
+        uint32_t index;                     // The object for eAddInstances and eRemoveModel, else the instance
+        std::vector<glm::mat4> transforms;  // One for eMoveInstance
+    };
+    std::vector<SceneEdit> m_sceneEdits;    // Guarded by m_loadMutex
+    uint32_t m_editBench = 0;               // -edits: edits still to make once loaded
+    uint32_t m_editBenchCount = 0;
+    double m_editBenchMs = 0, m_editBenchMaxMs = 0;
+    std::vector<uint32_t> m_removedObjects; // Of removed models, still in the TLAS until its rebuild is in
+    bool applySceneEdits();
+    void eraseInstance(uint32_t instIndex);
+    void releaseRemovedObjects();
+    void queueBenchEdits();
+
+    // Streaming scene load: myloadModel only queues work on m_loadPool,
+    // which parses models and decodes textures while frames are being
+    // presented.  pollSceneLoad, called each frame after the fence wait,
+    // uploads whatever has finished.  Texture slots not yet loaded show
+    // m_fallbackText.  Decoded textures are uploaded in batches of up to
+    // TEXTURE_BATCH_BYTES per frame.  Each model takes a run of
+    // consecutive slots; a model finding no run free is drawn untextured.
+    // A removed model's slots are freed once no object uses them and no
+    // load, which might still be decoding into them, is in flight.
+    static const uint32_t MAX_TEXTURES = 1024;  // Size of the texture descriptor array
+    static const size_t TEXTURE_BATCH_BYTES = 64 << 20;
+    std::mutex m_loadMutex;
+    std::vector<LoadedModel>  m_loadedModels{};   // Guarded by m_loadMutex
+    std::vector<DecodedImage> m_decodedImages{};  // Guarded by m_loadMutex
+    std::atomic<int>      m_loadsInFlight{0};     // Models+textures queued but not yet uploaded
+    std::vector<bool> m_textureSlotUsed = std::vector<bool>(MAX_TEXTURES);  // Guarded by m_loadMutex
+    std::vector<std::pair<uint32_t, uint32_t>> m_freedTextureSlots;  // First and count, not yet freed
+    ImageWrap m_fallbackText{};
+    double m_loadStartTime{0}, m_firstFrameTime{0}, m_fullyLoadedTime{0};
+    // Texture load report: first decode start to last upload, and the
+    // decode time summed over the loader threads.  Guarded by m_loadMutex.
+    double m_firstDecodeTime{0}, m_lastTextureTime{0}, m_decodeSeconds{0};
+    uint32_t m_texturesUploaded{0}, m_textureBatches{0};
+    size_t m_textureBytes{0}, m_textureTexels{0};  // Level 0 as uploaded
+    size_t m_textureVramBytes{0}, m_textureRgbaBytes{0};  // All levels: as uploaded, and as RGBA8
+    uint32_t m_textureCacheHits{0};
+    void queueDecodedImage(DecodedImage& image, double decodeStart);
+    void printTextureLoadReport();
+    void createFallbackTexture();
+    bool allocateTextureSlots(uint32_t count, uint32_t& first);
+    void releaseTextureSlots();
+    void pollSceneLoad();
+    void queueLoadedModel(LoadedModel& loaded);
+
+    // Texture streaming (vkapp_texstream.cpp): with -texbudget, only the
+    // mip levels the shaders have recently asked for stay resident, in at
+    // most m_textureBudget bytes.  The shaders write their requests into
+    // m_texFeedback whether or not streaming is on.
+    size_t m_textureBudget = 0;               // 0 keeps every texture fully resident
+    std::vector<StreamedTexture> m_streamed;  // By texture slot; empty source if not streamed
+    size_t m_streamedBytes = 0;               // Resident bytes of all streamed textures
+    uint64_t m_streamFrame = 0;
+    BufferWrap m_texFeedbackBW{};
+    uint32_t* m_texFeedback = nullptr;        // Mapped m_texFeedbackBW, MAX_TEXTURES widths
+    void createTextureFeedbackBuffer();
+    DecodedImage startStreaming(DecodedImage& image);
+    std::vector<ImageWrap>  m_retiredTextures;  // Replaced by streaming; destroyed next frame
+    std::vector<BufferWrap> m_retiredStaging;   // and the staging of their replacements
+    DecodedImage streamedUpload(uint32_t slot, uint32_t firstMip);
+    void replaceStreamedImage(uint32_t slot, uint32_t firstMip);
+    void releaseRetiredTextures();
+    void updateTextureStreaming();
+
+    // Geometry streaming (vkapp_geomstream.cpp): with -geombudget, the
+    // vertex and index buffers and BLASes of objects with a proxy are
+    // resident only while their priority earns them room in
+    // m_geometryBudget bytes.  Evicted objects are drawn and traced as
+    // their proxy.  The ray tracer records which objects its paths hit
+    // in m_objHits whether or not streaming is on.
+    static const uint32_t MAX_OBJECT_HITS = 1 << 18;  // Objects past this get no hit feedback
+    size_t m_geometryBudget = 0;                   // 0 keeps every object resident
+    std::vector<StreamedGeometry> m_geomStreamed;  // By object; empty without -geombudget
+    size_t m_geomResidentBytes = 0;                // Of objects that can be evicted
+    uint32_t m_geomEvictions = 0, m_geomRestores = 0;
+    uint64_t m_geomFrame = 0;
+    std::vector<uint32_t> m_geomEvicting;          // Evicted, but in the TLAS until its background rebuild is in
+    BufferWrap m_objHitsBW{};
+    uint32_t* m_objHits = nullptr;                 // Mapped m_objHitsBW, MAX_OBJECT_HITS flags
+    void createObjectHitBuffer();
+    void buildGeometryProxy(LoadedModel& loaded, const std::vector<AlphaMap>& alphaMaps);
+    void startGeometryStreaming(uint32_t first, uint32_t last);
+    size_t geometryBytes(uint32_t objIndex) const;
+    void evictGeometry(const std::vector<uint32_t>& objects);
+    void releaseEvictedGeometry(const std::vector<uint32_t>& objects);
+    void restoreGeometry(const std::vector<uint32_t>& objects);
+    bool updateGeometryStreaming();
+
+    // Procedural scenes and the -bench report (vkapp_benchmark.cpp)
+    std::string m_sceneName{};       // Model, scene file or -gen spec; for reports
+    int    m_benchFrames{0};         // Frames to time once loaded; 0 for no benchmark
+    int    m_benchCount{0};
+    double m_benchStartTime{0}, m_benchTraceMs{0};
+    bool   m_memoryBudget{false};    // VK_EXT_memory_budget is enabled
+    double deviceLocalMB();
+    VkQueryPool m_timestampPool{VK_NULL_HANDLE};
+    float  m_timestampPeriod{1};
+    bool   m_timestampsWritten{false};
+    double m_traceTimeMs{0};         // GPU time of the most recent vkCmdTraceRaysKHR
+    void generateScene(const std::string& spec);
+    void createTimestampQueries();
+    void readTimestamps();
+    void benchmarkFrame();
     
 
     DescriptorWrap m_scDesc{};
@@ -209,12 +488,71 @@ public:
     // DescriptorWrap m_rtDesc{};
     // void createRtDescriptorSet();
 
-    BufferWrap m_scratch1;
-    BufferWrap m_scratch2;
     RaytracingBuilderKHR m_rtBuilder{};
     BlasInput objectToVkGeometryKHR(const ObjData& model);
     void createBottomLevelAS();
     void createTopLevelAS();
+    VkBuildAccelerationStructureFlagsKHR tlasFlags() const;
+    VkBuildAccelerationStructureFlagsKHR blasPolicy(const ObjData& model) const;
+    std::string m_asStatsPath;  // -asstats: where to write the AS statistics as JSON
+    unsigned m_hostBuildThreads = 0;  // -hostbuild: build BLASes on the host with this many threads
+    void releaseHostGeometry(uint32_t first, uint32_t last);
+    void writeAsStats(const std::string& path);
+    std::vector<VkAccelerationStructureInstanceKHR> tlasInstances(uint32_t nbObjects, uint32_t nbInstances);
+
+    // Background AS builds (vkapp_asbuild.cpp): given m_asQueue, the
+    // BLASes of objects loaded after startup are built on it by a worker
+    // thread, and the TLAS is rebuilt into the back TLAS, while frames
+    // go on tracing the current one.  The objects, and instances, it
+    // covers are a prefix of each: the first m_rtObjects and
+    // m_rtInstances.  One job at a time.
+    uint32_t m_rtObjects = 0, m_rtInstances = 0;
+    std::future<RaytracingBuilderKHR::BlasBuild> m_blasJob;
+    RaytracingBuilderKHR::PendingSubmit m_tlasJob{};  // Ends every job, and signals m_asDoneSemaphore
+    uint32_t m_jobObjects = 0, m_jobInstances = 0;    // What the job will cover
+    bool m_tlasJobBuilds = false;  // Whether m_tlasJob builds the back TLAS, or only signals
+    bool m_tlasStale = false;      // The current TLAS's instances have changed
+    VkSemaphore m_asDoneSemaphore{VK_NULL_HANDLE};
+    bool m_waitAsDone = false;     // The next frame's submission waits on m_asDoneSemaphore
+    void pollAsBuilds();
+    void startBlasJob();
+    void startTlasJob();
+    bool asBuildsIdle() const;
+
+    // Instance motion (vkapp_motion.cpp): with -motion, instances move
+    // every frame and the TLAS is refit in the frame's command buffer,
+    // or rebuilt once the refits have drifted too far.  -deform updates
+    // the TLAS the same way.
+    bool m_instanceMotion = false;
+    uint64_t m_motionFrame = 0;
+    std::vector<glm::mat4> m_restTransforms;  // Where each instance was loaded
+    std::vector<glm::vec3> m_rebuildCenters;  // Where each instance was at the last rebuild
+    bool m_tlasRefit = false;                 // Whether the latest TLAS update was a refit
+    bool m_tlasTimestampsWritten = false;
+    uint32_t m_tlasRefits = 0, m_tlasRebuilds = 0;  // Counted, and timed, as timestamps are read
+    double m_tlasRefitMs = 0, m_tlasRebuildMs = 0;
+    float moveInstances();
+    void updateTopLevelAS(bool instancesChanged);
+    void resetRefitDrift();
+    bool tlasPerFrame() const { return m_instanceMotion || m_deform; }
+
+    // Deforming geometry (vkapp_deform.cpp): with -deform, deform.comp
+    // moves every object's vertices each frame, and its BLAS is refit,
+    // or rebuilt as set by m_deformRebuildFrames and the deformation.
+    bool m_deform = false;
+    uint32_t m_deformRebuildFrames = 0;  // -deform N: rebuild at least every N frames; 0 for never
+    uint64_t m_deformFrame = 0;
+    std::vector<float>    m_deformRebuildPhase;  // Per object, the wave phase at its last rebuild
+    std::vector<uint64_t> m_deformRebuildFrame;  // and the frame
+    VkPipelineLayout m_deformPipelineLayout{VK_NULL_HANDLE};
+    VkPipeline       m_deformPipeline{VK_NULL_HANDLE};
+    bool m_blasTimestampsWritten = false;
+    uint32_t m_blasPendingRefits = 0, m_blasPendingRebuilds = 0;  // Of the frame whose timestamps are pending
+    uint32_t m_blasRefits = 0, m_blasRebuilds = 0;  // Counted, and timed, as timestamps are read
+    double m_blasRefitMs = 0, m_blasRebuildMs = 0;
+    uint32_t deformRebuildPeriod() const;
+    void createDeformPipeline();
+    void deformObjects();
     void createRtAccelerationStructure();
     DescriptorWrap m_rtDesc{};
     void createRtDescriptorSet();
@@ -282,6 +620,9 @@ public:
 
     BufferWrap createBufferWrap(VkDeviceSize size, VkBufferUsageFlags usage,
                                 VkMemoryPropertyFlags properties);
+    bool updateStagedBufferWrap(BufferWrap& bw, VkDeviceSize& capacity,
+                                const void* data, VkDeviceSize size, VkDeviceSize offset,
+                                VkBufferUsageFlags usage);
 
      void copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size);
     
@@ -292,6 +633,10 @@ public:
     void copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t width, uint32_t height);
     
     ImageWrap createTextureImage(std::string fileName);
+    ImageWrap createTextureImage(DecodedImage& image);
+    std::vector<ImageWrap> createTextureImages(std::vector<DecodedImage>& images);
+    DecodedImage decodeImage(const std::string& fileName);
+    void buildImageMips(DecodedImage& image);
     ImageWrap createBufferImage(VkExtent2D& size);
     
     ImageWrap createImageWrap(uint32_t width, uint32_t height,
@@ -301,9 +646,14 @@ public:
                               uint32_t mipLevels=1);
 
     VkImageView createImageView(VkImage image, VkFormat format,
-                                VkImageAspectFlagBits aspect=VK_IMAGE_ASPECT_COLOR_BIT);
+                                VkImageAspectFlagBits aspect=VK_IMAGE_ASPECT_COLOR_BIT,
+                                uint32_t levelCount=1);
     VkSampler createTextureSampler();
     
-    void generateMipmaps(VkImage image, VkFormat imageFormat,
+    void generateMipmaps(VkCommandBuffer commandBuffer, VkImage image, VkFormat imageFormat,
                          int32_t texWidth, int32_t texHeight, uint32_t mipLevels);
+
+    // Last, so it is destroyed, and its workers joined, before anything
+    // they write; destroyAllVulkanResources stops it first anyway.
+    ThreadPool m_loadPool;  // -loadthreads, or one per core
 };
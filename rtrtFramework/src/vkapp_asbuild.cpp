@@ -0,0 +1,108 @@
+//////////////////////////////////////////////////////////////////////
+// Background acceleration structure builds.
+//
+// Models streamed in after startup used to have their BLASes, and a
+// new TLAS, built in pollSceneLoad while the frame waited.  Given a
+// second queue of the graphics family, m_asQueue, they are instead
+// built there while frames go on being drawn with the TLAS as it was:
+//
+//   - startBlasJob hands the new objects' BLAS inputs to a worker
+//     thread, which builds them on m_asQueue from the builder's own
+//     command pool, and waits for them there.
+//   - Once that is done pollAsBuilds commits the BLASes, and
+//     startTlasJob records a rebuild of the TLAS over the new instances
+//     into the back TLAS, submitted to m_asQueue.
+//   - Once that is done too, pollAsBuilds swaps the back TLAS in and
+//     points the descriptor set at it.  The next frame's submission
+//     waits on m_asDoneSemaphore, which the job's last submission
+//     signaled, so its reads are ordered after the job's writes.
+//
+// Both queues are of one family, so nothing changes ownership, and
+// only the AS builds themselves move off the render queue; uploads
+// stay on it.  With -motion or -deform the frame rebuilds the TLAS
+// itself, so the job only signals.  Level of detail and geometry
+// residency changes mark the TLAS stale and are rebuilt the same way;
+// evicted objects are traced as their proxies meanwhile, and destroyed
+// once the rebuilt TLAS is in.  Without a second queue, builds block as
+// before.
+//
+// All of this runs in drawFrame after the fence wait, so no frame is
+// still tracing the TLAS that becomes the back one.
+////////////////////////////////////////////////////////////////////////
+
+#include <chrono>
+
+#include "vkapp.h"
+
+bool VkApp::asBuildsIdle() const
+{
+    return !m_blasJob.valid() && m_tlasJob.cmdBuf == VK_NULL_HANDLE
+        && m_rtObjects == m_objData.size() && m_geomEvicting.empty() && m_removedObjects.empty();
+}
+
+// Advances the job under way, if its step is done, and starts one if
+// there is anything to build.  A finished TLAS job's semaphore is only
+// waited on by the next frame, so the next job starts a frame later,
+// never signaling it twice unwaited.
+void VkApp::pollAsBuilds()
+{
+    if (m_blasJob.valid()) {
+        if (m_blasJob.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+            return;
+        RaytracingBuilderKHR::BlasBuild built = m_blasJob.get();
+        printf("Background BLAS build: %zu objects, %.3f s\n", built.blas.size(), built.seconds);
+        m_rtBuilder.commitBlas(built);
+        releaseHostGeometry(m_rtObjects, m_jobObjects);
+        startTlasJob();
+        return; }
+
+    if (m_tlasJob.cmdBuf != VK_NULL_HANDLE) {
+        if (!m_rtBuilder.poll(m_tlasJob))
+            return;
+        if (m_tlasJobBuilds) {
+            m_rtBuilder.swapTlas();
+            m_rtDesc.write(m_device, 0, m_rtBuilder.getAccelerationStructure());
+            releaseEvictedGeometry(m_geomEvicting);
+            m_geomEvicting.clear();
+            releaseRemovedObjects(); }
+        m_rtObjects   = m_jobObjects;
+        m_rtInstances = m_jobInstances;
+        m_waitAsDone  = true;
+        return; }
+
+    if (m_rtObjects < m_objData.size())
+        startBlasJob();
+    else if (m_tlasStale) {
+        m_jobObjects   = m_rtObjects;
+        m_jobInstances = m_rtInstances;
+        startTlasJob(); }
+}
+
+// Builds the BLASes of every object without one on a worker thread.
+void VkApp::startBlasJob()
+{
+    m_jobObjects   = uint32_t(m_objData.size());
+    m_jobInstances = uint32_t(m_objInst.size());
+
+    std::vector<BlasInput> inputs;
+    for (uint32_t i=m_rtObjects;  i<m_jobObjects;  i++)
+        inputs.emplace_back(objectToVkGeometryKHR(m_objData[i]));
+    m_blasJob = std::async(std::launch::async, [this, inputs]() {
+        return m_rtBuilder.buildBlasDetached(inputs, 0); });
+}
+
+// Rebuilds the TLAS, over the instances of the job, into the back
+// TLAS; or with a per-frame TLAS, only signals.
+void VkApp::startTlasJob()
+{
+    m_tlasStale = false;
+    m_tlasJobBuilds = !tlasPerFrame();
+
+    VkCommandBuffer cmdBuf = m_rtBuilder.createCmdBuffer();
+    if (m_tlasJobBuilds) {
+        vkCmdResetQueryPool(cmdBuf, m_rtBuilder.m_tlasTimestamps, 0, 2);
+        vkCmdWriteTimestamp(cmdBuf, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, m_rtBuilder.m_tlasTimestamps, 0);
+        m_rtBuilder.cmdBuildTlas(cmdBuf, tlasInstances(m_jobObjects, m_jobInstances), tlasFlags(), false, true);
+        vkCmdWriteTimestamp(cmdBuf, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, m_rtBuilder.m_tlasTimestamps, 1); }
+    m_tlasJob = m_rtBuilder.submitNoWait(cmdBuf, m_asDoneSemaphore);
+}
@@ -0,0 +1,432 @@
+//////////////////////////////////////////////////////////////////////
+// Procedural scenes for stress testing, and the -bench report.
+//
+// A generated scene is a set of wavy heightfield objects, instanced on
+// a grid, lit by a ring of small emissive triangles, and textured with
+// procedural checkerboards.  Everything goes through the same
+// LoadedModel/DecodedImage queues as files loaded by myloadModel.
+////////////////////////////////////////////////////////////////////////
+
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "vkapp.h"
+#include "app.h"
+
+#define GLM_FORCE_RADIANS
+#define GLM_SWIZZLE
+#include <glm/glm.hpp>
+#include <glm/gtx/transform.hpp>
+using namespace glm;
+
+struct GenParams
+{
+    uint64_t tris{1'000'000};   // Unique triangles, split over all objects
+    uint32_t instances{1};
+    uint32_t objects{1};
+    uint32_t emitters{8};
+    uint32_t textures{4};
+};
+
+// Parses "tris=1000000,instances=100,objects=4,emitters=8,textures=4";
+// any parameter may be omitted.
+static GenParams parseGenParams(const std::string& spec)
+{
+    GenParams gp;
+    std::istringstream in(spec);
+    std::string item;
+    while (std::getline(in, item, ',')) {
+        size_t eq = item.find('=');
+        if (eq == std::string::npos) continue;
+        std::string key = item.substr(0, eq);
+        uint64_t value = std::stoull(item.substr(eq+1));
+        if      (key == "tris")      gp.tris = value;
+        else if (key == "instances") gp.instances = uint32_t(value);
+        else if (key == "objects")   gp.objects = uint32_t(value);
+        else if (key == "emitters")  gp.emitters = uint32_t(value);
+        else if (key == "textures")  gp.textures = uint32_t(value);
+        else printf("-gen: unknown parameter %s\n", key.c_str()); }
+
+    gp.instances = std::max(gp.instances, 1u);
+    gp.objects = std::min(std::max(gp.objects, 1u), gp.instances);
+    return gp;
+}
+
+// An n by n grid over [-1,1]^2 in XZ, displaced by a few sine waves
+// whose phase depends on seed.  2*n*n triangles.
+static void generateHeightfield(ModelData& meshdata, uint64_t tris, uint32_t seed, int textureId)
+{
+    uint32_t n = std::max(1u, uint32_t(std::ceil(std::sqrt(tris/2.0))));
+    float phase = 1.7f*seed;
+    const float A = 0.08f, F = 7.0f;
+
+    meshdata.vertices.resize(size_t(n+1)*(n+1));
+    for (uint32_t j=0;  j<=n;  j++)
+        for (uint32_t i=0;  i<=n;  i++) {
+            float x = 2.0f*i/n - 1.0f;
+            float z = 2.0f*j/n - 1.0f;
+            float y = A*std::sin(F*x + phase)*std::cos(F*z - phase);
+            float dydx = A*F*std::cos(F*x + phase)*std::cos(F*z - phase);
+            float dydz = -A*F*std::sin(F*x + phase)*std::sin(F*z - phase);
+            Vertex& v = meshdata.vertices[size_t(j)*(n+1) + i];
+            v.pos = vec3(x, y, z);
+            v.nrm = normalize(vec3(-dydx, 1.0f, -dydz));
+            v.texCoord = vec2(2.0f*i/n, 2.0f*j/n); }
+
+    meshdata.indicies.resize(size_t(n)*n*6);
+    uint32_t* ind = meshdata.indicies.data();
+    for (uint32_t j=0;  j<n;  j++)
+        for (uint32_t i=0;  i<n;  i++) {
+            uint32_t a = j*(n+1) + i, b = a+1, c = a+n+1, d = c+1;
+            *ind++ = a;  *ind++ = c;  *ind++ = b;
+            *ind++ = b;  *ind++ = c;  *ind++ = d; }
+
+    Material mat;
+    mat.diffuse = vec3(0.4f + 0.1f*(seed%5), 0.5f, 0.6f - 0.1f*(seed%4));
+    mat.specular = vec3(0.04f);
+    mat.emission = vec3(0.0f);
+    mat.shininess = 40.0f;
+    mat.textureId = textureId;
+    meshdata.materials.push_back(mat);
+    meshdata.matIndx.assign(size_t(n)*n*2, 0);
+}
+
+// Small emissive triangles on a ring of the given radius, at height h.
+static void generateEmitters(ModelData& meshdata, uint32_t count, float radius, float h)
+{
+    Material mat;
+    mat.diffuse = vec3(1.0f);
+    mat.specular = vec3(0.0f);
+    mat.emission = vec3(10.0f);
+    mat.shininess = 0.0f;
+    mat.textureId = -1;
+    meshdata.materials.push_back(mat);
+
+    for (uint32_t e=0;  e<count;  e++) {
+        float t = 2.0f*3.14159265f*e/count;
+        vec3 c(radius*std::cos(t), h, radius*std::sin(t));
+        uint32_t base = uint32_t(meshdata.vertices.size());
+        // Wound so the face normal points down into the scene.
+        meshdata.vertices.push_back({c + vec3(-0.3f, 0, -0.2f), vec3(0,-1,0), vec2(0)});
+        meshdata.vertices.push_back({c + vec3( 0.3f, 0, -0.2f), vec3(0,-1,0), vec2(0)});
+        meshdata.vertices.push_back({c + vec3( 0.0f, 0,  0.3f), vec3(0,-1,0), vec2(0)});
+        meshdata.indicies.insert(meshdata.indicies.end(), {base, base+1, base+2});
+        meshdata.matIndx.push_back(0); }
+}
+
+// A 512x512 two-tone checkerboard whose colors depend on index.
+static DecodedImage generateChecker(uint32_t index)
+{
+    DecodedImage image;
+    image.width = image.height = 512;
+    image.pixels = (unsigned char*)malloc(size_t(image.width)*image.height*4);
+    unsigned char r = 80 + 37*index%170, g = 80 + 71*index%170, b = 80 + 113*index%170;
+    for (int y=0;  y<image.height;  y++)
+        for (int x=0;  x<image.width;  x++) {
+            bool light = ((x/32) + (y/32)) & 1;
+            unsigned char* p = image.pixels + 4*(size_t(y)*image.width + x);
+            p[0] = light ? r : r/2;
+            p[1] = light ? g : g/2;
+            p[2] = light ? b : b/2;
+            p[3] = 255; }
+    return image;
+}
+
+void VkApp::generateScene(const std::string& spec)
+{
+    GenParams gp = parseGenParams(spec);
+    printf("Generating: %llu tris, %u instances, %u objects, %u emitters, %u textures\n",
+           (unsigned long long)gp.tris, gp.instances, gp.objects, gp.emitters, gp.textures);
+
+    // Instances on a square grid, 2.5 units apart, centered on the origin.
+    uint32_t side = uint32_t(std::ceil(std::sqrt(double(gp.instances))));
+    const float spacing = 2.5f;
+    auto gridTransform = [&](uint32_t k) {
+        float x = (float(k%side) - 0.5f*(side-1))*spacing;
+        float z = (float(k/side) - 0.5f*(side-1))*spacing;
+        return glm::translate(vec3(x, 0.0f, z)); };
+
+    // Textures are shared by all objects, in slots reserved up front.
+    uint32_t nbTextures = std::min(gp.textures, MAX_TEXTURES), txtOffset;
+    if (!allocateTextureSlots(nbTextures, txtOffset))
+        nbTextures = 0;
+    for (uint32_t t=0;  t<nbTextures;  t++) {
+        m_loadsInFlight++;
+        m_loadPool.submit([this, t, txtOffset]() {
+            double decodeStart = glfwGetTime();
+            DecodedImage image = generateChecker(t);
+            if (m_compressTextures || m_textureBudget > 0)
+                buildImageMips(image);
+            image.slot = txtOffset + t;
+            queueDecodedImage(image, decodeStart); }); }
+
+    // Instances are dealt out to the objects round-robin.
+    std::vector<std::vector<mat4>> transforms(gp.objects);
+    for (uint32_t k=0;  k<gp.instances;  k++)
+        transforms[k%gp.objects].push_back(gridTransform(k));
+
+    for (uint32_t o=0;  o<gp.objects;  o++) {
+        uint64_t tris = gp.tris/gp.objects + (o < gp.tris%gp.objects ? 1 : 0);
+        int textureId = nbTextures > 0 ? int(o%nbTextures) : -1;
+        m_loadsInFlight++;
+        m_loadPool.submit([this, tris, o, textureId, txtOffset, xforms=transforms[o]]() {
+            LoadedModel loaded;
+            generateHeightfield(loaded.meshdata, tris, o, textureId);
+            loaded.transforms = xforms;
+            loaded.txtOffset = txtOffset;
+            queueLoadedModel(loaded); }); }
+
+    if (gp.emitters > 0) {
+        float radius = 0.5f*side*spacing;
+        m_loadsInFlight++;
+        m_loadPool.submit([this, gp, radius]() {
+            LoadedModel loaded;
+            generateEmitters(loaded.meshdata, gp.emitters, std::max(radius, 1.0f), 3.0f);
+            loaded.transforms = {mat4(1.0f)};
+            loaded.txtOffset = 0;
+            queueLoadedModel(loaded); }); }
+}
+
+// Two timestamps bracketing vkCmdTraceRaysKHR, two more bracketing the
+// per-frame TLAS update, and with -deform three around the BLAS refits
+// and rebuilds; read back one frame later once the fence says they are
+// available.
+void VkApp::createTimestampQueries()
+{
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(m_physicalDevice, &properties);
+    m_timestampPeriod = properties.limits.timestampPeriod;
+
+    VkQueryPoolCreateInfo qpci{VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO};
+    qpci.queryType  = VK_QUERY_TYPE_TIMESTAMP;
+    qpci.queryCount = 7;
+    vkCreateQueryPool(m_device, &qpci, nullptr, &m_timestampPool);
+    // @@ Destroy with vkDestroyQueryPool(m_device, m_timestampPool, nullptr);
+}
+
+void VkApp::readTimestamps()
+{
+    uint64_t ticks[2];
+    if (m_timestampsWritten
+        && vkGetQueryPoolResults(m_device, m_timestampPool, 0, 2, sizeof(ticks), ticks,
+                                 sizeof(uint64_t), VK_QUERY_RESULT_64_BIT) == VK_SUCCESS)
+        m_traceTimeMs = (ticks[1] - ticks[0]) * m_timestampPeriod * 1e-6;
+    m_timestampsWritten = false;
+
+    if (m_tlasTimestampsWritten
+        && vkGetQueryPoolResults(m_device, m_timestampPool, 2, 2, sizeof(ticks), ticks,
+                                 sizeof(uint64_t), VK_QUERY_RESULT_64_BIT) == VK_SUCCESS) {
+        double ms = (ticks[1] - ticks[0]) * m_timestampPeriod * 1e-6;
+        m_rtBuilder.m_tlasStats.buildMs = ms;
+        if (m_tlasRefit) {
+            m_tlasRefits++;
+            m_tlasRefitMs += ms; }
+        else {
+            m_tlasRebuilds++;
+            m_tlasRebuildMs += ms; } }
+    m_tlasTimestampsWritten = false;
+
+    uint64_t blasTicks[3];
+    if (m_blasTimestampsWritten
+        && vkGetQueryPoolResults(m_device, m_timestampPool, 4, 3, sizeof(blasTicks), blasTicks,
+                                 sizeof(uint64_t), VK_QUERY_RESULT_64_BIT) == VK_SUCCESS) {
+        m_blasRefits += m_blasPendingRefits;
+        m_blasRefitMs += (blasTicks[1] - blasTicks[0]) * m_timestampPeriod * 1e-6;
+        m_blasRebuilds += m_blasPendingRebuilds;
+        m_blasRebuildMs += (blasTicks[2] - blasTicks[1]) * m_timestampPeriod * 1e-6; }
+    m_blasTimestampsWritten = false;
+}
+
+// Device-local memory this process has in use, from VK_EXT_memory_budget;
+// -1 without it.
+double VkApp::deviceLocalMB()
+{
+    if (!m_memoryBudget)
+        return -1.0;
+    VkPhysicalDeviceMemoryBudgetPropertiesEXT budget{VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT};
+    VkPhysicalDeviceMemoryProperties2 props{VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2};
+    props.pNext = &budget;
+    vkGetPhysicalDeviceMemoryProperties2(m_physicalDevice, &props);
+    VkDeviceSize bytes = 0;
+    for (uint32_t h=0;  h<props.memoryProperties.memoryHeapCount;  h++)
+        if (props.memoryProperties.memoryHeaps[h].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT)
+            bytes += budget.heapUsage[h];
+    return bytes/1048576.0;
+}
+
+// Called after each submitted frame.  Once the scene is fully loaded,
+// skips a few warm-up frames, times m_benchFrames frames, prints a
+// one-line report and asks the app to exit.
+void VkApp::benchmarkFrame()
+{
+    const int warmup = 10;
+    if (m_benchFrames <= 0 || m_fullyLoadedTime == 0.0)
+        return;
+
+    m_benchCount++;
+    if (m_benchCount <= warmup) {
+        m_benchStartTime = glfwGetTime();
+        m_benchTraceMs = 0.0;
+        m_tlasRefits = m_tlasRebuilds = 0;
+        m_tlasRefitMs = m_tlasRebuildMs = 0.0;
+        m_blasRefits = m_blasRebuilds = 0;
+        m_blasRefitMs = m_blasRebuildMs = 0.0;
+        return; }
+    m_benchTraceMs += m_traceTimeMs;
+    if (m_benchCount < warmup + m_benchFrames)
+        return;
+
+    uint64_t uniqueTris = 0, instancedTris = 0;
+    for (const ObjData& obj : m_objData)
+        uniqueTris += obj.nbIndices/3;
+    for (const ObjInst& inst : m_objInst)
+        instancedTris += m_objData[lodObject(inst.objIndex, inst.lod)].nbIndices/3;
+
+    double frameMs = 1000.0*(glfwGetTime() - m_benchStartTime)/m_benchFrames;
+    double traceMs = m_benchTraceMs/m_benchFrames;
+    double pixels = double(windowSize.width)*windowSize.height;
+    const RaytracingBuilderKHR::Stats& as = m_rtBuilder.m_stats;
+
+    printf("BENCH scene=%s uniqueTris=%llu instancedTris=%llu objects=%zu instances=%zu"
+           " emitters=%zu textures=%zu load=%.3fs blasBuild=%.3fs blasCached=%u blasMB=%.1f"
+           " tlasBuild=%.3fs tlasMB=%.1f deviceMB=%.1f frameMs=%.3f traceMs=%.3f"
+           " Mpaths/s=%.1f texLod=%s tlasRefits=%u refitMs=%.3f tlasRebuilds=%u rebuildMs=%.3f"
+           " blasRefits=%u blasRefitMs=%.4f blasRebuilds=%u blasRebuildMs=%.4f"
+           " geomMB=%.1f geomEvictions=%u geomRestores=%u pipelines=%.3fs pipelineCache=%s\n",
+           m_sceneName.c_str(), (unsigned long long)uniqueTris, (unsigned long long)instancedTris,
+           m_objData.size(), m_objInst.size(),
+           m_emitters.size(), m_objText.size(), m_fullyLoadedTime,
+           as.blasSeconds, as.blasCached, as.blasBytes/1048576.0, as.tlasSeconds, as.tlasBytes/1048576.0,
+           deviceLocalMB(), frameMs, traceMs,
+           traceMs > 0.0 ? pixels/(traceMs*1000.0) : 0.0,
+           m_rayCones ? "cones" : "level0",
+           m_tlasRefits, m_tlasRefits ? m_tlasRefitMs/m_tlasRefits : 0.0,
+           m_tlasRebuilds, m_tlasRebuilds ? m_tlasRebuildMs/m_tlasRebuilds : 0.0,
+           m_blasRefits, m_blasRefits ? m_blasRefitMs/m_blasRefits : 0.0,
+           m_blasRebuilds, m_blasRebuilds ? m_blasRebuildMs/m_blasRebuilds : 0.0,
+           m_geomResidentBytes/1048576.0, m_geomEvictions, m_geomRestores,
+           m_pipelineSeconds, m_pipelineCacheWarm ? "warm" : "cold");
+
+    glfwSetWindowShouldClose(app->GLFW_window, GLFW_TRUE);
+    m_benchFrames = 0;
+}
+
+std::string asFlagNames(VkBuildAccelerationStructureFlagsKHR flags)
+{
+    std::string names;
+    auto add = [&](VkBuildAccelerationStructureFlagsKHR flag, const char* name) {
+        if (flags & flag)
+            names += names.empty() ? name : std::string("|") + name; };
+    add(VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR, "fastTrace");
+    add(VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_BUILD_BIT_KHR, "fastBuild");
+    add(VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR, "update");
+    add(VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR, "compact");
+    return names;
+}
+
+static void writeAsJson(FILE* f, const RaytracingBuilderKHR::AsStats& s)
+{
+    fprintf(f, "{\"primitives\": %u, \"buildBytes\": %llu, \"compactBytes\": %llu,"
+            " \"scratchBytes\": %llu, \"buildMs\": %.4f, \"flags\": \"%s\", \"cached\": %s, \"host\": %s}",
+            s.primitives, (unsigned long long)s.buildSize, (unsigned long long)s.compactSize,
+            (unsigned long long)s.scratchSize, s.buildMs, asFlagNames(s.flags).c_str(),
+            s.cached ? "true" : "false", s.host ? "true" : "false");
+}
+
+// With -asstats, writes every BLAS's statistics, by object, and the
+// TLAS's as JSON once the scene is fully loaded.
+void VkApp::writeAsStats(const std::string& path)
+{
+    FILE* f = fopen(path.c_str(), "w");
+    if (!f) {
+        printf("Could not write %s\n", path.c_str());
+        return; }
+
+    std::string scene;  // Windows paths have backslashes to escape
+    for (char c : m_sceneName) {
+        if (c == '\\' || c == '"')
+            scene += '\\';
+        scene += c; }
+
+    const std::vector<RaytracingBuilderKHR::AsStats>& blas = m_rtBuilder.m_blasStats;
+    fprintf(f, "{\n  \"scene\": \"%s\",\n  \"tlas\": ", scene.c_str());
+    writeAsJson(f, m_rtBuilder.m_tlasStats);
+    fprintf(f, ",\n  \"blas\": [");
+    for (size_t b = 0; b < blas.size(); b++) {
+        fprintf(f, b ? ",\n    " : "\n    ");
+        writeAsJson(f, blas[b]); }
+    fprintf(f, "\n  ]\n}\n");
+    fclose(f);
+    printf("AS statistics written to %s\n", path.c_str());
+}
+
+// Writes a generated heightfield of about tris triangles as an OBJ with
+// an accompanying MTL, for benchmarking the model loaders.
+void writeGeneratedObj(uint64_t tris, const std::string& path)
+{
+    ModelData meshdata;
+    generateHeightfield(meshdata, tris, 0, -1);
+
+    std::string mtlPath = path.substr(0, path.find_last_of('.')) + ".mtl";
+    std::string mtlName = mtlPath.substr(mtlPath.find_last_of("/\\") + 1);
+    FILE* mtl = fopen(mtlPath.c_str(), "w");
+    FILE* obj = fopen(path.c_str(), "w");
+    if (!mtl || !obj) {
+        printf("Could not write %s\n", path.c_str());
+        exit(-1); }
+
+    const Material& m = meshdata.materials[0];
+    fprintf(mtl, "newmtl heightfield\nKd %g %g %g\nKs %g %g %g\nNs %g\n",
+            m.diffuse.x, m.diffuse.y, m.diffuse.z,
+            m.specular.x, m.specular.y, m.specular.z, m.shininess);
+    fclose(mtl);
+
+    fprintf(obj, "mtllib %s\n", mtlName.c_str());
+    for (const Vertex& v : meshdata.vertices)
+        fprintf(obj, "v %.6f %.6f %.6f\n", v.pos.x, v.pos.y, v.pos.z);
+    for (const Vertex& v : meshdata.vertices)
+        fprintf(obj, "vt %.6f %.6f\n", v.texCoord.x, v.texCoord.y);
+    for (const Vertex& v : meshdata.vertices)
+        fprintf(obj, "vn %.6f %.6f %.6f\n", v.nrm.x, v.nrm.y, v.nrm.z);
+    fprintf(obj, "usemtl heightfield\n");
+    const uint32_t* ind = meshdata.indicies.data();
+    for (size_t t=0;  t<meshdata.indicies.size()/3;  t++, ind+=3)
+        fprintf(obj, "f %u/%u/%u %u/%u/%u %u/%u/%u\n",
+                ind[0]+1, ind[0]+1, ind[0]+1, ind[1]+1, ind[1]+1, ind[1]+1,
+                ind[2]+1, ind[2]+1, ind[2]+1);
+    fclose(obj);
+    printf("Wrote %s: %zu triangles\n", path.c_str(), meshdata.matIndx.size());
+}
+
+// Reads path with the native OBJ parser and with Assimp, and prints a
+// line per loader plus the speedup.
+void benchmarkModelLoaders(const std::string& path)
+{
+    uintmax_t bytes = std::filesystem::file_size(path);
+    auto timeLoader = [&](const char* name, auto read) {
+        ModelData meshdata;
+        auto start = std::chrono::high_resolution_clock::now();
+        read(meshdata);
+        double seconds = std::chrono::duration<double>(
+            std::chrono::high_resolution_clock::now() - start).count();
+        printf("LOADBENCH loader=%s tris=%zu verts=%zu materials=%zu seconds=%.3f MBps=%.1f\n",
+               name, meshdata.matIndx.size(), meshdata.vertices.size(),
+               meshdata.materials.size(), seconds, bytes/1e6/seconds);
+        return seconds; };
+
+    double native = timeLoader("obj", [&](ModelData& md) {
+        if (!md.readObjFile(path, mat4(1.0f))) {
+            printf("Could not read %s\n", path.c_str());
+            exit(-1); } });
+    double assimp = timeLoader("assimp", [&](ModelData& md) {
+        try {
+            md.readAssimpFile(path, mat4(1.0f)); }
+        catch (const std::exception& e) {
+            printf("%s: %s\n", path.c_str(), e.what());
+            exit(-1); } });
+    printf("LOADBENCH speedup=%.2f\n", assimp/native);
+}
@@ -0,0 +1,146 @@
+//////////////////////////////////////////////////////////////////////
+// Deforming geometry.
+//
+// With -deform every object's surface ripples: each frame deform.comp
+// pushes each rest position along its rest normal by a travelling wave,
+// and tilts the normal by the wave's slope, writing the vertex buffers
+// the rasterizer, the ray tracer and the BLAS builder read.  Emitters
+// stay at rest.  -triattribs is off under -deform: its per-triangle
+// copies of the normals would stay at rest too.  The BLASes are then updated in
+// the frame's command buffer, ahead of the TLAS update and the trace.
+//
+// An update is normally a refit, which keeps the tree built for the
+// pose of the object's last rebuild and only resizes its boxes.  The
+// further the surface has moved from that pose, the more the boxes
+// overlap and the slower traversal gets.  A vertex has moved at most
+// 2*amplitude*|sin(dphase/2)| since the rebuild, dphase being the wave
+// phase gained since then; past DEFORM_REBUILD_LIMIT bounding radii the
+// BLAS is rebuilt instead.  With -deform N it is also rebuilt whenever
+// N frames have passed since its last rebuild.
+////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#include "vkapp.h"
+#include "app.h"
+
+#define GROUP_SIZE 128  // Must match deform.comp's local_size_x
+
+static const float DEFORM_AMPLITUDE     = 0.05f;  // Bounding radii
+static const float DEFORM_WAVES         = 3.0f;   // Wavelengths across the bounding sphere
+static const float DEFORM_SPEED         = 0.05f;  // Radians per frame
+static const float DEFORM_REBUILD_LIMIT = 0.05f;  // Bounding radii moved since the last rebuild
+
+// Frames between the rebuilds the deformation alone calls for: those
+// the phase takes to move a vertex DEFORM_REBUILD_LIMIT bounding radii.
+uint32_t VkApp::deformRebuildPeriod() const
+{
+    float ratio = DEFORM_REBUILD_LIMIT/(2.0f*DEFORM_AMPLITUDE);
+    if (ratio >= 1.0f)
+        return UINT32_MAX;
+    return uint32_t(std::ceil(2.0f*std::asin(ratio)/DEFORM_SPEED));
+}
+
+void VkApp::createDeformPipeline()
+{
+    // No descriptors: the buffers are passed by device address.
+    VkPushConstantRange pc_info = { VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(PushConstantDeform) };
+    VkPipelineLayoutCreateInfo plCreateInfo{ VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO };
+    plCreateInfo.pushConstantRangeCount = 1;
+    plCreateInfo.pPushConstantRanges = &pc_info;
+    vkCreatePipelineLayout(m_device, &plCreateInfo, nullptr, &m_deformPipelineLayout);
+
+    VkComputePipelineCreateInfo cpCreateInfo{ VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO };
+    cpCreateInfo.layout = m_deformPipelineLayout;
+    cpCreateInfo.stage = createShaderStageInfo(loadFile("spv/deform.comp.spv"),
+        VK_SHADER_STAGE_COMPUTE_BIT);
+    double start = glfwGetTime();
+    vkCreateComputePipelines(m_device, m_pipelineCache, 1, &cpCreateInfo, nullptr, &m_deformPipeline);
+    m_pipelineSeconds += glfwGetTime() - start;
+    vkDestroyShaderModule(m_device, cpCreateInfo.stage.module, nullptr);
+}
+
+// Records the frame's deformation of every object with a BLAS, and the
+// updates of those BLASes, into m_commandBuffer.  Objects whose BLASes
+// are still being built stay at rest.
+void VkApp::deformObjects()
+{
+    uint64_t frame = m_deformFrame++;
+    std::vector<uint32_t> ids;
+    std::vector<BlasInput> inputs;
+    std::vector<bool> rebuild;
+
+    vkCmdBindPipeline(m_commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_deformPipeline);
+    for (uint32_t o=0;  o<m_rtObjects;  o++) {
+        const ObjData& object = m_objData[o];
+        if (object.restBuffer.buffer == VK_NULL_HANDLE || object.nbVertices == 0)
+            continue;
+
+        // Objects loaded since the last frame were built at rest, off the
+        // wave, so their first update is a rebuild.
+        if (o >= m_deformRebuildPhase.size()) {
+            m_deformRebuildPhase.resize(o + 1, 0.0f);
+            m_deformRebuildFrame.resize(o + 1, UINT64_MAX); }
+
+        PushConstantDeform pc;
+        VkBufferDeviceAddressInfo restInfo{VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO,
+            nullptr, object.restBuffer.buffer};
+        VkBufferDeviceAddressInfo vertexInfo{VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO,
+            nullptr, object.vertexBuffer.buffer};
+        pc.restAddress   = vkGetBufferDeviceAddress(m_device, &restInfo);
+        pc.vertexAddress = vkGetBufferDeviceAddress(m_device, &vertexInfo);
+        pc.attribAddress = 0;
+        if (m_compactVertices) {
+            VkBufferDeviceAddressInfo attribInfo{VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO,
+                nullptr, object.attribBuffer.buffer};
+            pc.attribAddress = vkGetBufferDeviceAddress(m_device, &attribInfo); }
+        pc.vertexCount   = object.nbVertices;
+        pc.vertexStride  = uint32_t((m_compactVertices ? sizeof(glm::vec3) : sizeof(Vertex))/sizeof(float));
+        pc.phase         = DEFORM_SPEED*float(frame) + 0.37f*float(o);  // Neighbors out of step
+        pc.amplitude     = DEFORM_AMPLITUDE*object.radius;
+        pc.waveNumber    = 3.14159265f*DEFORM_WAVES/std::max(object.radius, 1e-6f);
+        vkCmdPushConstants(m_commandBuffer, m_deformPipelineLayout,
+            VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(PushConstantDeform), &pc);
+        vkCmdDispatch(m_commandBuffer, (object.nbVertices + GROUP_SIZE - 1) / GROUP_SIZE, 1, 1);
+
+        float moved = 2.0f*DEFORM_AMPLITUDE*std::abs(std::sin(0.5f*(pc.phase - m_deformRebuildPhase[o])));
+        bool rebuildThis = m_deformRebuildFrame[o] == UINT64_MAX
+            || moved > DEFORM_REBUILD_LIMIT
+            || (m_deformRebuildFrames > 0 && frame - m_deformRebuildFrame[o] >= m_deformRebuildFrames);
+        if (rebuildThis) {
+            m_deformRebuildPhase[o] = pc.phase;
+            m_deformRebuildFrame[o] = frame; }
+
+        ids.push_back(o);
+        inputs.push_back(objectToVkGeometryKHR(object));
+        rebuild.push_back(rebuildThis); }
+
+    if (ids.empty())
+        return;
+
+    // The BLAS builds, the rasterizer and the hit shaders read what the
+    // dispatches wrote.
+    VkMemoryBarrier barrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT;
+    vkCmdPipelineBarrier(m_commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR
+                         | VK_PIPELINE_STAGE_VERTEX_INPUT_BIT
+                         | VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+                         0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+    vkCmdResetQueryPool(m_commandBuffer, m_timestampPool, 4, 3);
+    m_rtBuilder.cmdUpdateBlas(m_commandBuffer, ids, inputs, rebuild, 0, m_timestampPool, 4);
+    m_blasTimestampsWritten = true;
+    m_blasPendingRebuilds = uint32_t(std::count(rebuild.begin(), rebuild.end(), true));
+    m_blasPendingRefits = uint32_t(rebuild.size()) - m_blasPendingRebuilds;
+
+    // The TLAS update reads what the BLAS updates wrote.
+    barrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+    barrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
+    vkCmdPipelineBarrier(m_commandBuffer, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                         VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                         0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
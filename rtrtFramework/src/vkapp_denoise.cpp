@@ -59,7 +59,9 @@ void VkApp::createDenoiseCompPipeline()
 
     cpCreateInfo.stage = createShaderStageInfo(loadFile("spv/denoiseX.comp.spv"),
         VK_SHADER_STAGE_COMPUTE_BIT);
-    vkCreateComputePipelines(m_device, {}, 1, &cpCreateInfo, nullptr, &m_denoisePipelineX);
+    double start = glfwGetTime();
+    vkCreateComputePipelines(m_device, m_pipelineCache, 1, &cpCreateInfo, nullptr, &m_denoisePipelineX);
+    m_pipelineSeconds += glfwGetTime() - start;
     vkDestroyShaderModule(m_device, cpCreateInfo.stage.module, nullptr);
 
     // Note: The original plan was to split the denoising shader into
@@ -0,0 +1,251 @@
+//////////////////////////////////////////////////////////////////////
+// Runtime scene editing.
+//
+// Models are added while running as they are at load, by myloadModel:
+// pollSceneLoad uploads them, builds only their BLASes, and writes their
+// descriptions after the existing ones.  The other edits are queued by
+// addInstances, moveInstance, removeInstance and removeModel, from any
+// thread, and applied by applySceneEdits at the top of drawFrame, after
+// the fence wait, so nothing still in flight reads what they change.
+//
+// No edit rebuilds a pipeline or reallocates a descriptor set.  The
+// object description, instance and emitter buffers are rewritten in
+// place, and only replaced, at twice the size, once they outgrow their
+// allocation; only then are their descriptors written.  A removed model
+// keeps its object indices, emptied, so no other description moves.
+// Added, removed and moved instances change the TLAS's instances, so a
+// static TLAS is rebuilt: in the background given m_asQueue, as after a
+// level of detail change, while frames are traced with the TLAS as it
+// was.  A removed model's buffers and BLASes are only destroyed once
+// the rebuilt TLAS is in.  Under -motion or -deform the frame's own
+// TLAS update takes the edits, refitting for moves.  The BLASes of the
+// remaining objects are untouched.
+//
+// Edits wait while background AS builds are under way, as they would
+// change the instances those builds were started with.  Only a model's
+// base object may be removed or instanced; its levels go with it.
+// With -edits N the scene is edited every frame once loaded, N times in
+// all, and the mean and maximum time taken printed.
+////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+
+#include "vkapp.h"
+#include "app.h"
+
+#define GLM_FORCE_RADIANS
+#define GLM_SWIZZLE
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+using namespace glm;
+
+void VkApp::addInstances(uint32_t objIndex, const std::vector<mat4>& transforms)
+{
+    std::lock_guard<std::mutex> lock(m_loadMutex);
+    m_sceneEdits.push_back({SceneEdit::eAddInstances, objIndex, transforms});
+}
+
+void VkApp::moveInstance(uint32_t instIndex, const mat4& transform)
+{
+    std::lock_guard<std::mutex> lock(m_loadMutex);
+    m_sceneEdits.push_back({SceneEdit::eMoveInstance, instIndex, {transform}});
+}
+
+void VkApp::removeInstance(uint32_t instIndex)
+{
+    std::lock_guard<std::mutex> lock(m_loadMutex);
+    m_sceneEdits.push_back({SceneEdit::eRemoveInstance, instIndex, {}});
+}
+
+void VkApp::removeModel(uint32_t objIndex)
+{
+    std::lock_guard<std::mutex> lock(m_loadMutex);
+    m_sceneEdits.push_back({SceneEdit::eRemoveModel, objIndex, {}});
+}
+
+// Whether object o is another's level of detail, or geometry proxy.
+static bool isLevelObject(const std::vector<ObjData>& objData, uint32_t o)
+{
+    for (const ObjData& object : objData)
+        if (std::find(object.lodObjects.begin(), object.lodObjects.end(), o) != object.lodObjects.end())
+            return true;
+    return false;
+}
+
+// Removes instance instIndex and its emitters, renumbering those after it.
+void VkApp::eraseInstance(uint32_t instIndex)
+{
+    m_objInst.erase(m_objInst.begin() + instIndex);
+    if (instIndex < m_restTransforms.size())
+        m_restTransforms.erase(m_restTransforms.begin() + instIndex);
+
+    size_t kept = 0;
+    for (size_t e=0;  e<m_emitters.size();  e++) {
+        if (m_emitterInstance[e] == instIndex)
+            continue;
+        m_emitters[kept] = m_emitters[e];
+        m_emitterInstance[kept++] = m_emitterInstance[e] - (m_emitterInstance[e] > instIndex); }
+    m_emitters.resize(kept);
+    m_emitterInstance.resize(kept);
+}
+
+// Applies the queued edits, and returns whether the set of instances
+// changed, for a per-frame TLAS update to rebuild rather than refit.
+// A static TLAS is rebuilt here, or marked stale for a background
+// rebuild.
+bool VkApp::applySceneEdits()
+{
+    if (m_editBench > 0 && m_fullyLoadedTime > 0.0)
+        queueBenchEdits();
+
+    std::vector<SceneEdit> edits;
+    {
+        std::lock_guard<std::mutex> lock(m_loadMutex);
+        if (m_sceneEdits.empty() || !asBuildsIdle())
+            return false;
+        edits.swap(m_sceneEdits);
+    }
+
+    double start = glfwGetTime();
+    bool instancesChanged = false, instancesMoved = false;
+    for (SceneEdit& edit : edits) {
+        switch (edit.kind) {
+        case SceneEdit::eAddInstances: {
+            if (edit.index >= m_objData.size() || m_objData[edit.index].nbIndices == 0
+                || isLevelObject(m_objData, edit.index)
+                || std::count(m_removedObjects.begin(), m_removedObjects.end(), edit.index)) {
+                printf("Scene edit: no object %u to instance\n", edit.index);
+                break; }
+            for (const mat4& M : edit.transforms) {
+                ObjInst instance;
+                instance.transform = M;
+                instance.objIndex  = edit.index;
+                m_objInst.push_back(instance);
+                placeEmitters(uint32_t(m_objInst.size() - 1)); }
+            instancesChanged = true;
+            break; }
+
+        case SceneEdit::eMoveInstance: {
+            if (edit.index >= m_objInst.size()) {
+                printf("Scene edit: no instance %u to move\n", edit.index);
+                break; }
+            m_objInst[edit.index].transform = edit.transforms[0];
+            if (edit.index < m_restTransforms.size())
+                m_restTransforms[edit.index] = edit.transforms[0];
+
+            // Its emitters are placed again, at the end.
+            size_t kept = 0;
+            for (size_t e=0;  e<m_emitters.size();  e++)
+                if (m_emitterInstance[e] != edit.index) {
+                    m_emitters[kept] = m_emitters[e];
+                    m_emitterInstance[kept++] = m_emitterInstance[e]; }
+            m_emitters.resize(kept);
+            m_emitterInstance.resize(kept);
+            placeEmitters(edit.index);
+            instancesMoved = true;
+            break; }
+
+        case SceneEdit::eRemoveInstance: {
+            if (edit.index >= m_objInst.size()) {
+                printf("Scene edit: no instance %u to remove\n", edit.index);
+                break; }
+            eraseInstance(edit.index);
+            instancesChanged = true;
+            break; }
+
+        case SceneEdit::eRemoveModel: {
+            if (edit.index >= m_objData.size() || m_objData[edit.index].nbIndices == 0
+                || isLevelObject(m_objData, edit.index)
+                || std::count(m_removedObjects.begin(), m_removedObjects.end(), edit.index)) {
+                printf("Scene edit: no model %u to remove\n", edit.index);
+                break; }
+            for (uint32_t i=uint32_t(m_objInst.size());  i-- > 0;  )
+                if (m_objInst[i].objIndex == edit.index)
+                    eraseInstance(i);
+            m_removedObjects.push_back(edit.index);
+            m_removedObjects.insert(m_removedObjects.end(), m_objData[edit.index].lodObjects.begin(),
+                                    m_objData[edit.index].lodObjects.end());
+            instancesChanged = true;
+            break; } } }
+
+    writeSceneBuffers(uint32_t(m_objDesc.size()));
+    m_rtInstances = uint32_t(m_objInst.size());
+    if (tlasPerFrame())
+        releaseRemovedObjects();  // This frame's TLAS update rebuilds it without them
+    else if (instancesChanged || instancesMoved) {
+        if (m_asQueue)
+            m_tlasStale = true;  // Rebuilt in the background; pollAsBuilds then releases them
+        else {
+            createTopLevelAS();
+            m_rtDesc.write(m_device, 0, m_rtBuilder.getAccelerationStructure());
+            releaseRemovedObjects(); } }
+
+    double ms = 1000.0*(glfwGetTime() - start);
+    if (m_editBench > 0 || m_editBenchCount > 0) {
+        m_editBenchCount++;
+        m_editBenchMs += ms;
+        m_editBenchMaxMs = std::max(m_editBenchMaxMs, ms);
+        if (m_editBench == 0)
+            printf("Scene edits: %u, %.3f ms mean, %.3f ms max\n", m_editBenchCount,
+                   m_editBenchMs/m_editBenchCount, m_editBenchMaxMs); }
+    return instancesChanged;
+}
+
+// Empties the objects of removed models, which no TLAS about to be
+// traced references any more.  They keep their indices: no buffers, no
+// BLAS, a zeroed description.  Their texture slots are queued for
+// releaseTextureSlots.
+void VkApp::releaseRemovedObjects()
+{
+    if (m_removedObjects.empty())
+        return;
+    uint32_t firstChanged = uint32_t(m_objDesc.size());
+    std::vector<std::pair<uint32_t, uint32_t>> textureSlots;
+    for (uint32_t o : m_removedObjects) {
+        ObjData& object = m_objData[o];
+        if (object.nbTextures > 0)
+            textureSlots.push_back({object.txtOffset, object.nbTextures});
+        for (BufferWrap* bw : {&object.vertexBuffer, &object.attribBuffer, &object.triAttribBuffer,
+                               &object.restBuffer, &object.indexBuffer, &object.matColorBuffer,
+                               &object.firstTriBuffer})
+            bw->destroy(m_device);
+        object = ObjData{};
+        m_objDesc[o] = ObjDesc{};
+        m_rtBuilder.evictBlas(o);
+        if (o < m_geomStreamed.size()) {
+            m_geomStreamed[o] = StreamedGeometry{};
+            m_geomStreamed[o].proxy = o; }
+        firstChanged = std::min(firstChanged, o); }
+    m_removedObjects.clear();
+    writeSceneBuffers(firstChanged);
+
+    // A split model's clusters share its slots; they are freed with the
+    // last of them.
+    for (auto [first, count] : textureSlots) {
+        bool shared = false;
+        for (const ObjData& object : m_objData)
+            shared = shared || (object.nbTextures > 0 && object.txtOffset == first);
+        if (!shared && std::find(m_freedTextureSlots.begin(), m_freedTextureSlots.end(),
+                                 std::make_pair(first, count)) == m_freedTextureSlots.end())
+            m_freedTextureSlots.push_back({first, count}); }
+}
+
+// -edits: each frame, removes a pseudo-randomly chosen instance and
+// adds one of the same object beside it, so the scene's size holds.
+void VkApp::queueBenchEdits()
+{
+    if (m_objInst.empty()) {
+        m_editBench = 0;
+        return; }
+    static uint32_t seed = 12345;
+    seed = 1664525u*seed + 1013904223u;
+    uint32_t i = (seed >> 8) % uint32_t(m_objInst.size());
+
+    const ObjInst& inst = m_objInst[i];
+    const ObjData& object = m_objData[inst.objIndex];
+    vec3 offset = 2.0f*object.radius*vec3(float(seed & 1) - 0.5f, 0.0f, float((seed >> 1) & 1) - 0.5f);
+    mat4 M = translate(mat4(1.0f), offset)*inst.transform;
+    removeInstance(i);
+    addInstances(inst.objIndex, {M});
+    m_editBench--;
+}
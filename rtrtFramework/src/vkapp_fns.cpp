@@ -10,12 +10,26 @@
 #include "app.h"
 #include "extensions_vk.hpp"
 #include "backends/imgui_impl_vulkan.h"
+#include "stb_image.h"
 
 
 void VkApp::destroyAllVulkanResources()
 {
     // @@
+    // Loader jobs not yet started are dropped; decoded textures not yet
+    // uploaded are freed.
+    m_loadPool.stop();
+    for (DecodedImage& image : m_decodedImages)
+        stbi_image_free(image.pixels);
+    m_decodedImages.clear();
+
+    // Its thread still submits to m_asQueue; its BLASes are committed
+    // so the builder destroys them with the rest.
+    if (m_blasJob.valid()) {
+        RaytracingBuilderKHR::BlasBuild built = m_blasJob.get();
+        m_rtBuilder.commitBlas(built); }
     vkDeviceWaitIdle(m_device);  // Uncomment this when you have an m_device created.
+    m_rtBuilder.finish(m_tlasJob);
 
     // Destroy all vulkan objects.
     // ...  All objects created on m_device must be destroyed before m_device.
@@ -42,6 +56,10 @@ void VkApp::destroyAllVulkanResources()
     int textureSize = m_objText.size();
     for(int i = 0; i < textureSize; ++i)
         m_objText[i].destroy(m_device);
+    m_fallbackText.destroy(m_device);
+    releaseRetiredTextures();
+    vkUnmapMemory(m_device, m_texFeedbackBW.memory);
+    m_texFeedbackBW.destroy(m_device);
 
 
 
@@ -49,12 +67,14 @@ void VkApp::destroyAllVulkanResources()
     //    m_objDesc[i].destroy(m_device);
     m_matrixBW.destroy(m_device);
     m_objDescriptionBW.destroy(m_device);
+    m_instanceBW.destroy(m_device);
     vkDestroyRenderPass(m_device, m_scanlineRenderPass, nullptr);
     vkDestroyFramebuffer(m_device, m_scanlineFramebuffer, nullptr);
     m_scDesc.destroy(m_device);
     m_shaderBindingTableBW.destroy(m_device);
 
     m_rtBuilder.destroy();
+    vkDestroySemaphore(m_device, m_asDoneSemaphore, nullptr);
 
     vkDestroyPipelineLayout(m_device, m_rtPipelineLayout, nullptr);
     vkDestroyPipeline(m_device, m_rtPipeline, nullptr);
@@ -62,13 +82,19 @@ void VkApp::destroyAllVulkanResources()
 
     vkDestroyDescriptorPool(m_device, m_imguiDescPool, nullptr);
     ImGui_ImplVulkan_Shutdown();
+    savePipelineCache();  // After ImGui, whose pipeline was created through it
 
     m_lightBuff.destroy(m_device);
+    vkUnmapMemory(m_device, m_objHitsBW.memory);
+    m_objHitsBW.destroy(m_device);
+    vkDestroyQueryPool(m_device, m_timestampPool, nullptr);
 
     vkDestroyCommandPool(m_device, m_cmdPool, nullptr);
 
     vkDestroyPipelineLayout(m_device, m_scanlinePipelineLayout, nullptr);
     vkDestroyPipeline(m_device, m_scanlinePipeline, nullptr);
+    vkDestroyPipelineLayout(m_device, m_deformPipelineLayout, nullptr);
+    vkDestroyPipeline(m_device, m_deformPipeline, nullptr);
 
     vkDestroyDevice(m_device, nullptr);
     vkDestroyInstance(m_instance, nullptr);
@@ -253,6 +279,7 @@ void VkApp::chooseQueueIndex()
     // Nothing to destroy as m_graphicsQueueIndex is just an integer.
     //m_graphicsQueueIndex = you chosen index;
     m_graphicsQueueIndex = 0;
+    m_graphicsQueueCount = queueProperties[m_graphicsQueueIndex].queueCount;
 }
 
 
@@ -300,11 +327,18 @@ void VkApp::createDevice()
     // Turn off robustBufferAccess (WHY?)
     features2.features.robustBufferAccess = VK_FALSE;
 
-    float priority = 1.0;
+    // Every supported feature is enabled, host commands included if -hostbuild can use them.
+    if (m_hostBuildThreads > 0 && !accelFeature.accelerationStructureHostCommands) {
+        printf("-hostbuild: no host acceleration structure commands; building on the device\n");
+        m_hostBuildThreads = 0; }
+
+    // A second queue of the family, if it has one, for background
+    // acceleration structure builds; see vkapp_asbuild.cpp.
+    float priorities[] = {1.0, 0.5};
     VkDeviceQueueCreateInfo queueInfo{VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO};
     queueInfo.queueFamilyIndex = m_graphicsQueueIndex;
-    queueInfo.queueCount       = 1;
-    queueInfo.pQueuePriorities = &priority;
+    queueInfo.queueCount       = std::min(m_graphicsQueueCount, 2u);
+    queueInfo.pQueuePriorities = priorities;
     
     VkDeviceCreateInfo deviceCreateInfo{VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO};
     deviceCreateInfo.pNext            = &features2; // This is the whole pNext chain
@@ -312,8 +346,19 @@ void VkApp::createDevice()
     deviceCreateInfo.queueCreateInfoCount = 1;
     deviceCreateInfo.pQueueCreateInfos    = &queueInfo;
     
-    deviceCreateInfo.enabledExtensionCount   = static_cast<uint32_t>(reqDeviceExtensions.size());
-    deviceCreateInfo.ppEnabledExtensionNames = reqDeviceExtensions.data();
+    // VK_EXT_memory_budget, if present, reports the memory in use for BENCH.
+    std::vector<const char*> extensions = reqDeviceExtensions;
+    uint32_t extCount = 0;
+    vkEnumerateDeviceExtensionProperties(m_physicalDevice, nullptr, &extCount, nullptr);
+    std::vector<VkExtensionProperties> extensionProperties(extCount);
+    vkEnumerateDeviceExtensionProperties(m_physicalDevice, nullptr, &extCount, extensionProperties.data());
+    for (const VkExtensionProperties& ext : extensionProperties)
+        if (strcmp(ext.extensionName, VK_EXT_MEMORY_BUDGET_EXTENSION_NAME) == 0) {
+            extensions.push_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+            m_memoryBudget = true; }
+
+    deviceCreateInfo.enabledExtensionCount   = static_cast<uint32_t>(extensions.size());
+    deviceCreateInfo.ppEnabledExtensionNames = extensions.data();
 
     if (vkCreateDevice(m_physicalDevice, &deviceCreateInfo, nullptr, &m_device) != VK_SUCCESS)
         throw std::runtime_error("Create Physical Device Failed");
@@ -9,11 +9,14 @@
 
 #include "extensions_vk.hpp"
 #include "vkapp.h"
+#include "fileio.h"
 #include "app.h"
 
 void VkApp::getCommandQueue()
 {
     vkGetDeviceQueue(m_device, m_graphicsQueueIndex, 0, &m_queue);
+    if (m_graphicsQueueCount > 1)
+        vkGetDeviceQueue(m_device, m_graphicsQueueIndex, 1, &m_asQueue);
     // Returns void -- nothing to verify
     // Nothing to destroy -- the queue is owned by the device.
 }
@@ -410,7 +413,7 @@ ImageWrap VkApp::createImageWrap(uint32_t width, uint32_t height,
 }
 
 VkImageView VkApp::createImageView(VkImage image, VkFormat format,
-                                         VkImageAspectFlagBits aspect)
+                                         VkImageAspectFlagBits aspect, uint32_t levelCount)
 {
     VkImageViewCreateInfo viewInfo{VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO};
     viewInfo.image = image;
@@ -418,7 +421,7 @@ VkImageView VkApp::createImageView(VkImage image, VkFormat format,
     viewInfo.format = format;
     viewInfo.subresourceRange.aspectMask = aspect;
     viewInfo.subresourceRange.baseMipLevel = 0;
-    viewInfo.subresourceRange.levelCount = 1;
+    viewInfo.subresourceRange.levelCount = levelCount;
     viewInfo.subresourceRange.baseArrayLayer = 0;
     viewInfo.subresourceRange.layerCount = 1;
     
@@ -643,9 +646,11 @@ void VkApp::createPostPipeline()
     pipelineInfo.subpass = 0;
     pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
 
-    if (vkCreateGraphicsPipelines(m_device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr,
+    double start = glfwGetTime();
+    if (vkCreateGraphicsPipelines(m_device, m_pipelineCache, 1, &pipelineInfo, nullptr,
         &m_postPipeline) != VK_SUCCESS)
         throw std::runtime_error("Create Pipeline fails!");
+    m_pipelineSeconds += glfwGetTime() - start;
 
 
     // The pipeline has fully compiled copies of the shaders, so these
@@ -692,7 +697,7 @@ void VkApp::initGUI()
     init_info.Device = m_device;
     init_info.QueueFamily = m_graphicsQueueIndex;
     init_info.Queue = m_queue;
-    init_info.PipelineCache = VK_NULL_HANDLE;
+    init_info.PipelineCache = m_pipelineCache;
     init_info.DescriptorPool = m_imguiDescPool;
     init_info.Subpass = subpassID;
     init_info.MinImageCount = 2;
@@ -701,7 +706,9 @@ void VkApp::initGUI()
     init_info.CheckVkResultFn = nullptr;
     init_info.Allocator = nullptr;
 
+    double start = glfwGetTime();  // ImGui creates its pipeline here, through m_pipelineCache
     ImGui_ImplVulkan_Init(&init_info, m_postRenderPass);
+    m_pipelineSeconds += glfwGetTime() - start;
 
     // Upload Fonts
     VkCommandBuffer cmdbuf = createTempCmdBuffer();
@@ -714,17 +721,11 @@ void VkApp::initGUI()
 
 std::string VkApp::loadFile(const std::string& filename)
 {
-    std::string   result;
-    std::ifstream stream(filename, std::ios::ate | std::ios::binary);  //ate: Open at file end
-
-    if(!stream.is_open())
-        return result;
-
-    result.reserve(stream.tellg()); // tellg() is last char position in file (i.e.,  length)
-    stream.seekg(0, std::ios::beg);
-
-    result.assign((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
-    return result;
+    // Only shaders are loaded this way; without one nothing can run.
+    std::vector<char> bytes;
+    if (!readFile(filename, bytes) || bytes.empty())
+        throw std::runtime_error("cannot read " + filename + "; build it with make");
+    return std::string(bytes.begin(), bytes.end());
 }
 
 //-------------------------------------------------------------------------------------------------
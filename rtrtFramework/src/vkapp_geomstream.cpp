@@ -0,0 +1,277 @@
+//////////////////////////////////////////////////////////////////////
+// Geometry streaming.
+//
+// With -geombudget MB, each model's coarsest level is its proxy: the
+// last of its -lod chain, or else one simplified level built for the
+// purpose on the loader thread.  The model's other objects may be
+// evicted, leaving the proxy to be drawn and traced in their place
+// (lodObject resolves this), so the TLAS and the rasterizer never see
+// an evicted object.  Proxies, and models too small to have one, stay
+// resident outside the budget.
+//
+// Eviction destroys an object's vertex, attribute and index buffers and
+// its BLAS.  The buffers' contents were kept in host memory at upload.
+// The BLAS is serialized into host memory on its first eviction, unless
+// -ascache already has it on disk, where buildBlasDetached finds it on
+// restore; a missing or incompatible file is rebuilt instead.
+//
+// Each frame updateGeometryStreaming ranks the objects instances use
+// by their largest angular size on screen, raised for objects a ray
+// hit in the last HIT_FRAMES frames (ScBindings::eObjHits), which
+// catches those seen only in reflections or shadows.  The highest
+// ranked evicted objects are restored, up to STREAM_BYTES_PER_FRAME a
+// frame, evicting the lowest ranked resident ones to make room.  An
+// object is only evicted for one ranked EVICT_MARGIN times above it,
+// so near equals don't swap places every frame.
+//
+// Objects are uploaded and built resident, and evicted once over
+// budget, so loading peaks at the budget plus a frame's loads.
+////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <cfloat>
+#include <cstring>
+
+#include "vkapp.h"
+#include "app.h"
+
+#define GLM_FORCE_RADIANS
+#define GLM_SWIZZLE
+#include <glm/glm.hpp>
+using namespace glm;
+
+VkDeviceAddress getBufferDeviceAddress(VkDevice device, VkBuffer buffer);  // vkapp_loadModel.cpp
+
+static const size_t   PROXY_REDUCTION     = 16;   // Of the triangles
+static const size_t   PROXY_MIN_TRIANGLES = 256;
+static const size_t   STREAM_BYTES_PER_FRAME = 64 << 20;
+static const uint64_t HIT_FRAMES   = 30;
+static const float    HIT_PRIORITY = 0.05f;  // Added to the screen size, a fraction of half the screen's height
+static const float    EVICT_MARGIN = 1.25f;
+
+// Host visible and persistently mapped: the host reads and clears it
+// between frames, after the fence wait.
+void VkApp::createObjectHitBuffer()
+{
+    VkDeviceSize size = MAX_OBJECT_HITS*sizeof(uint32_t);
+    m_objHitsBW = createBufferWrap(size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+        | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    vkMapMemory(m_device, m_objHitsBW.memory, 0, size, 0, (void**)&m_objHits);
+    memset(m_objHits, 0, size);
+}
+
+// Loader thread: without -lod, gives loaded.meshdata a proxy as its
+// one level.  updateLods never selects it, as -lod is off.
+void VkApp::buildGeometryProxy(LoadedModel& loaded, const std::vector<AlphaMap>& alphaMaps)
+{
+    size_t triangles = loaded.meshdata.matIndx.size();
+    size_t target = std::max(triangles/PROXY_REDUCTION, PROXY_MIN_TRIANGLES);
+    if (2*target > triangles)
+        return;  // Too small to be worth evicting
+    ModelData proxy = loaded.meshdata.simplify(target);
+    proxy.sortByMaterial(alphaMaps);
+    printf("Proxy: %zu triangles\n", proxy.matIndx.size());
+    loaded.lods.push_back(std::move(proxy));
+}
+
+// Called once a model's objects, first to last, are uploaded: the last
+// is the proxy of the others, and never evicted, so needs no host copies.
+void VkApp::startGeometryStreaming(uint32_t first, uint32_t last)
+{
+    uint32_t proxy = last - 1;
+    for (uint32_t o = first; o < last; o++)
+        m_geomStreamed[o].proxy = proxy;
+    std::vector<StreamedGeometry::Stream>().swap(m_geomStreamed[proxy].streams);
+}
+
+// What an object's eviction frees: its buffers, and its BLAS.
+size_t VkApp::geometryBytes(uint32_t objIndex) const
+{
+    size_t bytes = 0;
+    for (const StreamedGeometry::Stream& s : m_geomStreamed[objIndex].streams)
+        bytes += s.bytes.size();
+    const RaytracingBuilderKHR::AsStats& stats = m_rtBuilder.m_blasStats[objIndex];
+    return bytes + (stats.compactSize ? stats.compactSize : stats.buildSize);
+}
+
+bool VkApp::updateGeometryStreaming()
+{
+    if (m_geometryBudget == 0)
+        return false;
+    uint64_t frame = ++m_geomFrame;
+
+    // Fold in the hits of the frame just finished.  A hit on a proxy
+    // counts for every object it stands in for.
+    uint32_t nbHits = uint32_t(m_geomStreamed.size());
+    if (nbHits > MAX_OBJECT_HITS)
+        nbHits = MAX_OBJECT_HITS;
+    for (uint32_t o = 0; o < nbHits; o++)
+        if (m_objHits[o])
+            m_geomStreamed[o].lastHit = frame;
+    memset(m_objHits, 0, nbHits*sizeof(uint32_t));
+    for (StreamedGeometry& g : m_geomStreamed)
+        if (m_geomStreamed[g.proxy].lastHit == frame)
+            g.lastHit = frame;
+
+    // Residency changes wait for background AS builds, whose TLAS
+    // would otherwise reference BLASes evicted meanwhile, and for the
+    // last evictions to be out of the TLAS.
+    if (m_blasJob.valid() || m_tlasJob.cmdBuf != VK_NULL_HANDLE || !m_geomEvicting.empty())
+        return false;
+
+    // Rank: each object's largest size on screen over the instances
+    // whose level uses it, behind the eye counting as 0.
+    for (StreamedGeometry& g : m_geomStreamed)
+        g.priority = -1.0f;  // Used by no instance
+    mat4 V = app->myCamera.view();
+    float ry = app->myCamera.ry;
+    for (uint32_t i = 0; i < m_rtInstances; i++) {
+        const ObjInst& inst = m_objInst[i];
+        uint32_t o = lodLevelObject(inst.objIndex, inst.lod);
+        const ObjData& object = m_objData[o];
+        const mat4& M = inst.transform;
+        float scale = std::max(length(vec3(M[0])), std::max(length(vec3(M[1])), length(vec3(M[2]))));
+        float r = std::max(scale*object.radius, 1e-6f);
+        vec3 center = vec3(V * M * vec4(object.center, 1.0f));
+        float d = length(center);
+        float size = center.z > r ? 0.0f : d <= r ? 1.0f : std::min(r/(d*ry), 1.0f);
+        m_geomStreamed[o].priority = std::max(m_geomStreamed[o].priority, size); }
+
+    std::vector<uint32_t> wanting, victims;
+    size_t total = 0;
+    for (uint32_t o = 0; o < m_rtObjects; o++) {
+        StreamedGeometry& g = m_geomStreamed[o];
+        if (g.proxy == o)
+            continue;
+        if (g.priority >= 0.0f && g.lastHit != 0 && frame - g.lastHit < HIT_FRAMES)
+            g.priority += HIT_PRIORITY;
+        if (g.resident) {
+            total += geometryBytes(o);
+            victims.push_back(o); }
+        else if (g.priority > 0.0f)
+            wanting.push_back(o); }
+
+    // Highest ranked first for restoring, lowest first for evicting.
+    auto higher = [&](uint32_t a, uint32_t b) { return m_geomStreamed[a].priority > m_geomStreamed[b].priority; };
+    std::sort(wanting.begin(), wanting.end(), higher);
+    std::sort(victims.begin(), victims.end(), [&](uint32_t a, uint32_t b) { return higher(b, a); });
+
+    std::vector<uint32_t> evict, restore;
+    size_t nextVictim = 0;
+    auto evictBelow = [&](float priority) {
+        if (nextVictim == victims.size()
+            || EVICT_MARGIN*m_geomStreamed[victims[nextVictim]].priority >= priority)
+            return false;
+        uint32_t v = victims[nextVictim++];
+        evict.push_back(v);
+        total -= geometryBytes(v);
+        return true; };
+
+    // New loads may have gone over budget.
+    while (total > m_geometryBudget && evictBelow(FLT_MAX))
+        ;
+
+    size_t uploadBytes = 0;
+    for (uint32_t o : wanting) {
+        size_t bytes = geometryBytes(o);
+        if (!restore.empty() && uploadBytes + bytes > STREAM_BYTES_PER_FRAME)
+            break;
+        while (total + bytes > m_geometryBudget && evictBelow(m_geomStreamed[o].priority))
+            ;
+        if (total + bytes > m_geometryBudget)
+            continue;
+        restore.push_back(o);
+        total += bytes;
+        uploadBytes += bytes; }
+
+    m_geomResidentBytes = total;
+    if (evict.empty() && restore.empty())
+        return false;
+    evictGeometry(evict);
+    restoreGeometry(restore);
+    return true;
+}
+
+// Objects are drawn and traced as their proxies from the next frame
+// on.  Given m_asQueue, the current TLAS, still traced until its
+// background rebuild is swapped in, references their BLASes, so they
+// wait in m_geomEvicting for pollAsBuilds to release them.  Otherwise
+// they are released now, and the caller rebuilds the TLAS without them
+// before the next trace.
+void VkApp::evictGeometry(const std::vector<uint32_t>& objects)
+{
+    std::vector<uint32_t> serialize;
+    for (uint32_t o : objects)
+        if (m_geomStreamed[o].blas.empty() && !(m_asCache && m_objData[o].blasKey != 0))
+            serialize.push_back(o);
+    std::vector<std::vector<char>> serialized = m_rtBuilder.serializeBlas(serialize);
+    for (size_t k = 0; k < serialize.size(); k++)
+        m_geomStreamed[serialize[k]].blas = std::move(serialized[k]);
+
+    for (uint32_t o : objects)
+        m_geomStreamed[o].resident = false;
+    m_geomEvictions += uint32_t(objects.size());
+    if (m_asQueue && !tlasPerFrame())
+        m_geomEvicting.insert(m_geomEvicting.end(), objects.begin(), objects.end());
+    else
+        releaseEvictedGeometry(objects);
+}
+
+// Destroys evicted objects' buffers and BLASes.  The previous frame's
+// fence has been waited on and it was the only one in flight, and no
+// TLAS about to be traced references them, so nothing uses them.
+void VkApp::releaseEvictedGeometry(const std::vector<uint32_t>& objects)
+{
+    for (uint32_t o : objects) {
+        for (const StreamedGeometry::Stream& s : m_geomStreamed[o].streams) {
+            (m_objData[o].*s.buffer).destroy(m_device);
+            m_objData[o].*s.buffer = BufferWrap{}; }
+        m_rtBuilder.evictBlas(o); }
+}
+
+// Uploads objects' buffers from their host copies, points their object
+// descriptions at them, and brings back their BLASes.
+void VkApp::restoreGeometry(const std::vector<uint32_t>& objects)
+{
+    if (objects.empty())
+        return;
+    VkCommandBuffer cmdBuf = createTempCmdBuffer();
+    for (uint32_t o : objects)
+        for (const StreamedGeometry::Stream& s : m_geomStreamed[o].streams)
+            m_objData[o].*s.buffer = createStagedBufferWrap(cmdBuf, s.bytes, s.usage);
+    submitTempCmdBuffer(cmdBuf);
+
+    for (uint32_t o : objects) {
+        const ObjData& object = m_objData[o];
+        ObjDesc& desc = m_objDesc[o];
+        desc.vertexAddress    = getBufferDeviceAddress(m_device, object.vertexBuffer.buffer);
+        desc.indexAddress     = getBufferDeviceAddress(m_device, object.indexBuffer.buffer);
+        desc.attribAddress    = m_compactVertices
+            ? getBufferDeviceAddress(m_device, object.attribBuffer.buffer) : 0;
+        desc.triAttribAddress = m_triAttribs
+            ? getBufferDeviceAddress(m_device, object.triAttribBuffer.buffer) : 0; }
+    if (createObjDescriptionBuffer(*std::min_element(objects.begin(), objects.end())))
+        m_scDesc.write(m_device, ScBindings::eObjDescs, m_objDescriptionBW.buffer);
+
+    // BLASes serialized here are deserialized; the others are read
+    // from ascache/, or rebuilt, by buildBlasDetached.
+    std::vector<uint32_t> deserialize, rebuild;
+    std::vector<const std::vector<char>*> serialized;
+    std::vector<BlasInput> inputs;
+    for (uint32_t o : objects)
+        if (!m_geomStreamed[o].blas.empty()) {
+            deserialize.push_back(o);
+            serialized.push_back(&m_geomStreamed[o].blas); }
+        else {
+            rebuild.push_back(o);
+            inputs.emplace_back(objectToVkGeometryKHR(m_objData[o])); }
+    m_rtBuilder.restoreBlas(deserialize, serialized);
+    if (!rebuild.empty()) {
+        RaytracingBuilderKHR::BlasBuild built = m_rtBuilder.buildBlasDetached(inputs, 0);
+        m_rtBuilder.replaceBlas(rebuild, built); }
+
+    for (uint32_t o : objects)
+        m_geomStreamed[o].resident = true;
+    m_geomRestores += uint32_t(objects.size());
+}
@@ -1,21 +1,30 @@
 //////////////////////////////////////////////////////////////////////
 // Uses the ASSIMP library to read mesh models in of 30+ file types
-// into a structure suitable for the raytracer.
+// into a structure suitable for the raytracer.  Reading and texture
+// decoding run on loader threads; uploads happen in pollSceneLoad.
 ////////////////////////////////////////////////////////////////////////
 
+#include <cfloat>
+#include <cstring>
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <stdexcept>
 #include <string>
 #include <vector>
 #include <array>
+#include <algorithm>
 #include <math.h>
 
 #include <filesystem>
 namespace fs = std::filesystem;
 
 #include "vkapp.h"
+#include "fileio.h"
 
 #include <assimp/Importer.hpp>
+#include <assimp/IOStream.hpp>
+#include <assimp/IOSystem.hpp>
 #include <assimp/version.h>
 #include <assimp/scene.h>
 #include <assimp/postprocess.h>
@@ -23,6 +32,7 @@ namespace fs = std::filesystem;
 #define GLM_FORCE_RADIANS
 #define GLM_SWIZZLE
 #include <glm/glm.hpp>
+#include <glm/gtx/transform.hpp>
 using namespace glm;
 
 #define STBI_FAILURE_USERMSG
@@ -31,18 +41,7 @@ using namespace glm;
 #include "app.h"
 #include "shaders/shared_structs.h"
 
-// Local objects and procedures defined and used here:
-struct ModelData
-{
-    std::vector<Vertex> vertices;
-    std::vector<uint32_t> indicies;
-    std::vector<Material> materials;
-    std::vector<int32_t>     matIndx;
-    std::vector<std::string> textures;
-
-    void readAssimpFile(const std::string& path, const mat4& M);
-};
-
+// Local procedures defined and used here:
 void recurseModelNodes(ModelData* meshdata,
                        const  aiScene* aiscene,
                        const  aiNode* node,
@@ -50,6 +49,13 @@ void recurseModelNodes(ModelData* meshdata,
                        const int level=0);
 
 
+// The bytes of data, for host copies of uploaded buffers.
+template <typename T>
+static std::vector<char> bytesOf(const std::vector<T>& data)
+{
+    return std::vector<char>((const char*)data.data(), (const char*)(data.data() + data.size()));
+}
+
 // Returns an address (as VkDeviceAddress=uint64_t) of a buffer on the GPU.
 VkDeviceAddress getBufferDeviceAddress(VkDevice device, VkBuffer buffer) {
     VkBufferDeviceAddressInfo info = {VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO};
@@ -59,14 +65,121 @@ VkDeviceAddress getBufferDeviceAddress(VkDevice device, VkBuffer buffer) {
 
 void VkApp::myloadModel(const std::string& filename, glm::mat4 transform)
 {
-    ModelData meshdata;
-    meshdata.readAssimpFile(filename.c_str(), transform);
-
-    printf("vertices: %ld\n", meshdata.vertices.size());
-    printf("indices: %ld (%ld)\n", meshdata.indicies.size(), meshdata.indicies.size()/3);
-    printf("materials: %ld\n", meshdata.materials.size());
-    printf("matIndx: %ld\n", meshdata.matIndx.size());
-    printf("textures: %ld\n", meshdata.textures.size());
+    myloadModel(filename, std::vector<glm::mat4>{transform});
+}
+
+// Queues a model for loading on m_loadPool and returns immediately.
+// The worker reads the file, reserves texture slots, queues a decode
+// job per texture, and hands the parsed model to pollSceneLoad.  The
+// model is read once and placed by each of the transforms.
+void VkApp::myloadModel(const std::string& filename, const std::vector<glm::mat4>& transforms)
+{
+    m_loadsInFlight++;
+    m_loadPool.submit([this, filename, transforms]() {
+        // A model that fails to load still counts itself out, or the
+        // scene would never finish loading.
+        try {
+            LoadedModel loaded;
+            loaded.transforms = transforms;
+            double readStart = glfwGetTime();
+            loaded.meshdata.readModelFile(filename, glm::mat4(1.0f));
+            printf("Read %s in %.3f s\n", filename.c_str(), glfwGetTime() - readStart);
+
+            // Without slots for all its textures, the model is drawn
+            // untextured rather than indexing past the descriptor array.
+            auto nbTxt = static_cast<uint32_t>(loaded.meshdata.textures.size());
+            if (!allocateTextureSlots(nbTxt, loaded.txtOffset)) {
+                printf("%s: no %u free texture slots of MAX_TEXTURES; drawn untextured.\n",
+                       filename.c_str(), nbTxt);
+                for (Material& mat : loaded.meshdata.materials)
+                    mat.textureId = -1;
+                loaded.meshdata.textures.clear();
+                nbTxt = 0; }
+
+            // Start every texture read now; the decode jobs then mostly find
+            // their files already cached.
+            for (const std::string& texName : loaded.meshdata.textures)
+                readAhead(texName);
+
+            // Alpha channels are needed before the model can be sorted; only
+            // textures that have one are decoded here.
+            for (const std::string& texName : loaded.meshdata.textures)
+                loaded.alphaMaps.push_back(readAlphaMap(texName));
+
+            for (uint32_t t=0;  t<nbTxt;  t++) {
+                uint32_t slot = loaded.txtOffset + t;
+                m_loadsInFlight++;
+                std::string texName = loaded.meshdata.textures[t];
+                m_loadPool.submit([this, texName, slot]() {
+                    try {
+                        double decodeStart = glfwGetTime();
+                        DecodedImage image = decodeImage(texName);
+                        image.slot = slot;
+                        queueDecodedImage(image, decodeStart); }
+                    catch (const std::exception& e) {
+                        printf("%s: %s\n", texName.c_str(), e.what());
+                        m_loadsInFlight--; } }); }
+
+            queueLoadedModel(loaded); }
+        catch (const std::exception& e) {
+            printf("%s: %s\n", filename.c_str(), e.what());
+            m_loadsInFlight--; } });
+}
+
+// Loader thread side of handing a decoded texture to pollSceneLoad.
+void VkApp::queueDecodedImage(DecodedImage& image, double decodeStart)
+{
+    std::lock_guard<std::mutex> lock(m_loadMutex);
+    if (m_firstDecodeTime == 0.0 || decodeStart < m_firstDecodeTime)
+        m_firstDecodeTime = decodeStart;
+    m_decodeSeconds += glfwGetTime() - decodeStart;
+    m_decodedImages.push_back(std::move(image));
+}
+
+// Loader thread side of handing a model to pollSceneLoad: sorts it by
+// material, classifying alpha-tested triangles, and, with -split, cuts
+// it into clusters which are queued as separate objects sharing the
+// model's transforms and texture slots.  With -lod each part also gets
+// its LOD chain, or with -geombudget alone, a proxy.  The caller has
+// counted one load in flight for the model.
+void VkApp::queueLoadedModel(LoadedModel& loaded)
+{
+    std::vector<AlphaMap> alphaMaps = std::move(loaded.alphaMaps);
+    std::vector<LoadedModel> parts;
+    if (m_splitTris > 0 && loaded.meshdata.matIndx.size() > m_splitTris) {
+        double splitStart = glfwGetTime();
+        std::vector<ModelData> clusters = loaded.meshdata.splitSpatially(m_splitTris);
+        for (ModelData& cluster : clusters)
+            parts.push_back({std::move(cluster), loaded.transforms, loaded.txtOffset});
+        printf("Split %zu triangles into %zu clusters in %.3f s\n",
+               loaded.meshdata.matIndx.size(), parts.size(), glfwGetTime() - splitStart); }
+    else
+        parts.push_back(std::move(loaded));
+
+    for (LoadedModel& part : parts) {
+        part.meshdata.sortByMaterial(alphaMaps);
+        if (m_lodLevels > 0)
+            buildLodChain(part, alphaMaps);
+        else if (m_geometryBudget > 0)
+            buildGeometryProxy(part, alphaMaps); }
+
+    m_loadsInFlight += int(parts.size()) - 1;
+    std::lock_guard<std::mutex> lock(m_loadMutex);
+    for (LoadedModel& part : parts)
+        m_loadedModels.push_back(std::move(part));
+}
+
+// Uploads a parsed model's buffers and adds its object, instances and
+// emitters to the scene.  The model must have been through
+// sortByMaterial.  Main thread only.
+void VkApp::uploadModel(ModelData& meshdata, const std::vector<glm::mat4>& transforms,
+                        uint32_t txtOffset)
+{
+    printf("vertices: %zu\n", meshdata.vertices.size());
+    printf("indices: %zu (%zu)\n", meshdata.indicies.size(), meshdata.indicies.size()/3);
+    printf("materials: %zu\n", meshdata.materials.size());
+    printf("matIndx: %zu\n", meshdata.matIndx.size());
+    printf("textures: %zu\n", meshdata.textures.size());
     
     // @@ Go though the list of meshdata.materials, find the ones that
     // are emitters, and scale the emission up by a factor of 5.  The
@@ -95,45 +208,33 @@ void VkApp::myloadModel(const std::string& filename, glm::mat4 transform)
     // Hint: Triangle i has
     //   vertices in meshdata.vertices, indexed by [3*i], [3*i+1], [3*i+2]
     //   and a material in meshdata.materials, indexed by meshdata.matIndx[i]
-    std::vector<Emitter> emitterList;
-    int matIndicesSize = meshdata.matIndx.size();
-
-    for(int i = 0; i < matIndicesSize; i++)
-    {
-        Emitter tempEmitter;
-        vec3 emission = meshdata.materials[meshdata.matIndx[i]].emission;
-
-        if(dot(emission, emission) > 0)
-        {
-	        vec3 v0 = meshdata.vertices[meshdata.indicies[3 * i]].pos;
-	        vec3 v1 = meshdata.vertices[meshdata.indicies[3 * i + 1]].pos;
-	        vec3 v2 = meshdata.vertices[meshdata.indicies[3 * i + 2]].pos;
-
-            tempEmitter.v0 = v0;
-            tempEmitter.v1 = v1;
-            tempEmitter.v2 = v2;
-            tempEmitter.emission = emission;
-            tempEmitter.normal = normalize(cross(v1 - v0, v2 - v0));
-            tempEmitter.area = length(cross(v1 - v0, v2 - v0)) / 2;
-            tempEmitter.index = i;
-
-            emitterList.push_back(tempEmitter);
-        }
-    }
-
-    m_lightBuff = createBufferWrap(sizeof(emitterList[0]) * emitterList.size(),
-        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
-        | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
-        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-
-    VkCommandBuffer commandBuffer = createTempCmdBuffer();
-    vkCmdUpdateBuffer(commandBuffer, m_lightBuff.buffer, 0,
-        sizeof(emitterList[0]) * emitterList.size(), emitterList.data());
-    submitTempCmdBuffer(commandBuffer);
     
     ObjData object;
     object.nbIndices  = static_cast<uint32_t>(meshdata.indicies.size());
     object.nbVertices = static_cast<uint32_t>(meshdata.vertices.size());
+    object.txtOffset  = txtOffset;
+    object.nbTextures = static_cast<uint32_t>(meshdata.textures.size());
+
+    vec3 lo(FLT_MAX), hi(-FLT_MAX);
+    for (const Vertex& v : meshdata.vertices) {
+        lo = min(lo, v.pos);
+        hi = max(hi, v.pos); }
+    if (!meshdata.vertices.empty()) {
+        object.center = 0.5f*(lo + hi);
+        object.radius = 0.5f*length(hi - lo); }
+
+    // Emitters are kept in object space; placeEmitters gives each
+    // instance its own world space copies.
+    for (uint32_t i=0;  i<meshdata.matIndx.size();  i++) {
+        vec3 emission = meshdata.materials[meshdata.matIndx[i]].emission;
+        if (dot(emission, emission) > 0) {
+            Emitter emitter;
+            emitter.v0       = meshdata.vertices[meshdata.indicies[3*i]].pos;
+            emitter.v1       = meshdata.vertices[meshdata.indicies[3*i + 1]].pos;
+            emitter.v2       = meshdata.vertices[meshdata.indicies[3*i + 2]].pos;
+            emitter.emission = emission;
+            emitter.index    = i;
+            object.emitters.push_back(emitter); } }
 
     // Create the buffers on Device and copy vertices, indices and materials
     VkCommandBuffer    cmdBuf = createTempCmdBuffer();
@@ -142,44 +243,533 @@ void VkApp::myloadModel(const std::string& filename, glm::mat4 transform)
         | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
     VkBufferUsageFlags rtFlags = flag
         | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR;
-  
-    object.vertexBuffer = createStagedBufferWrap(cmdBuf, meshdata.vertices,
-                                         VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | rtFlags);
-    object.indexBuffer = createStagedBufferWrap(cmdBuf, meshdata.indicies,
-                                        VK_BUFFER_USAGE_INDEX_BUFFER_BIT | rtFlags);
+
+    // With -geombudget, the buffers an eviction destroys are also kept
+    // in host memory, to be uploaded again.
+    StreamedGeometry streamed;
+    streamed.proxy = static_cast<uint32_t>(m_objData.size());
+    auto upload = [&](BufferWrap ObjData::* buffer, const auto& data, VkBufferUsageFlags usage) {
+        object.*buffer = createStagedBufferWrap(cmdBuf, data, usage);
+        if (m_geometryBudget > 0)
+            streamed.streams.push_back({buffer, usage, bytesOf(data)}); };
+
+    size_t fullBytes = sizeof(Vertex)*meshdata.vertices.size()
+        + sizeof(uint32_t)*meshdata.indicies.size();
+    
+    if (m_compactVertices) {
+        // Position stream for the AS builder and rasterizer, attribute
+        // stream for shading, and 16 bit indices if the mesh is small enough.
+        std::vector<vec3> positions;
+        std::vector<VertexAttrib> attribs;
+        meshdata.packCompact(positions, attribs);
+        
+        upload(&ObjData::vertexBuffer, positions, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | rtFlags);
+        upload(&ObjData::attribBuffer, attribs, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | flag);
+        size_t compactBytes = sizeof(vec3)*positions.size() + sizeof(VertexAttrib)*attribs.size();
+
+        if (meshdata.vertices.size() <= 0x10000) {
+            std::vector<uint16_t> shortIndices(meshdata.indicies.begin(), meshdata.indicies.end());
+            upload(&ObjData::indexBuffer, shortIndices, VK_BUFFER_USAGE_INDEX_BUFFER_BIT | rtFlags);
+            object.indexType = VK_INDEX_TYPE_UINT16;
+            compactBytes += sizeof(uint16_t)*shortIndices.size(); }
+        else {
+            upload(&ObjData::indexBuffer, meshdata.indicies, VK_BUFFER_USAGE_INDEX_BUFFER_BIT | rtFlags);
+            compactBytes += sizeof(uint32_t)*meshdata.indicies.size(); }
+        
+        printf("vertex+index bytes: %zu compact vs %zu full (%.1f%%)\n",
+               compactBytes, fullBytes, 100.0*compactBytes/fullBytes); }
+    else {
+        upload(&ObjData::vertexBuffer, meshdata.vertices, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | rtFlags);
+        upload(&ObjData::indexBuffer, meshdata.indicies, VK_BUFFER_USAGE_INDEX_BUFFER_BIT | rtFlags);
+        printf("vertex+index bytes: %zu full\n", fullBytes); }
+    
     object.matColorBuffer = createStagedBufferWrap(cmdBuf, meshdata.materials, flag);
-    object.matIndexBuffer = createStagedBufferWrap(cmdBuf, meshdata.matIndx, flag);
+    object.firstTriBuffer = createStagedBufferWrap(cmdBuf, meshdata.firstTriangle, flag);
+
+    if (m_triAttribs) {
+        std::vector<TriAttrib> triAttribs;
+        meshdata.packTriAttribs(triAttribs);
+        upload(&ObjData::triAttribBuffer, triAttribs, flag);
+        printf("triangle attribute bytes: %zu\n", sizeof(TriAttrib)*triAttribs.size()); }
+    object.firstTriangle  = meshdata.firstTriangle;
+    object.alphaTested    = meshdata.alphaTested;
+
+    // Host builds read positions, and indices in the uploaded type.
+    if (m_hostBuildThreads > 0) {
+        object.hostPositions.resize(meshdata.vertices.size());
+        for (size_t v=0;  v<meshdata.vertices.size();  v++)
+            object.hostPositions[v] = meshdata.vertices[v].pos;
+        if (object.indexType == VK_INDEX_TYPE_UINT16) {
+            std::vector<uint16_t> shortIndices(meshdata.indicies.begin(), meshdata.indicies.end());
+            object.hostIndices.assign((const uint8_t*)shortIndices.data(),
+                                      (const uint8_t*)(shortIndices.data() + shortIndices.size())); }
+        else
+            object.hostIndices.assign((const uint8_t*)meshdata.indicies.data(),
+                                      (const uint8_t*)(meshdata.indicies.data() + meshdata.indicies.size())); }
+
+    if (m_deform) {
+        std::vector<DeformRest> rest(meshdata.vertices.size());
+        for (size_t v=0;  v<rest.size();  v++)
+            rest[v] = {meshdata.vertices[v].pos, meshdata.vertices[v].nrm};
+        object.restBuffer = createStagedBufferWrap(cmdBuf, rest, flag); }
+
+    // The BLAS reads positions, indices in the uploaded index type, and
+    // the material ranges with their opacity.
+    if (m_asCache) {
+        std::vector<vec3> positions(meshdata.vertices.size());
+        for (size_t v=0;  v<positions.size();  v++)
+            positions[v] = meshdata.vertices[v].pos;
+        std::vector<uint8_t> alphaTested(meshdata.alphaTested.begin(), meshdata.alphaTested.end());
+        uint64_t parts[] = {
+            contentHash(positions.data(), sizeof(vec3)*positions.size()),
+            contentHash(meshdata.indicies.data(), sizeof(uint32_t)*meshdata.indicies.size()),
+            contentHash(meshdata.firstTriangle.data(), sizeof(uint32_t)*meshdata.firstTriangle.size()),
+            contentHash(alphaTested.data(), alphaTested.size()),
+            uint64_t(object.indexType), uint64_t(m_compactVertices) };
+        object.blasKey = contentHash(parts, sizeof(parts)); }
   
     submitTempCmdBuffer(cmdBuf);
     
-    // Creates all textures on the GPU
-    auto txtOffset = static_cast<uint32_t>(m_objText.size());  // Offset is current size
-    for(const auto& texName : meshdata.textures)
-        m_objText.push_back(createTextureImage(texName));
-
-    // Assuming one instance of an object with its supplied transform.
-    // Could provide multiple transform here to make a vector of instances of this object.
-    ObjInst instance;
-    instance.transform = transform;
-    instance.objIndex  = static_cast<uint32_t>(m_objData.size()); // Index of current object
-    m_objInst.push_back(instance);
+    // Textures are uploaded separately by pollSceneLoad as they finish
+    // decoding, into the slots starting at txtOffset.
+
+    // One instance of this object per supplied transform, kept
+    // consecutive so the rasterizer can draw them in one call.
+    uint32_t firstInst = static_cast<uint32_t>(m_objInst.size());
+    for (const mat4& M : transforms) {
+        ObjInst instance;
+        instance.transform = M;
+        instance.objIndex  = static_cast<uint32_t>(m_objData.size()); // Index of current object
+        m_objInst.push_back(instance); }
 
     // Creating information for device access
     ObjDesc desc;
     desc.txtOffset            = txtOffset;
+    desc.shortIndices         = object.indexType == VK_INDEX_TYPE_UINT16;
     desc.vertexAddress        = getBufferDeviceAddress(m_device, object.vertexBuffer.buffer);
     desc.indexAddress         = getBufferDeviceAddress(m_device, object.indexBuffer.buffer);
     desc.materialAddress      = getBufferDeviceAddress(m_device, object.matColorBuffer.buffer);
-    desc.materialIndexAddress = getBufferDeviceAddress(m_device, object.matIndexBuffer.buffer);
+    desc.firstTriangleAddress = getBufferDeviceAddress(m_device, object.firstTriBuffer.buffer);
+    desc.attribAddress        = m_compactVertices
+        ? getBufferDeviceAddress(m_device, object.attribBuffer.buffer) : 0;
+    desc.triAttribAddress     = m_triAttribs
+        ? getBufferDeviceAddress(m_device, object.triAttribBuffer.buffer) : 0;
 
     m_objData.emplace_back(object);
     m_objDesc.emplace_back(desc);
+    if (m_geometryBudget > 0)
+        m_geomStreamed.push_back(std::move(streamed));
+    for (uint32_t i=firstInst;  i<m_objInst.size();  i++)
+        placeEmitters(i);
 
     // @@ At shutdown:
     //   Destroy all textures with:  for (t:m_objText) t.destroy(m_device); 
     //   Destroy all buffers with:   for (ob:objDesc) ob.destroy(m_device);
 }
 
+// Uploads whatever the loader threads have finished since the last
+// frame.  Called from drawFrame after the fence wait, so no submitted
+// work still references the buffers and descriptors replaced here.
+void VkApp::pollSceneLoad()
+{
+    std::vector<LoadedModel> models;
+    std::vector<DecodedImage> images;
+    {
+        std::lock_guard<std::mutex> lock(m_loadMutex);
+        models.swap(m_loadedModels);
+        
+        // A bounded batch per frame keeps the frame rate interactive.
+        size_t nbImages = 0, bytes = 0;
+        while (nbImages < m_decodedImages.size() && (nbImages == 0 || bytes < TEXTURE_BATCH_BYTES)) {
+            const DecodedImage& image = m_decodedImages[nbImages++];
+            bytes += image.pixels ? size_t(image.width)*image.height*4 : image.compressed.bytes(); }
+        images.assign(std::make_move_iterator(m_decodedImages.begin()),
+                      std::make_move_iterator(m_decodedImages.begin()+nbImages));
+        m_decodedImages.erase(m_decodedImages.begin(), m_decodedImages.begin()+nbImages);
+    }
+
+    if (!models.empty()) {
+        uint32_t firstNew = uint32_t(m_objData.size());
+        for (auto& loaded : models) {
+            uint32_t base = uint32_t(m_objData.size());
+            uploadModel(loaded.meshdata, loaded.transforms, loaded.txtOffset);
+            // LOD objects have no instances or emitters of their own;
+            // instances of the base object switch to them.
+            for (ModelData& lod : loaded.lods) {
+                m_objData[base].lodObjects.push_back(uint32_t(m_objData.size()));
+                uploadModel(lod, {}, loaded.txtOffset); }
+            if (m_geometryBudget > 0)
+                startGeometryStreaming(base, uint32_t(m_objData.size()));
+            m_loadsInFlight--; }
+
+        // Without a second queue the new objects' acceleration
+        // structures are built here, and waited for; otherwise
+        // pollAsBuilds builds them in the background.
+        if (!m_asQueue) {
+            std::vector<BlasInput> newBlas;
+            for (size_t i=firstNew;  i<m_objData.size();  i++)
+                newBlas.emplace_back(objectToVkGeometryKHR(m_objData[i]));
+            m_rtBuilder.buildBlas(newBlas, 0);
+            releaseHostGeometry(m_rtObjects, uint32_t(m_objData.size()));
+            m_rtObjects   = uint32_t(m_objData.size());
+            m_rtInstances = uint32_t(m_objInst.size());
+            createTopLevelAS();
+            m_rtDesc.write(m_device, 0, m_rtBuilder.getAccelerationStructure()); }
+        
+        writeSceneBuffers(firstNew); }
+
+    // Streamed textures upload only their mip tail here; the full chain
+    // stays in m_streamed for updateTextureStreaming.
+    if (m_textureBudget > 0)
+        for (DecodedImage& image : images)
+            if (!image.compressed.levels.empty())
+                image = startStreaming(image);
+
+    if (!images.empty()) {
+        // Level 0 and full chain sizes, as uploaded and as RGBA8.
+        size_t bytes = 0, texels = 0, vramBytes = 0, rgbaBytes = 0;
+        uint32_t cacheHits = 0;
+        for (const DecodedImage& image : images) {
+            size_t w = image.width, h = image.height, rgbaChain = 0;
+            for (;;) {
+                rgbaChain += w*h*4;
+                if (w == 1 && h == 1) break;
+                w = std::max<size_t>(w/2, 1);
+                h = std::max<size_t>(h/2, 1); }
+            rgbaBytes += rgbaChain;
+            texels += size_t(image.width)*image.height;
+            if (image.pixels) {
+                bytes += size_t(image.width)*image.height*4;
+                vramBytes += rgbaChain; }
+            else {
+                bytes += image.compressed.levels[0].size();
+                vramBytes += image.compressed.bytes();
+                cacheHits += image.compressed.fromCache; } }
+        std::vector<ImageWrap> uploaded = createTextureImages(images);
+        for (size_t i=0;  i<images.size();  i++) {
+            uint32_t slot = images[i].slot;
+            if (slot >= m_objText.size())
+                m_objText.resize(slot+1);
+            m_objText[slot] = uploaded[i];
+            m_scDesc.write(m_device, ScBindings::eTextures, m_objText[slot].Descriptor(), slot);
+            m_loadsInFlight--; }
+
+        std::lock_guard<std::mutex> lock(m_loadMutex);
+        m_lastTextureTime = glfwGetTime();
+        m_texturesUploaded += uint32_t(images.size());
+        m_textureBatches++;
+        m_textureBytes += bytes;
+        m_textureTexels += texels;
+        m_textureVramBytes += vramBytes;
+        m_textureRgbaBytes += rgbaBytes;
+        m_textureCacheHits += cacheHits; }
+
+    if (m_loadsInFlight == 0)
+        releaseTextureSlots();
+
+    if (m_loadsInFlight == 0 && asBuildsIdle() && m_fullyLoadedTime == 0.0) {
+        m_fullyLoadedTime = glfwGetTime() - m_loadStartTime;
+        printf("Scene fully loaded: %.3f s\n", m_fullyLoadedTime);
+        printTextureLoadReport();
+        printFileStats();
+        if (!m_asStatsPath.empty())
+            writeAsStats(m_asStatsPath); }
+}
+
+void VkApp::printTextureLoadReport()
+{
+    std::lock_guard<std::mutex> lock(m_loadMutex);
+    if (m_texturesUploaded == 0)
+        return;
+    printf("Textures: %u (%.1f MB) on %u loader threads: %.3f s wall from first decode to last upload,"
+           " %.3f s decoding summed over threads, %u upload batches\n",
+           m_texturesUploaded, m_textureBytes/1048576.0, m_loadPool.size(),
+           m_lastTextureTime - m_firstDecodeTime, m_decodeSeconds, m_textureBatches);
+
+    // Level 0 is what raytrace.rgen fetches, so its bytes per texel are
+    // the bytes a cache-missing texture fetch pulls from memory.
+    if (m_compressTextures && m_textureTexels > 0)
+        printf("BC textures: %.1f MB VRAM vs %.1f MB as RGBA8 (%.1f%% saved), %.2f bytes/texel fetched vs 4,"
+               " %u of %u from texcache\n",
+               m_textureVramBytes/1048576.0, m_textureRgbaBytes/1048576.0,
+               100.0*(1.0 - double(m_textureVramBytes)/m_textureRgbaBytes),
+               double(m_textureBytes)/m_textureTexels, m_textureCacheHits, m_texturesUploaded);
+}
+
+// Appends world space copies of an instance's object's emitters to
+// m_emitters.
+void VkApp::placeEmitters(uint32_t instIndex)
+{
+    const mat4& M = m_objInst[instIndex].transform;
+    for (Emitter emitter : m_objData[m_objInst[instIndex].objIndex].emitters) {
+        emitter.v0 = vec3(M * vec4(emitter.v0, 1));
+        emitter.v1 = vec3(M * vec4(emitter.v1, 1));
+        emitter.v2 = vec3(M * vec4(emitter.v2, 1));
+        vec3 n = cross(emitter.v1 - emitter.v0, emitter.v2 - emitter.v0);
+        emitter.normal = normalize(n);
+        emitter.area   = length(n) / 2;
+        m_emitters.push_back(emitter);
+        m_emitterInstance.push_back(instIndex); }
+}
+
+// Writes m_emitters into the emitter buffer.  A zeroed emitter stands
+// in while the scene is empty.
+bool VkApp::createLightBuffer()
+{
+    Emitter empty{};
+    const Emitter* emitters = m_emitters.empty() ? &empty : m_emitters.data();
+    VkDeviceSize count = std::max<size_t>(m_emitters.size(), 1);
+    m_pcRay.numEmitters = static_cast<int>(m_emitters.size());
+    return updateStagedBufferWrap(m_lightBuff, m_lightCapacity, emitters,
+                                  count*sizeof(Emitter), 0, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+}
+
+// Writes m_objInst's transforms into the instance buffer and splits
+// m_objInst into runs of one object each.  An identity matrix stands in
+// while the scene is empty.  With -motion the buffer is host visible
+// and stays mapped, for moveInstances to rewrite every frame.
+bool VkApp::createInstanceBuffer()
+{
+    std::vector<mat4> transforms;
+    transforms.reserve(std::max<size_t>(m_objInst.size(), 1));
+    m_instanceRuns.clear();
+    for (uint32_t i=0;  i<m_objInst.size();  i++) {
+        const ObjInst& inst = m_objInst[i];
+        transforms.push_back(inst.transform);
+        if (m_instanceRuns.empty() || m_instanceRuns.back().objIndex != inst.objIndex)
+            m_instanceRuns.push_back({inst.objIndex, i, 0});
+        m_instanceRuns.back().instanceCount++; }
+    if (transforms.empty())
+        transforms.push_back(mat4(1.0f));
+
+    VkDeviceSize size = sizeof(mat4)*transforms.size();
+    if (!m_instanceMotion)
+        return updateStagedBufferWrap(m_instanceBW, m_instanceCapacity, transforms.data(),
+                                      size, 0, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+
+    // Freeing the memory unmaps it.
+    bool replaced = size > m_instanceCapacity;
+    if (replaced) {
+        m_instanceBW.destroy(m_device);
+        m_instanceCapacity = 2*size;
+        m_instanceBW = createBufferWrap(m_instanceCapacity, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+                                        | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+        vkMapMemory(m_device, m_instanceBW.memory, 0, m_instanceCapacity, 0, (void**)&m_instanceTransforms); }
+    memcpy(m_instanceTransforms, transforms.data(), size);
+    return replaced;
+}
+
+// Brings the object description, instance and emitter buffers up to
+// date after the scene changed, objects before firstChanged keeping
+// their descriptions, and writes the descriptors of those replaced.
+void VkApp::writeSceneBuffers(uint32_t firstChanged)
+{
+    if (createObjDescriptionBuffer(firstChanged))
+        m_scDesc.write(m_device, ScBindings::eObjDescs, m_objDescriptionBW.buffer);
+    if (createInstanceBuffer())
+        m_scDesc.write(m_device, ScBindings::eInstances, m_instanceBW.buffer);
+    if (createLightBuffer())
+        m_rtDesc.write(m_device, 2, m_lightBuff.buffer);
+}
+
+// Reads a scene description file.  Each line is one of
+//   model    <name> <file>                      (relative to the scene file)
+//   instance <name> <tx ty tz> [<yaw degrees> [<scale>]]
+//   array    <name> <nx ny nz> <dx dy dz>       (an nx*ny*nz grid of instances)
+// with # starting a comment.  Every model is read once, however many
+// instances refer to it.
+void VkApp::loadScene(const std::string& filename)
+{
+    std::vector<char> bytes;
+    if (!readFile(filename, bytes)) {
+        std::cerr << "File not found: "  << filename << std::endl;
+        exit(-1); }
+    std::istringstream in(std::string(bytes.begin(), bytes.end()));
+
+    std::vector<std::string> modelNames;
+    std::vector<std::string> modelFiles;
+    std::vector<std::vector<mat4>> modelInstances;
+    auto findModel = [&](const std::string& name) -> int {
+        for (size_t m=0;  m<modelNames.size();  m++)
+            if (modelNames[m] == name) return int(m);
+        return -1; };
+    
+    std::string line;
+    int lineNo = 0;
+    size_t nbInstances = 0;
+    while (std::getline(in, line)) {
+        lineNo++;
+        line = line.substr(0, line.find('#'));
+        std::istringstream words(line);
+        std::string keyword, name;
+        if (!(words >> keyword))
+            continue;
+        words >> name;
+        
+        if (keyword == "model") {
+            std::string file;
+            words >> file;
+            if (findModel(name) < 0) {
+                fs::path fullPath = filename;
+                fullPath.replace_filename(file);
+                modelNames.push_back(name);
+                modelFiles.push_back(fullPath.u8string());
+                modelInstances.emplace_back(); }
+            continue; }
+        
+        int m = findModel(name);
+        if (m < 0) {
+            printf("%s:%d: unknown model '%s'\n", filename.c_str(), lineNo, name.c_str());
+            continue; }
+
+        if (keyword == "instance") {
+            vec3 t(0.0f);
+            float yaw = 0.0f, scale = 1.0f;
+            words >> t.x >> t.y >> t.z >> yaw >> scale;
+            modelInstances[m].push_back(glm::translate(t)
+                                        * glm::rotate(glm::radians(yaw), vec3(0,1,0))
+                                        * glm::scale(vec3(scale)));
+            nbInstances++; }
+        
+        else if (keyword == "array") {
+            int nx = 1, ny = 1, nz = 1;
+            vec3 d(0.0f);
+            words >> nx >> ny >> nz >> d.x >> d.y >> d.z;
+            for (int i=0;  i<nx;  i++)
+                for (int j=0;  j<ny;  j++)
+                    for (int k=0;  k<nz;  k++)
+                        modelInstances[m].push_back(glm::translate(d*vec3(i, j, k)));
+            nbInstances += size_t(nx)*ny*nz; }
+        
+        else
+            printf("%s:%d: unknown keyword '%s'\n", filename.c_str(), lineNo, keyword.c_str()); }
+
+    printf("Scene %s: %zu models, %zu instances\n", filename.c_str(), modelNames.size(), nbInstances);
+    for (size_t m=0;  m<modelNames.size();  m++)
+        if (!modelInstances[m].empty())
+            readAhead(modelFiles[m]);
+    for (size_t m=0;  m<modelNames.size();  m++)
+        if (!modelInstances[m].empty())
+            myloadModel(modelFiles[m], modelInstances[m]);
+}
+
+// A 1x1 mid-grey texture bound to every texture slot until the real
+// texture has been uploaded.
+void VkApp::createFallbackTexture()
+{
+    DecodedImage image;
+    image.width = 1;
+    image.height = 1;
+    image.pixels = (unsigned char*)malloc(4);  // Released by stbi_image_free, i.e. free()
+    image.pixels[0] = image.pixels[1] = image.pixels[2] = 128;
+    image.pixels[3] = 255;
+    m_fallbackText = createTextureImage(image);
+}
+
+// Reserves count consecutive texture slots, the first run free, and
+// returns whether there was one.  Any thread.
+bool VkApp::allocateTextureSlots(uint32_t count, uint32_t& first)
+{
+    first = 0;
+    if (count == 0)
+        return true;
+    std::lock_guard<std::mutex> lock(m_loadMutex);
+    for (uint32_t run=0, s=0;  s<MAX_TEXTURES;  s++) {
+        run = m_textureSlotUsed[s] ? 0 : run+1;
+        if (run == count) {
+            first = s+1 - count;
+            std::fill(m_textureSlotUsed.begin()+first, m_textureSlotUsed.begin()+s+1, true);
+            return true; } }
+    return false;
+}
+
+// Frees the slots of removed models, showing m_fallbackText in them
+// again.  Only called with no load in flight, so no decode job still
+// holds one of the slots.  Main thread only, after the fence wait.
+void VkApp::releaseTextureSlots()
+{
+    if (m_freedTextureSlots.empty())
+        return;
+    std::lock_guard<std::mutex> lock(m_loadMutex);
+    for (auto [first, count] : m_freedTextureSlots)
+        for (uint32_t slot=first;  slot<first+count;  slot++) {
+            if (slot < m_objText.size()) {
+                m_objText[slot].destroy(m_device);
+                m_objText[slot] = ImageWrap{}; }
+            if (slot < m_streamed.size()) {
+                m_streamedBytes -= m_streamed[slot].residentBytes;
+                m_streamed[slot] = StreamedTexture{}; }
+            m_scDesc.write(m_device, ScBindings::eTextures, m_fallbackText.Descriptor(), slot);
+            m_textureSlotUsed[slot] = false; }
+    m_freedTextureSlots.clear();
+}
+
+// OBJ files go through the native parser in objloader.cpp; everything
+// else, and any OBJ it cannot open, through Assimp.
+void ModelData::readModelFile(const std::string& path, const mat4& M)
+{
+    std::string ext = fs::path(path).extension().u8string();
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    if (ext == ".obj" && readObjFile(path, M))
+        return;
+    readAssimpFile(path, M);
+}
+
+// Routes Assimp's file access through fileio: each file it opens is
+// memory mapped, and its reads are copies out of the mapping.
+class MappedIOStream : public Assimp::IOStream
+{
+public:
+    bool open(const std::string& path) { return m_file.open(path); }
+
+    size_t Read(void* buffer, size_t size, size_t count) override
+    {
+        if (size == 0) return 0;
+        count = std::min(count, (m_file.size - m_pos)/size);
+        if (count > 0) memcpy(buffer, m_file.data + m_pos, size*count);
+        m_pos += size*count;
+        return count;
+    }
+
+    size_t Write(const void*, size_t, size_t) override { return 0; }
+
+    aiReturn Seek(size_t offset, aiOrigin origin) override
+    {
+        size_t base = origin == aiOrigin_CUR ? m_pos : origin == aiOrigin_END ? m_file.size : 0;
+        if (base + offset > m_file.size) return aiReturn_FAILURE;
+        m_pos = base + offset;
+        return aiReturn_SUCCESS;
+    }
+
+    size_t Tell() const override { return m_pos; }
+    size_t FileSize() const override { return m_file.size; }
+    void Flush() override {}
+
+private:
+    MappedFile m_file;
+    size_t m_pos{0};
+};
+
+class MappedIOSystem : public Assimp::IOSystem
+{
+public:
+    bool Exists(const char* path) const override { return fileExists(path); }
+    char getOsSeparator() const override { return '/'; }
+
+    Assimp::IOStream* Open(const char* path, const char* mode) override
+    {
+        if (strchr(mode, 'w') || strchr(mode, 'a')) return nullptr;  // Read only
+        MappedIOStream* stream = new MappedIOStream;
+        if (!stream->open(path)) {
+            delete stream;
+            return nullptr; }
+        return stream;
+    }
+
+    void Close(Assimp::IOStream* stream) override { delete stream; }
+};
+
 void ModelData::readAssimpFile(const std::string& path, const mat4& M)
 {
     printf("ReadAssimpFile File:  %s \n", path.c_str());
@@ -189,25 +779,23 @@ void ModelData::readAssimpFile(const std::string& path, const mat4& M)
                         M[0][2], M[1][2], M[2][2], M[3][2],
                         M[0][3], M[1][3], M[2][3], M[3][3]);
 
-    // Does the file exist?
-    std::ifstream find_it(path.c_str());
-    if (find_it.fail()) {
-        std::cerr << "File not found: "  << path << std::endl;
-        exit(-1); }
+    // Does the file exist?  Failures throw, as this runs on a loader
+    // thread, whose caller reports them and loads on without the model.
+    if (!fileExists(path))
+        throw std::runtime_error("file not found");
 
     // Invoke assimp to read the file.
     printf("Assimp %d.%d Reading %s\n", aiGetVersionMajor(), aiGetVersionMinor(), path.c_str());
     Assimp::Importer importer;
+    importer.SetIOHandler(new MappedIOSystem);  // Owned and deleted by importer
     const aiScene* aiscene = importer.ReadFile(path.c_str(),
                                                aiProcess_Triangulate|aiProcess_GenSmoothNormals);
     
-    if (!aiscene) {
-        printf("... Failed to read.\n");
-        exit(-1); }
+    if (!aiscene)
+        throw std::runtime_error(std::string("Assimp failed to read it: ") + importer.GetErrorString());
 
-    if (!aiscene->mRootNode) {
-        printf("Scene has no rootnode.\n");
-        exit(-1); }
+    if (!aiscene->mRootNode)
+        throw std::runtime_error("scene has no root node");
 
     printf("Assimp mNumMeshes: %d\n", aiscene->mNumMeshes);
     printf("Assimp mNumMaterials: %d\n", aiscene->mNumMaterials);
@@ -262,6 +850,111 @@ void ModelData::readAssimpFile(const std::string& path, const mat4& M)
 
 }
 
+// Reorders the triangles so each material's are contiguous and drops
+// unused materials.  Afterwards materials[g] belongs to the range of
+// triangles [firstTriangle[g], firstTriangle[g+1]), which becomes
+// geometry g of the BLAS and draw g of the rasterizer, so shaders find
+// the material without a per-triangle lookup.  matIndx is kept, remapped,
+// for host side use.
+//
+// Given the alpha maps of the model's textures, alpha-tested triangles
+// that are all hole are dropped, and those that are partly hole get a
+// range of their own, with a copy of the material, marked alphaTested.
+void ModelData::sortByMaterial(const std::vector<AlphaMap>& alphaMaps)
+{
+    size_t nbTris = matIndx.size();
+    std::vector<uint8_t> alphaClass = classifyAlpha(alphaMaps);
+    auto dropped = [&](size_t t) { return !alphaClass.empty() && alphaClass[t] == ALPHA_TRANSPARENT; };
+    auto bucket = [&](size_t t) {  // 2m for material m's opaque triangles, 2m+1 for its mixed ones
+        return 2*size_t(matIndx[t]) + (!alphaClass.empty() && alphaClass[t] == ALPHA_MIXED); };
+
+    std::vector<uint32_t> count(2*materials.size(), 0);
+    for (size_t t=0;  t<nbTris;  t++)
+        if (!dropped(t))
+            count[bucket(t)]++;
+
+    std::vector<Material> used;
+    std::vector<int32_t> remap(2*materials.size(), -1);
+    std::vector<uint32_t> next(2*materials.size(), 0);
+    firstTriangle.clear();
+    alphaTested.clear();
+    uint32_t start = 0;
+    for (size_t b=0;  b<count.size();  b++) {
+        if (count[b] == 0) continue;
+        remap[b] = int32_t(used.size());
+        used.push_back(materials[b/2]);
+        alphaTested.push_back(b & 1);
+        firstTriangle.push_back(start);
+        next[b] = start;
+        start += count[b]; }
+    firstTriangle.push_back(start);
+
+    std::vector<uint32_t> sortedIndices(3*size_t(start));
+    std::vector<int32_t> sortedMatIndx(start);
+    for (size_t t=0;  t<nbTris;  t++) {
+        if (dropped(t)) continue;
+        uint32_t dst = next[bucket(t)]++;
+        sortedIndices[3*dst]   = indicies[3*t];
+        sortedIndices[3*dst+1] = indicies[3*t+1];
+        sortedIndices[3*dst+2] = indicies[3*t+2];
+        sortedMatIndx[dst] = remap[bucket(t)]; }
+
+    if (!alphaClass.empty()) {
+        size_t mixed = 0;
+        for (size_t b=1;  b<count.size();  b+=2)
+            mixed += count[b];
+        printf("Alpha test: %zu of %zu triangles need any-hit, %zu dropped\n",
+               mixed, nbTris, nbTris - start); }
+
+    indicies.swap(sortedIndices);
+    matIndx.swap(sortedMatIndx);
+    materials.swap(used);
+}
+
+// Octahedral normal encoding: project onto the octahedron |x|+|y|+|z|=1,
+// fold the lower hemisphere over the diagonals, and store the
+// resulting square as two snorm16 values.  Decoded by octDecode in
+// shared_structs.h.
+static uint32_t octEncode(vec3 n)
+{
+    n /= (std::abs(n.x) + std::abs(n.y) + std::abs(n.z));
+    vec2 e(n.x, n.y);
+    if (n.z < 0.0f)
+        e = vec2((1.0f - std::abs(n.y)) * (n.x >= 0.0f ? 1.0f : -1.0f),
+                 (1.0f - std::abs(n.x)) * (n.y >= 0.0f ? 1.0f : -1.0f));
+    return glm::packSnorm2x16(e);
+}
+
+// Split the vertices into the compact layout's two streams.
+void ModelData::packCompact(std::vector<vec3>& positions,
+                            std::vector<VertexAttrib>& attribs) const
+{
+    positions.resize(vertices.size());
+    attribs.resize(vertices.size());
+    for (size_t i=0;  i<vertices.size();  i++) {
+        const Vertex& v = vertices[i];
+        positions[i] = v.pos;
+        attribs[i].nrm = dot(v.nrm, v.nrm) > 0.0f ? octEncode(v.nrm) : octEncode(vec3(0,0,1));
+        attribs[i].texCoord = glm::packHalf2x16(v.texCoord); }
+}
+
+// One TriAttrib per triangle, in the (sorted) triangle order.
+void ModelData::packTriAttribs(std::vector<TriAttrib>& triAttribs) const
+{
+    triAttribs.resize(matIndx.size());
+    for (size_t t=0;  t<triAttribs.size();  t++) {
+        TriAttrib& ta = triAttribs[t];
+        const Vertex* v[3] = {&vertices[indicies[3*t]], &vertices[indicies[3*t+1]],
+                              &vertices[indicies[3*t+2]]};
+        for (int j=0;  j<3;  j++) {
+            ta.nrm[j] = dot(v[j]->nrm, v[j]->nrm) > 0.0f ? octEncode(v[j]->nrm) : octEncode(vec3(0,0,1));
+            ta.texCoord[j] = glm::packHalf2x16(v[j]->texCoord); }
+        float area = length(cross(v[1]->pos - v[0]->pos, v[2]->pos - v[0]->pos));
+        vec2 t1 = v[1]->texCoord - v[0]->texCoord;
+        vec2 t2 = v[2]->texCoord - v[0]->texCoord;
+        ta.uvDensity = area > 0.0f ? std::sqrt(std::abs(t1.x*t2.y - t2.x*t1.y)/area) : 0.0f; }
+}
+
 // Recursively traverses the assimp node hierarchy, accumulating
 // modeling transformations, and creating and transforming any meshes
 // found.  Meshes comming from assimp can have associated surface
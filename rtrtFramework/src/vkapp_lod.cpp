@@ -0,0 +1,73 @@
+//////////////////////////////////////////////////////////////////////
+// Level of detail.
+//
+// With -lod N each object gets up to N quadric-simplified levels, each
+// with a quarter of the previous level's triangles, uploaded as objects
+// (and so BLASes) of their own.  Every frame, updateLods picks a level
+// per instance from its distance to the eye in bounding radii; the
+// rasterizer draws, and the TLAS references, that level's object.
+////////////////////////////////////////////////////////////////////////
+
+#include <cmath>
+
+#include "vkapp.h"
+#include "app.h"
+
+#define GLM_FORCE_RADIANS
+#define GLM_SWIZZLE
+#include <glm/glm.hpp>
+using namespace glm;
+
+// Coarser levels stop being worth a BLAS and a draw below this size.
+static const size_t MIN_LOD_TRIANGLES = 256;
+
+// Loader thread: fills loaded.lods from loaded.meshdata.  Each level's
+// triangles are classified against the alpha maps afresh.
+void VkApp::buildLodChain(LoadedModel& loaded, const std::vector<AlphaMap>& alphaMaps)
+{
+    const ModelData* previous = &loaded.meshdata;
+    for (int l=0;  l<m_lodLevels;  l++) {
+        size_t target = previous->matIndx.size()/4;
+        if (target < MIN_LOD_TRIANGLES)
+            break;
+        ModelData lod = previous->simplify(target);
+        lod.sortByMaterial(alphaMaps);
+        printf("LOD %d: %zu triangles\n", l+1, lod.matIndx.size());
+        loaded.lods.push_back(std::move(lod));
+        previous = &loaded.lods.back(); }
+}
+
+// Moves each instance to the level for its current distance.  A level
+// change needs the distance to pass its threshold by 10%, so instances
+// near a threshold don't flicker between levels.  Returns true if any
+// instance changed level, in which case the TLAS must be rebuilt.
+bool VkApp::updateLods()
+{
+    if (m_lodLevels == 0)
+        return false;
+
+    vec3 eye = vec3(inverse(app->myCamera.view())[3]);
+    bool changed = false;
+    uint64_t triangles = 0;
+    for (ObjInst& inst : m_objInst) {
+        const ObjData& object = m_objData[inst.objIndex];
+        uint32_t maxLod = uint32_t(object.lodObjects.size());
+        if (maxLod > 0) {
+            const mat4& M = inst.transform;
+            float scale = std::max(length(vec3(M[0])), std::max(length(vec3(M[1])), length(vec3(M[2]))));
+            vec3 center = vec3(M * vec4(object.center, 1.0f));
+            float d = length(center - eye) / std::max(scale*object.radius, 1e-6f);
+
+            uint32_t lod = inst.lod;
+            while (lod < maxLod && d > 1.1f*m_lodDistance*float(1u << lod))
+                lod++;
+            while (lod > 0 && d < 0.9f*m_lodDistance*float(1u << (lod-1)))
+                lod--;
+            if (lod != inst.lod) {
+                inst.lod = lod;
+                changed = true; } }
+        triangles += m_objData[lodObject(inst.objIndex, inst.lod)].nbIndices/3; }
+
+    m_lodTriangles = triangles;
+    return changed;
+}
@@ -0,0 +1,108 @@
+//////////////////////////////////////////////////////////////////////
+// Instance motion.
+//
+// With -motion every instance drifts about the place it was loaded at,
+// on a path of its own a few bounding radii wide.  Each frame,
+// moveInstances writes the new transforms into the rasterizer's mapped
+// instance buffer, and updateTopLevelAS records a TLAS update into the
+// frame's command buffer ahead of the trace (as it does after -deform's
+// BLAS updates).  Nothing is staged or waited for: the
+// previous frame's fence has been waited on, so the host may overwrite
+// the buffers that frame read.
+//
+// An update is normally a refit, which keeps the tree of the last
+// rebuild and only resizes its boxes.  As instances drift from where
+// they were at that rebuild the boxes overlap more and traversal slows.
+// The drift since the last rebuild, in bounding radii averaged over the
+// instances, stands in for that loss; past REFIT_DRIFT_LIMIT the TLAS
+// is rebuilt instead.  Emitters do not move with their instances.
+////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <cmath>
+
+#include "vkapp.h"
+#include "app.h"
+
+#define GLM_FORCE_RADIANS
+#define GLM_SWIZZLE
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+using namespace glm;
+
+static const float MOTION_AMPLITUDE  = 3.0f;   // Bounding radii
+static const float MOTION_SPEED      = 0.5f;   // Radians per frame at 60 frames per second
+static const float REFIT_DRIFT_LIMIT = 0.5f;   // Mean bounding radii moved since the last rebuild
+
+// An instance's bounding sphere in world space: center, radius.
+static vec4 worldBounds(const ObjData& object, const mat4& M)
+{
+    float scale = std::max(length(vec3(M[0])), std::max(length(vec3(M[1])), length(vec3(M[2]))));
+    return vec4(vec3(M * vec4(object.center, 1.0f)), std::max(scale*object.radius, 1e-6f));
+}
+
+// Remembers where every instance is as of a TLAS rebuild.
+void VkApp::resetRefitDrift()
+{
+    m_rebuildCenters.resize(m_rtInstances);
+    for (size_t i=0;  i<m_rtInstances;  i++)
+        m_rebuildCenters[i] = vec3(worldBounds(m_objData[m_objInst[i].objIndex], m_objInst[i].transform));
+}
+
+// Moves every instance to its place for this frame, and returns their
+// mean drift since the last TLAS rebuild in bounding radii.
+float VkApp::moveInstances()
+{
+    // Instances loaded since the last frame start from where they were placed.
+    for (size_t i=m_restTransforms.size();  i<m_objInst.size();  i++)
+        m_restTransforms.push_back(m_objInst[i].transform);
+
+    float t = MOTION_SPEED*float(m_motionFrame++)/60.0f;
+    float drift = 0.0f;
+    for (size_t i=0;  i<m_objInst.size();  i++) {
+        ObjInst& inst = m_objInst[i];
+        vec4 bounds = worldBounds(m_objData[inst.objIndex], m_restTransforms[i]);
+        float phase = 2.39996f*float(i);  // The golden angle keeps neighbors out of step
+        vec3 offset = MOTION_AMPLITUDE*bounds.w*vec3(sin(t + phase),
+                                                     0.5f*sin(1.3f*t + 2.0f*phase),
+                                                     cos(0.7f*t + phase));
+        inst.transform = translate(mat4(1.0f), offset)*m_restTransforms[i];
+        m_instanceTransforms[i] = inst.transform;
+        if (i < m_rebuildCenters.size())
+            drift += length(vec3(bounds) + offset - m_rebuildCenters[i])/bounds.w; }
+    if (!m_objInst.empty())
+        drift /= float(m_objInst.size());
+    return drift;
+}
+
+// Records the frame's TLAS update into m_commandBuffer: after moving
+// instances with -motion, or after BLAS updates with -deform.  Changed
+// instances, from level of detail or residency changes, and new
+// instances force a rebuild.
+void VkApp::updateTopLevelAS(bool instancesChanged)
+{
+    float drift = m_instanceMotion ? moveInstances() : 0.0f;
+    bool rebuild = instancesChanged || m_rebuildCenters.size() != m_rtInstances
+        || drift > REFIT_DRIFT_LIMIT;
+
+    vkCmdResetQueryPool(m_commandBuffer, m_timestampPool, 2, 2);
+    vkCmdWriteTimestamp(m_commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, m_timestampPool, 2);
+    m_tlasRefit = m_rtBuilder.cmdBuildTlas(m_commandBuffer, tlasInstances(m_rtObjects, m_rtInstances),
+                                          tlasFlags(), !rebuild);
+    vkCmdWriteTimestamp(m_commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, m_timestampPool, 3);
+    m_tlasTimestampsWritten = true;
+
+    // The trace reads what the build wrote.
+    VkMemoryBarrier barrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+    barrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+    barrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
+    vkCmdPipelineBarrier(m_commandBuffer, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                         VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+                         0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+    // A rebuild may have replaced the TLAS; the descriptor set is not in
+    // use until this frame binds it below.
+    if (!m_tlasRefit) {
+        resetRefitDrift();
+        m_rtDesc.write(m_device, 0, m_rtBuilder.getAccelerationStructure()); }
+}
@@ -0,0 +1,81 @@
+//////////////////////////////////////////////////////////////////////
+// Persistent pipeline cache.
+//
+// Every pipeline is created through m_pipelineCache, which starts out
+// with what pipelinecache.bin held at the end of the last run, so a
+// warm start skips the driver's compilation of shaders it has seen,
+// the ray tracing pipeline's above all.  The data is only ever used on
+// the driver and device that wrote it: its header's vendor, device and
+// cache UUID must match this device's, or it is ignored, and the cache
+// starts empty.  The driver rejects stale data of its own the same way.
+// -nopipecache starts with an empty cache and saves nothing.
+////////////////////////////////////////////////////////////////////////
+
+#include <cstring>
+#include <filesystem>
+
+#include "vkapp.h"
+#include "fileio.h"
+
+static const char* PIPELINE_CACHE_PATH = "pipelinecache.bin";
+
+// Whether data, as read from PIPELINE_CACHE_PATH, was written for this
+// device's driver.
+static bool pipelineCacheMatches(const std::vector<char>& data, const VkPhysicalDeviceProperties& props)
+{
+    VkPipelineCacheHeaderVersionOne header;
+    if (data.size() < sizeof(header))
+        return false;
+    memcpy(&header, data.data(), sizeof(header));
+    return header.headerSize >= sizeof(header)
+        && header.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE
+        && header.vendorID == props.vendorID
+        && header.deviceID == props.deviceID
+        && memcmp(header.pipelineCacheUUID, props.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+}
+
+void VkApp::createPipelineCache()
+{
+    std::vector<char> data;
+    if (m_usePipelineCache && readFile(PIPELINE_CACHE_PATH, data)) {
+        VkPhysicalDeviceProperties props;
+        vkGetPhysicalDeviceProperties(m_physicalDevice, &props);
+        if (!pipelineCacheMatches(data, props)) {
+            printf("Pipeline cache: %s is for another driver or device; starting empty\n",
+                   PIPELINE_CACHE_PATH);
+            data.clear(); } }
+    m_pipelineCacheWarm = !data.empty();
+
+    VkPipelineCacheCreateInfo info{VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO};
+    info.initialDataSize = data.size();
+    info.pInitialData    = data.data();
+    if (vkCreatePipelineCache(m_device, &info, nullptr, &m_pipelineCache) != VK_SUCCESS) {
+        // Unusable data is the driver's to refuse; start over without it.
+        info.initialDataSize = 0;
+        info.pInitialData    = nullptr;
+        m_pipelineCacheWarm  = false;
+        vkCreatePipelineCache(m_device, &info, nullptr, &m_pipelineCache); }
+}
+
+// Writes the cache out, through a temporary file so an interrupted
+// write never leaves a truncated one, and destroys it.
+void VkApp::savePipelineCache()
+{
+    if (m_usePipelineCache) {
+        size_t size = 0;
+        vkGetPipelineCacheData(m_device, m_pipelineCache, &size, nullptr);
+        std::vector<char> data(size);
+        if (size > 0 && vkGetPipelineCacheData(m_device, m_pipelineCache, &size, data.data()) == VK_SUCCESS) {
+            std::string temp = tempPath(PIPELINE_CACHE_PATH);
+            std::error_code ec;
+            FILE* file = fopen(temp.c_str(), "wb");
+            bool ok = file && fwrite(data.data(), 1, size, file) == size;
+            ok = file && fclose(file) == 0 && ok;
+            if (ok)
+                std::filesystem::rename(temp, PIPELINE_CACHE_PATH, ec);
+            if (!ok || ec)
+                std::filesystem::remove(temp, ec);
+            else
+                printf("Pipeline cache: %zu bytes written\n", size); } }
+    vkDestroyPipelineCache(m_device, m_pipelineCache, nullptr);
+}
@@ -91,7 +91,12 @@ void VkApp::initRayTracing()
     handleAlignment = rtProps.shaderGroupHandleAlignment;
     baseAlignment   = rtProps.shaderGroupBaseAlignment;
     
-    m_rtBuilder.setup(this, m_device, m_graphicsQueueIndex);
+    m_rtBuilder.setup(this, m_device, m_graphicsQueueIndex, m_asQueue ? m_asQueue : m_queue);
+    m_rtBuilder.m_useCache = m_asCache;
+    m_rtBuilder.m_hostThreads = m_hostBuildThreads;
+
+    VkSemaphoreCreateInfo semCreateInfo{VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO};
+    vkCreateSemaphore(m_device, &semCreateInfo, nullptr, &m_asDoneSemaphore);
 
     // @@ Call  m_rtBuilder.destroy() after the acceleration building is done.
 }
@@ -161,10 +166,20 @@ void VkApp::createRtPipeline()
     group.generalShader      = VK_SHADER_UNUSED_KHR;
     group.intersectionShader = VK_SHADER_UNUSED_KHR;
 
+    // Specialization constants 0 (compactVertices) and 1 (triAttribs)
+    // select the vertex fetch path in raygen; 2 (rayCones) its texture LOD.
+    VkBool32 specData[3] = {m_compactVertices, m_triAttribs, m_rayCones};
+    VkSpecializationMapEntry specEntries[3] = {{0, 0, sizeof(VkBool32)},
+                                               {1, sizeof(VkBool32), sizeof(VkBool32)},
+                                               {2, 2*sizeof(VkBool32), sizeof(VkBool32)}};
+    VkSpecializationInfo specInfo{3, specEntries, sizeof(specData), specData};
+
     // Raygen shader stage and group appended to stages and groups lists
     stage.module = createShaderModule(loadFile("spv/raytrace.rgen.spv"));
     stage.stage = VK_SHADER_STAGE_RAYGEN_BIT_KHR;
+    stage.pSpecializationInfo = &specInfo;
     stages.push_back(stage);
+    stage.pSpecializationInfo = nullptr;
     
     group.type          = VK_RAY_TRACING_SHADER_GROUP_TYPE_GENERAL_KHR;
     group.generalShader = stages.size()-1;    // Index of raygen shader
@@ -191,13 +206,22 @@ void VkApp::createRtPipeline()
     groups.push_back(group);
     group.generalShader = VK_SHADER_UNUSED_KHR;
 
-    // Closest hit shader stage and group appended to stages and groups lists
+    // Closest hit and any-hit shader stages, and their group, appended to
+    // stages and groups lists.  Any-hit only runs for geometries built
+    // without VK_GEOMETRY_OPAQUE_BIT_KHR, the alpha-tested ones.
     stage.module = createShaderModule(loadFile("spv/raytrace.rchit.spv"));
     stage.stage = VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR;
     stages.push_back(stage);
+    group.closestHitShader = stages.size()-1;   // Index of hit shader
+
+    stage.module = createShaderModule(loadFile("spv/raytrace.rahit.spv"));
+    stage.stage = VK_SHADER_STAGE_ANY_HIT_BIT_KHR;
+    stage.pSpecializationInfo = &specInfo;
+    stages.push_back(stage);
+    stage.pSpecializationInfo = nullptr;
+    group.anyHitShader = stages.size()-1;
 
     group.type             = VK_RAY_TRACING_SHADER_GROUP_TYPE_TRIANGLES_HIT_GROUP_KHR;
-    group.closestHitShader = stages.size()-1;   // Index of hit shader
     groups.push_back(group);
 
     ////////////////////////////////////////////////////////////////////////////////////////////
@@ -234,7 +258,9 @@ void VkApp::createRtPipeline()
     rayPipelineInfo.maxPipelineRayRecursionDepth = 10;  // Ray depth
     rayPipelineInfo.layout                       = m_rtPipelineLayout;
 
-    vkCreateRayTracingPipelinesKHR(m_device, {}, {}, 1, &rayPipelineInfo, nullptr, &m_rtPipeline);
+    double start = glfwGetTime();
+    vkCreateRayTracingPipelinesKHR(m_device, {}, m_pipelineCache, 1, &rayPipelineInfo, nullptr, &m_rtPipeline);
+    m_pipelineSeconds += glfwGetTime() - start;
 
 
     for (auto& s : stages)
@@ -373,8 +399,12 @@ void VkApp::raytrace()
                        | VK_SHADER_STAGE_MISS_BIT_KHR,
                        0, sizeof(PushConstantRay), &m_pcRay);
 
+    vkCmdResetQueryPool(m_commandBuffer, m_timestampPool, 0, 2);
+    vkCmdWriteTimestamp(m_commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, m_timestampPool, 0);
     vkCmdTraceRaysKHR(m_commandBuffer, &m_rgenRegion, &m_missRegion, &m_hitRegion,
                       &m_callRegion, windowSize.width, windowSize.height, 1);
+    vkCmdWriteTimestamp(m_commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, m_timestampPool, 1);
+    m_timestampsWritten = true;
 
     CmdCopyImage(m_rtColCurrBuffer, m_scImageBuffer);
     CmdCopyImage(m_rtColCurrBuffer, m_rtColPrevBuffer);
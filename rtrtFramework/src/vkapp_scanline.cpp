@@ -5,9 +5,11 @@
 #include <cstring>              // for memcpy
 #include <vector>
 #include <array>
+#include <algorithm>
 #include <math.h>
 
 #include "vkapp.h"
+#include "fileio.h"
 
 #define GLM_FORCE_RADIANS
 #define GLM_SWIZZLE
@@ -97,54 +99,186 @@ void VkApp::imageLayoutBarrier(VkCommandBuffer cmdbuffer,
 
 ImageWrap VkApp::createTextureImage(std::string fileName)
 {
-	//VkImage& textureImage, VkDeviceMemory& textureImageMemory
-	int texWidth, texHeight, texChannels;
+	DecodedImage image = decodeImage(fileName);
+	return createTextureImage(image);
+}
+
+// Reads and decodes an image file to RGBA8, or with -bc to its block
+// compressed mip chain, from the texture cache if the file's contents
+// have been encoded before.  Touches no Vulkan state, so it may run on a
+// loader thread.
+DecodedImage VkApp::decodeImage(const std::string& fileName)
+{
+	int texChannels;
+	DecodedImage image;
+	MappedFile file;
+	if (!file.open(fileName) || file.size == 0) {
+		throw std::runtime_error("failed to load texture image!");
+	}
 
-	stbi_set_flip_vertically_on_load(true);
-	stbi_uc* pixels = stbi_load(fileName.c_str(), &texWidth, &texHeight, &texChannels,
-		STBI_rgb_alpha);
-	VkDeviceSize imageSize = texWidth * texHeight * 4;
+	std::string cachePath;
+	if (m_compressTextures) {
+		cachePath = textureCachePath(contentHash(file.data, file.size));
+		if (readTextureCache(cachePath, image.compressed)) {
+			image.width = int(image.compressed.width);
+			image.height = int(image.compressed.height);
+			return image;
+		}
+	}
 
-	if (!pixels) {
+	image.pixels = stbi_load_from_memory((const stbi_uc*)file.data, int(file.size),
+		&image.width, &image.height, &texChannels, STBI_rgb_alpha);
+	if (!image.pixels) {
 		throw std::runtime_error("failed to load texture image!");
 	}
 
-	BufferWrap staging = createBufferWrap(imageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+	if (m_compressTextures) {
+		buildImageMips(image);
+		if (!writeTextureCache(cachePath, image.compressed))
+			printf("Could not write texture cache %s\n", cachePath.c_str());
+	}
+	else if (m_textureBudget > 0)
+		buildImageMips(image);
+	return image;
+}
+
+// Replaces an image's pixels by their CPU-built mip chain, block
+// compressed with -bc.
+void VkApp::buildImageMips(DecodedImage& image)
+{
+	image.compressed = m_compressTextures
+		? compressTexture(image.pixels, image.width, image.height)
+		: buildMipChain(image.pixels, image.width, image.height);
+	stbi_image_free(image.pixels);
+	image.pixels = nullptr;
+}
+
+// Uploads a decoded image, builds its mip chain, and frees the pixels.
+ImageWrap VkApp::createTextureImage(DecodedImage& image)
+{
+	std::vector<DecodedImage> images{image};
+	std::vector<ImageWrap> result = createTextureImages(images);
+	image.pixels = nullptr;
+	return result[0];
+}
+
+// Uploads a batch of decoded images and frees their pixels.  All the
+// pixels share one staging buffer, and every layout transition, copy
+// and mip blit is recorded into one command buffer with one submit, so
+// a batch costs a single queue wait however many images it holds.
+// Images with CPU-built mip chains (block compressed, or streamed)
+// bring their own mips, copied level by level.
+std::vector<ImageWrap> VkApp::createTextureImages(std::vector<DecodedImage>& images)
+{
+	// Staging offsets of each image's levels: one for plain RGBA8 images,
+	// all of them for mip chains.
+	std::vector<std::vector<VkDeviceSize>> offsets(images.size());
+	VkDeviceSize stagingSize = 0;
+	auto reserve = [&](size_t i, VkDeviceSize bytes) {
+		offsets[i].push_back(stagingSize);
+		stagingSize += (bytes + 15) & ~VkDeviceSize(15);  // Keep every copy 16 byte aligned
+	};
+	for (size_t i = 0; i < images.size(); i++) {
+		if (images[i].pixels)
+			reserve(i, VkDeviceSize(images[i].width) * images[i].height * 4);
+		else
+			for (const auto& level : images[i].compressed.levels)
+				reserve(i, level.size());
+	}
+
+	BufferWrap staging = createBufferWrap(std::max<VkDeviceSize>(stagingSize, 16),
+		VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
 		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
 		| VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
 
-	void* data;
-	vkMapMemory(m_device, staging.memory, 0, imageSize, 0, &data);
-	memcpy(data, pixels, static_cast<size_t>(imageSize));
+	char* data;
+	vkMapMemory(m_device, staging.memory, 0, VK_WHOLE_SIZE, 0, (void**)&data);
+	for (size_t i = 0; i < images.size(); i++) {
+		if (images[i].pixels) {
+			memcpy(data + offsets[i][0], images[i].pixels, size_t(images[i].width) * images[i].height * 4);
+			stbi_image_free(images[i].pixels);
+			images[i].pixels = nullptr;
+		}
+		else {
+			auto& levels = images[i].compressed.levels;
+			for (size_t l = 0; l < levels.size(); l++)
+				memcpy(data + offsets[i][l], levels[l].data(), levels[l].size());
+		}
+	}
 	vkUnmapMemory(m_device, staging.memory);
 
-	stbi_image_free(pixels);
-
-	uint mipLevels = std::floor(std::log2(std::max(texWidth, texHeight))) + 1;
-
-	ImageWrap myImage = createImageWrap(texWidth, texHeight, VK_FORMAT_R8G8B8A8_UNORM,
-		VK_IMAGE_USAGE_TRANSFER_DST_BIT
-		| VK_IMAGE_USAGE_SAMPLED_BIT
-		| VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
-		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-		mipLevels);
+	VkCommandBuffer commandBuffer = createTempCmdBuffer();
 
-	transitionImageLayout(myImage.image, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_LAYOUT_UNDEFINED,
-		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, mipLevels);
-	copyBufferToImage(staging.buffer, myImage.image, static_cast<uint32_t>(texWidth),
-		static_cast<uint32_t>(texHeight));
+	std::vector<ImageWrap> result(images.size());
+	std::vector<VkFormat> formats(images.size());
+	std::vector<uint> mipCounts(images.size());
+	for (size_t i = 0; i < images.size(); i++) {
+		int texWidth = images[i].width;
+		int texHeight = images[i].height;
+		bool precomputed = !images[i].compressed.levels.empty();
+		formats[i] = precomputed ? VkFormat(images[i].compressed.vkFormat) : VK_FORMAT_R8G8B8A8_UNORM;
+		uint mipLevels = precomputed ? uint(offsets[i].size())
+			: uint(std::floor(std::log2(std::max(texWidth, texHeight)))) + 1;
+		mipCounts[i] = mipLevels;
+
+		if (formats[i] != VK_FORMAT_R8G8B8A8_UNORM) {
+			VkFormatProperties formatProperties;
+			vkGetPhysicalDeviceFormatProperties(m_physicalDevice, formats[i], &formatProperties);
+			if (!(formatProperties.optimalTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT)) {
+				throw std::runtime_error("device cannot sample BC textures; run without -bc");
+			}
+		}
+
+		// Also a transfer source: of the mip blits, or of texture
+		// streaming's copies into the image that replaces it.
+		VkImageUsageFlags usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT
+			| VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+		result[i] = createImageWrap(texWidth, texHeight, formats[i], usage,
+			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, mipLevels);
+
+		imageLayoutBarrier(commandBuffer, result[i].image,
+			VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+
+		std::vector<VkBufferImageCopy> regions(offsets[i].size());
+		uint32_t levelWidth = uint32_t(texWidth), levelHeight = uint32_t(texHeight);
+		for (size_t l = 0; l < regions.size(); l++) {
+			VkBufferImageCopy& region = regions[l];
+			region = {};
+			region.bufferOffset = offsets[i][l];
+			region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+			region.imageSubresource.mipLevel = uint32_t(l);
+			region.imageSubresource.baseArrayLayer = 0;
+			region.imageSubresource.layerCount = 1;
+			region.imageOffset = { 0, 0, 0 };
+			region.imageExtent = { levelWidth, levelHeight, 1 };
+			levelWidth = std::max(levelWidth / 2, 1u);
+			levelHeight = std::max(levelHeight / 2, 1u);
+		}
+		vkCmdCopyBufferToImage(commandBuffer, staging.buffer, result[i].image,
+			VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, uint32_t(regions.size()), regions.data());
+
+		if (precomputed)
+			imageLayoutBarrier(commandBuffer, result[i].image,
+				VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+		else
+			generateMipmaps(commandBuffer, result[i].image, formats[i], texWidth, texHeight, mipLevels);
+	}
 
+	submitTempCmdBuffer(commandBuffer);
 	staging.destroy(m_device);
 
-	generateMipmaps(myImage.image, VK_FORMAT_R8G8B8A8_UNORM, texWidth, texHeight, mipLevels);
-
-	myImage.imageView = createImageView(myImage.image, VK_FORMAT_R8G8B8A8_UNORM);
-	myImage.sampler = createTextureSampler();
-	myImage.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-	return myImage;
+	for (size_t i = 0; i < images.size(); i++) {
+		images[i].compressed.levels.clear();
+		result[i].imageView = createImageView(result[i].image, formats[i], VK_IMAGE_ASPECT_COLOR_BIT, mipCounts[i]);
+		result[i].sampler = createTextureSampler();
+		result[i].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	}
+	return result;
 }
 
-void VkApp::generateMipmaps(VkImage image, VkFormat imageFormat,
+// Records blits filling mips 1..mipLevels-1 from mip 0, which must be in
+// TRANSFER_DST layout, and leaves every mip in SHADER_READ_ONLY layout.
+void VkApp::generateMipmaps(VkCommandBuffer commandBuffer, VkImage image, VkFormat imageFormat,
 	int32_t texWidth, int32_t texHeight, uint32_t mipLevels)
 {
 	// Check if image format supports linear blitting
@@ -155,8 +289,6 @@ void VkApp::generateMipmaps(VkImage image, VkFormat imageFormat,
 		throw std::runtime_error("texture image format does not support linear blitting!");
 	}
 
-	VkCommandBuffer commandBuffer = createTempCmdBuffer();
-
 	VkImageMemoryBarrier barrier{ VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER };
 	barrier.image = image;
 	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
@@ -228,8 +360,6 @@ void VkApp::generateMipmaps(VkImage image, VkFormat imageFormat,
 		0, nullptr,
 		0, nullptr,
 		1, &barrier);
-
-	submitTempCmdBuffer(commandBuffer);
 }
 
 BufferWrap VkApp::createStagedBufferWrap(const VkCommandBuffer& cmdBuf,
@@ -256,6 +386,41 @@ BufferWrap VkApp::createStagedBufferWrap(const VkCommandBuffer& cmdBuf,
 	return bw;
 }
 
+// Writes bytes offset to size of data, a buffer's whole contents, into
+// bw in place.  Once the contents outgrow capacity, bw is instead
+// replaced by a buffer of twice their size, written whole, and true is
+// returned.  The caller must ensure no submitted work still reads bw.
+bool VkApp::updateStagedBufferWrap(BufferWrap& bw, VkDeviceSize& capacity,
+	const void* data, VkDeviceSize size, VkDeviceSize offset,
+	VkBufferUsageFlags usage)
+{
+	bool replaced = size > capacity;
+	if (replaced) {
+		bw.destroy(m_device);
+		capacity = 2*size;
+		bw = createBufferWrap(capacity, VK_BUFFER_USAGE_TRANSFER_DST_BIT | usage,
+			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+		offset = 0;
+	}
+	if (offset >= size)
+		return replaced;
+
+	BufferWrap staging = createBufferWrap(size - offset, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+		| VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+	void* dest;
+	vkMapMemory(m_device, staging.memory, 0, size - offset, 0, &dest);
+	memcpy(dest, (const char*)data + offset, size - offset);
+	vkUnmapMemory(m_device, staging.memory);
+
+	VkCommandBuffer cmdBuf = createTempCmdBuffer();
+	VkBufferCopy region{ 0, offset, size - offset };
+	vkCmdCopyBuffer(cmdBuf, staging.buffer, bw.buffer, 1, &region);
+	submitTempCmdBuffer(cmdBuf);
+	staging.destroy(m_device);
+	return replaced;
+}
+
 BufferWrap VkApp::createBufferWrap(VkDeviceSize size, VkBufferUsageFlags usage,
 	VkMemoryPropertyFlags properties)
 {
@@ -369,6 +534,7 @@ VkSampler VkApp::createTextureSampler()
 	samplerInfo.compareEnable = VK_FALSE;
 	samplerInfo.compareOp = VK_COMPARE_OP_ALWAYS;
 	samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
+	samplerInfo.maxLod = VK_LOD_CLAMP_NONE;  // Every level the view holds
 
 	VkSampler textureSampler;
 	if (vkCreateSampler(m_device, &samplerInfo, nullptr, &textureSampler) != VK_SUCCESS) {
@@ -501,7 +667,9 @@ void VkApp::createScanlineRenderPass()
 
 void VkApp::createScDescriptorSet()
 {
-	auto nbTxt = static_cast<uint32_t>(m_objText.size());
+	// Sized for the whole scene up front since textures stream in after
+	// this set is created; every slot starts out as the fallback texture.
+	auto nbTxt = MAX_TEXTURES;
 
 	m_scDesc.setBindings(m_device, {
 	 {ScBindings::eMatrices, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1,
@@ -511,18 +679,30 @@ void VkApp::createScDescriptorSet()
 	 {ScBindings::eObjDescs, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1,
 	 VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT
 	 | VK_SHADER_STAGE_RAYGEN_BIT_KHR
-	 | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR},
+	 | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR
+	 | VK_SHADER_STAGE_ANY_HIT_BIT_KHR},
 	 {ScBindings::eTextures, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
 	 nbTxt,
 	 VK_SHADER_STAGE_FRAGMENT_BIT
 	 | VK_SHADER_STAGE_RAYGEN_BIT_KHR
-	 | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR}
+	 | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR
+	 | VK_SHADER_STAGE_ANY_HIT_BIT_KHR},
+	 {ScBindings::eInstances, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1,
+	 VK_SHADER_STAGE_VERTEX_BIT},
+	 {ScBindings::eTexFeedback, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1,
+	 VK_SHADER_STAGE_FRAGMENT_BIT
+	 | VK_SHADER_STAGE_RAYGEN_BIT_KHR},
+	 {ScBindings::eObjHits, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1,
+	 VK_SHADER_STAGE_RAYGEN_BIT_KHR}
 	});
 
 
 	m_scDesc.write(m_device, ScBindings::eMatrices, m_matrixBW.buffer);
 	m_scDesc.write(m_device, ScBindings::eObjDescs, m_objDescriptionBW.buffer);
-	m_scDesc.write(m_device, ScBindings::eTextures, m_objText);
+	m_scDesc.write(m_device, ScBindings::eTextures, std::vector<ImageWrap>(nbTxt, m_fallbackText));
+	m_scDesc.write(m_device, ScBindings::eInstances, m_instanceBW.buffer);
+	m_scDesc.write(m_device, ScBindings::eTexFeedback, m_texFeedbackBW.buffer);
+	m_scDesc.write(m_device, ScBindings::eObjHits, m_objHitsBW.buffer);
 
 	//Done
 	// @@ Destroy with m_scDesc.destroy(m_device);
@@ -545,11 +725,17 @@ void VkApp::createScPipeline()
 	VkShaderModule vertShaderModule = createShaderModule(loadFile("spv/scanline.vert.spv"));
 	VkShaderModule fragShaderModule = createShaderModule(loadFile("spv/scanline.frag.spv"));
 
+	// Specialization constant 0 (compactVertices) selects the vertex decode path.
+	VkBool32 compact = m_compactVertices;
+	VkSpecializationMapEntry specEntry{ 0, 0, sizeof(VkBool32) };
+	VkSpecializationInfo specInfo{ 1, &specEntry, sizeof(VkBool32), &compact };
+
 	VkPipelineShaderStageCreateInfo vertShaderStageInfo{};
 	vertShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
 	vertShaderStageInfo.stage = VK_SHADER_STAGE_VERTEX_BIT;
 	vertShaderStageInfo.module = vertShaderModule;
 	vertShaderStageInfo.pName = "main";
+	vertShaderStageInfo.pSpecializationInfo = &specInfo;
 
 	VkPipelineShaderStageCreateInfo fragShaderStageInfo{};
 	fragShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
@@ -562,16 +748,28 @@ void VkApp::createScPipeline()
 	VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
 	vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
 
-	VkVertexInputBindingDescription bindingDescription
-	{ 0, sizeof(Vertex), VK_VERTEX_INPUT_RATE_VERTEX };
+	std::vector<VkVertexInputBindingDescription> bindingDescriptions{
+		{ 0, sizeof(Vertex), VK_VERTEX_INPUT_RATE_VERTEX } };
 
 	std::vector<VkVertexInputAttributeDescription> attributeDescriptions{
 		{0, 0, VK_FORMAT_R32G32B32_SFLOAT, static_cast<uint32_t>(offsetof(Vertex, pos))},
 		{1, 0, VK_FORMAT_R32G32B32_SFLOAT, static_cast<uint32_t>(offsetof(Vertex, nrm))},
 		{2, 0, VK_FORMAT_R32G32_SFLOAT, static_cast<uint32_t>(offsetof(Vertex, texCoord))} };
 
-	vertexInputInfo.vertexBindingDescriptionCount = 1;
-	vertexInputInfo.pVertexBindingDescriptions = &bindingDescription;
+	if (m_compactVertices) {
+		// Binding 0: vec3 position stream; binding 1: VertexAttrib stream.
+		// The octahedral normal arrives as a snorm pair and is decoded in the shader.
+		bindingDescriptions = {
+			{ 0, sizeof(glm::vec3), VK_VERTEX_INPUT_RATE_VERTEX },
+			{ 1, sizeof(VertexAttrib), VK_VERTEX_INPUT_RATE_VERTEX } };
+		attributeDescriptions = {
+			{0, 0, VK_FORMAT_R32G32B32_SFLOAT, 0},
+			{1, 1, VK_FORMAT_R16G16_SNORM, static_cast<uint32_t>(offsetof(VertexAttrib, nrm))},
+			{2, 1, VK_FORMAT_R16G16_SFLOAT, static_cast<uint32_t>(offsetof(VertexAttrib, texCoord))} };
+	}
+
+	vertexInputInfo.vertexBindingDescriptionCount = bindingDescriptions.size();
+	vertexInputInfo.pVertexBindingDescriptions = bindingDescriptions.data();
 
 	vertexInputInfo.vertexAttributeDescriptionCount = attributeDescriptions.size();
 	vertexInputInfo.pVertexAttributeDescriptions = attributeDescriptions.data();
@@ -654,9 +852,11 @@ void VkApp::createScPipeline()
 	pipelineInfo.subpass = 0;
 	pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
 
-	if (vkCreateGraphicsPipelines(m_device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &m_scanlinePipeline) != VK_SUCCESS) {
+	double start = glfwGetTime();
+	if (vkCreateGraphicsPipelines(m_device, m_pipelineCache, 1, &pipelineInfo, nullptr, &m_scanlinePipeline) != VK_SUCCESS) {
 		throw std::runtime_error("failed to create scanline pipeline!");
 	}
+	m_pipelineSeconds += glfwGetTime() - start;
 
 	// Done with the temporary spv shader modules.
 	vkDestroyShaderModule(m_device, fragShaderModule, nullptr);
@@ -684,12 +884,16 @@ void VkApp::createMatrixBuffer()
 // Create a Vulkan buffer containing pointers to all object buffers
 // (vertex, triangle indices, materials, and material indices. Will be
 // included in a descriptor set for use in shaders.
-void VkApp::createObjDescriptionBuffer()
+// Writes m_objDesc, from entry first on, into m_objDescriptionBW; called
+// again as objects are added, restored or removed.  A zeroed entry
+// stands in while the scene is empty.
+bool VkApp::createObjDescriptionBuffer(uint32_t first)
 {
-	VkCommandBuffer cmdBuf = createTempCmdBuffer();
-	m_objDescriptionBW = createStagedBufferWrap(cmdBuf, m_objDesc,
-		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
-	submitTempCmdBuffer(cmdBuf);
+	ObjDesc empty{};
+	const ObjDesc* descs = m_objDesc.empty() ? &empty : m_objDesc.data();
+	VkDeviceSize count = std::max<size_t>(m_objDesc.size(), 1);
+	return updateStagedBufferWrap(m_objDescriptionBW, m_objDescCapacity, descs,
+		count*sizeof(ObjDesc), first*sizeof(ObjDesc), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
 
 	//Done
 	// @@ Destroy with m_objDescriptionBW.destroy(m_device);
@@ -715,27 +919,47 @@ void VkApp::rasterize()
 	vkCmdBindDescriptorSets(m_commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
 		m_scanlinePipelineLayout, 0, 1, &m_scDesc.descSet, 0, nullptr);
 
-	for (const ObjInst& inst : m_objInst) {
-		auto& object = m_objData[inst.objIndex];
-
-		// Information pushed at each draw call
-		PushConstantRaster pcRaster{
-			inst.transform,      // Object's instance transform.
-			{0.5f, 2.5f, 3.0f},  // light position;  Should not be hard-coded here!
-			inst.objIndex,       // instance Id
-			2.5f                 // light intensity;  Should not be hard-coded here!
-		};
-
-		pcRaster.objIndex = inst.objIndex;  // Telling which object is drawn
-		pcRaster.modelMatrix = inst.transform;
-
-		vkCmdPushConstants(m_commandBuffer, m_scanlinePipelineLayout,
-			VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, 0,
-			sizeof(PushConstantRaster), &pcRaster);
-		vkCmdBindVertexBuffers(m_commandBuffer, 0, 1, &object.vertexBuffer.buffer, &offset);
-		vkCmdBindIndexBuffer(m_commandBuffer, object.indexBuffer.buffer, 0,
-			VK_INDEX_TYPE_UINT32);
-		vkCmdDrawIndexed(m_commandBuffer, object.nbIndices, 1, 0, 0, 0);
+	// One instanced draw per material range of each run of instances
+	// sharing an object and LOD; the vertex shader fetches each
+	// instance's transform by gl_InstanceIndex.
+	for (const InstanceRun& run : m_instanceRuns) {
+		uint32_t end = run.firstInstance + run.instanceCount;
+		for (uint32_t first = run.firstInstance; first < end; ) {
+			uint32_t lod = m_objInst[first].lod;
+			uint32_t last = first + 1;
+			while (last < end && m_objInst[last].lod == lod)
+				last++;
+
+			uint32_t objIndex = lodObject(run.objIndex, lod);
+			auto& object = m_objData[objIndex];
+
+			vkCmdBindVertexBuffers(m_commandBuffer, 0, 1, &object.vertexBuffer.buffer, &offset);
+			if (m_compactVertices)
+				vkCmdBindVertexBuffers(m_commandBuffer, 1, 1, &object.attribBuffer.buffer, &offset);
+			vkCmdBindIndexBuffer(m_commandBuffer, object.indexBuffer.buffer, 0,
+				object.indexType);
+
+			for (size_t g = 0; g + 1 < object.firstTriangle.size(); g++) {
+				// Information pushed at each draw call
+				PushConstantRaster pcRaster{
+					{0.5f, 2.5f, 3.0f},  // light position;  Should not be hard-coded here!
+					objIndex,            // instance Id
+					2.5f,                // light intensity;  Should not be hard-coded here!
+					0,                   // light type
+					int(g),              // material range
+					int(g < object.alphaTested.size() && object.alphaTested[g])  // alpha test
+				};
+
+				vkCmdPushConstants(m_commandBuffer, m_scanlinePipelineLayout,
+					VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, 0,
+					sizeof(PushConstantRaster), &pcRaster);
+				uint32_t firstTri = object.firstTriangle[g];
+				uint32_t nbTris = object.firstTriangle[g + 1] - firstTri;
+				vkCmdDrawIndexed(m_commandBuffer, 3 * nbTris, last - first, 3 * firstTri, 0,
+					first);
+			}
+			first = last;
+		}
 	}
 
 	vkCmdEndRenderPass(m_commandBuffer);
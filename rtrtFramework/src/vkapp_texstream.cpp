@@ -0,0 +1,272 @@
+//////////////////////////////////////////////////////////////////////
+// Texture streaming.
+//
+// With -texbudget MB, each texture is kept in host memory as a full mip
+// chain, and only part of that chain is resident on the GPU.  At first
+// that is just the mip tail: the levels of at most TAIL_SIZE texels on
+// a side.  The rasterizer and the ray tracer's hits record, per
+// texture slot, the width of the finest level they would sample
+// (ScBindings::eTexFeedback).  Each frame updateTextureStreaming folds
+// that into a last-used frame per level.  It streams in one finer level
+// per frame for textures that want more detail, and evicts levels
+// unused for EVICT_FRAMES frames.  When the budget is full, it evicts
+// the least recently used levels of other textures.
+//
+// A residency change replaces the texture's image with one holding the
+// levels from the new finest level down.  Only a newly resident level
+// comes from the host copy; the others are copied from the old image
+// on the GPU.  Both are recorded into the frame's command buffer ahead
+// of the draws and the trace, so nothing waits, and the old image is
+// destroyed a frame later.  So level 0 of a texture's image is always
+// its finest resident level, and the shaders need not know what is
+// resident.
+////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <cstring>
+
+#include "vkapp.h"
+#include "app.h"
+
+static const uint32_t TAIL_SIZE = 64;
+static const uint64_t EVICT_FRAMES = 120;
+static const size_t   STREAM_BYTES_PER_FRAME = 32 << 20;
+
+// Host visible and persistently mapped: the host reads and clears it
+// between frames, after the fence wait.
+void VkApp::createTextureFeedbackBuffer()
+{
+    VkDeviceSize size = MAX_TEXTURES*sizeof(uint32_t);
+    m_texFeedbackBW = createBufferWrap(size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+        | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    vkMapMemory(m_device, m_texFeedbackBW.memory, 0, size, 0, (void**)&m_texFeedback);
+    memset(m_texFeedback, 0, size);
+}
+
+// Takes over a freshly loaded texture's mip chain, and returns the
+// upload of its mip tail.
+DecodedImage VkApp::startStreaming(DecodedImage& image)
+{
+    if (image.slot >= m_streamed.size())
+        m_streamed.resize(image.slot + 1);
+    StreamedTexture& t = m_streamed[image.slot];
+    t.source = std::move(image.compressed);
+
+    uint32_t levels = uint32_t(t.source.levels.size());
+    t.tailMip = 0;
+    while (t.tailMip + 1 < levels
+        && std::max(t.source.width >> t.tailMip, t.source.height >> t.tailMip) > TAIL_SIZE)
+        t.tailMip++;
+    t.lastUse.assign(levels, 0);
+    t.residentMip = t.tailMip;
+
+    DecodedImage upload = streamedUpload(image.slot, t.tailMip);
+    t.residentBytes = upload.compressed.bytes();
+    m_streamedBytes += t.residentBytes;
+    return upload;
+}
+
+// An image of slot's levels from firstMip down, ready for createTextureImages.
+DecodedImage VkApp::streamedUpload(uint32_t slot, uint32_t firstMip)
+{
+    const CompressedTexture& source = m_streamed[slot].source;
+    DecodedImage upload;
+    upload.slot = slot;
+    upload.width = int(std::max(source.width >> firstMip, 1u));
+    upload.height = int(std::max(source.height >> firstMip, 1u));
+    upload.compressed.vkFormat = source.vkFormat;
+    upload.compressed.width = uint32_t(upload.width);
+    upload.compressed.height = uint32_t(upload.height);
+    upload.compressed.levels.assign(source.levels.begin() + firstMip, source.levels.end());
+    return upload;
+}
+
+// Called while recording m_commandBuffer, before anything binds the
+// texture descriptors.
+void VkApp::updateTextureStreaming()
+{
+    releaseRetiredTextures();
+    if (m_textureBudget == 0)
+        return;
+    uint64_t frame = ++m_streamFrame;
+
+    // Fold in the widths requested by the frame just finished: the
+    // coarsest level at least that wide, and every coarser one, are in use.
+    for (uint32_t slot = 0; slot < m_streamed.size(); slot++) {
+        StreamedTexture& t = m_streamed[slot];
+        uint32_t width = m_texFeedback[slot];
+        m_texFeedback[slot] = 0;
+        if (t.source.levels.empty() || width == 0)
+            continue;
+        uint32_t mip = 0;
+        while (mip < t.tailMip && (t.source.width >> (mip + 1)) >= width)
+            mip++;
+        for (uint32_t l = mip; l < t.lastUse.size(); l++)
+            t.lastUse[l] = frame;
+    }
+
+    auto recent = [&](uint64_t use) { return use != 0 && frame - use < EVICT_FRAMES; };
+    auto levelBytes = [&](const StreamedTexture& t, uint32_t l) {
+        return mipLevelBytes(t.source.vkFormat, t.source.width, t.source.height, l); };
+
+    // Each texture's wanted level is the finest used recently.  Levels
+    // finer than that are evicted now; textures wanting finer levels
+    // than they hold are candidates for streaming in.
+    std::vector<uint32_t> newMip(m_streamed.size());
+    std::vector<uint32_t> wanting;
+    size_t total = m_streamedBytes;
+    for (uint32_t slot = 0; slot < m_streamed.size(); slot++) {
+        StreamedTexture& t = m_streamed[slot];
+        newMip[slot] = t.residentMip;
+        if (t.source.levels.empty())
+            continue;
+        uint32_t wanted = 0;
+        while (wanted < t.tailMip && !recent(t.lastUse[wanted]))
+            wanted++;
+        for (; newMip[slot] < wanted; newMip[slot]++)
+            total -= levelBytes(t, newMip[slot]);
+        if (wanted < newMip[slot])
+            wanting.push_back(slot);
+    }
+
+    // Most recently requested first; one level finer per texture per
+    // frame, so detail arrives coarse to fine and uploads stay small.
+    std::sort(wanting.begin(), wanting.end(), [&](uint32_t a, uint32_t b) {
+        return m_streamed[a].lastUse[newMip[a] - 1] > m_streamed[b].lastUse[newMip[b] - 1]; });
+    size_t uploadBytes = 0;
+    for (uint32_t slot : wanting) {
+        StreamedTexture& t = m_streamed[slot];
+        size_t bytes = levelBytes(t, newMip[slot] - 1);
+        if (uploadBytes + bytes > STREAM_BYTES_PER_FRAME)
+            break;
+
+        // Over budget: drop the finest level of whichever other texture
+        // used its finest level longest ago, but never one used this
+        // frame.  The victims are only taken if that makes room.
+        std::vector<uint32_t> taken;
+        size_t freed = 0;
+        while (total - freed + bytes > m_textureBudget) {
+            int victim = -1;
+            for (uint32_t v = 0; v < m_streamed.size(); v++) {
+                const StreamedTexture& vt = m_streamed[v];
+                if (v == slot || vt.source.levels.empty() || newMip[v] >= vt.tailMip
+                    || vt.lastUse[newMip[v]] == frame)
+                    continue;
+                if (victim < 0 || vt.lastUse[newMip[v]] < m_streamed[victim].lastUse[newMip[victim]])
+                    victim = int(v);
+            }
+            if (victim < 0)
+                break;
+            freed += levelBytes(m_streamed[victim], newMip[victim]);
+            newMip[victim]++;
+            taken.push_back(uint32_t(victim));
+        }
+        if (total - freed + bytes > m_textureBudget) {
+            for (uint32_t v : taken)
+                newMip[v]--;
+            continue;
+        }
+
+        newMip[slot]--;
+        total += bytes - freed;
+        uploadBytes += bytes;
+    }
+
+    // Replace the image of every texture whose residency changed.
+    for (uint32_t slot = 0; slot < m_streamed.size(); slot++)
+        if (newMip[slot] != m_streamed[slot].residentMip)
+            replaceStreamedImage(slot, newMip[slot]);
+}
+
+// Records into m_commandBuffer the filling of a new image for slot,
+// holding its levels from firstMip down, and puts it in the old one's
+// place.  Levels new to the GPU are copied from a staging buffer, the
+// rest from the old image.  The copies are ordered before this frame's
+// draws and trace, so the descriptor may point at the new image at
+// once; the old one is destroyed next frame.
+void VkApp::replaceStreamedImage(uint32_t slot, uint32_t firstMip)
+{
+    StreamedTexture& t = m_streamed[slot];
+    const CompressedTexture& source = t.source;
+    uint32_t levels = uint32_t(source.levels.size()) - firstMip;
+    VkFormat format = VkFormat(source.vkFormat);
+    auto extent = [&](uint32_t mip) {
+        return VkExtent3D{std::max(source.width >> mip, 1u), std::max(source.height >> mip, 1u), 1}; };
+
+    ImageWrap image = createImageWrap(extent(firstMip).width, extent(firstMip).height, format,
+        VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, levels);
+    ImageWrap old = m_objText[slot];
+    imageLayoutBarrier(m_commandBuffer, image.image,
+        VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+    imageLayoutBarrier(m_commandBuffer, old.image,
+        VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+
+    std::vector<VkBufferImageCopy> uploads;
+    if (firstMip < t.residentMip) {
+        VkDeviceSize size = 0;
+        for (uint32_t m = firstMip; m < t.residentMip; m++)
+            size += (source.levels[m].size() + 15) & ~size_t(15);  // Keep every copy 16 byte aligned
+        BufferWrap staging = createBufferWrap(size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+            | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+        char* data;
+        vkMapMemory(m_device, staging.memory, 0, VK_WHOLE_SIZE, 0, (void**)&data);
+        VkDeviceSize offset = 0;
+        for (uint32_t m = firstMip; m < t.residentMip; m++) {
+            memcpy(data + offset, source.levels[m].data(), source.levels[m].size());
+            VkBufferImageCopy region{};
+            region.bufferOffset = offset;
+            region.imageSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, m - firstMip, 0, 1};
+            region.imageExtent = extent(m);
+            uploads.push_back(region);
+            offset += (source.levels[m].size() + 15) & ~size_t(15);
+        }
+        vkUnmapMemory(m_device, staging.memory);
+        vkCmdCopyBufferToImage(m_commandBuffer, staging.buffer, image.image,
+            VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, uint32_t(uploads.size()), uploads.data());
+        m_retiredStaging.push_back(staging);
+    }
+
+    std::vector<VkImageCopy> copies;
+    for (uint32_t m = std::max(firstMip, t.residentMip); m < source.levels.size(); m++) {
+        VkImageCopy region{};
+        region.srcSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, m - t.residentMip, 0, 1};
+        region.dstSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, m - firstMip, 0, 1};
+        region.extent = extent(m);
+        copies.push_back(region);
+    }
+    vkCmdCopyImage(m_commandBuffer, old.image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+        image.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, uint32_t(copies.size()), copies.data());
+    imageLayoutBarrier(m_commandBuffer, image.image,
+        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+
+    image.imageView = createImageView(image.image, format, VK_IMAGE_ASPECT_COLOR_BIT, levels);
+    image.sampler = createTextureSampler();
+    image.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    m_retiredTextures.push_back(old);
+    m_objText[slot] = image;
+    m_scDesc.write(m_device, ScBindings::eTextures, m_objText[slot].Descriptor(), slot);
+
+    size_t bytes = 0;
+    for (uint32_t m = firstMip; m < source.levels.size(); m++)
+        bytes += source.levels[m].size();
+    m_streamedBytes += bytes;
+    m_streamedBytes -= t.residentBytes;
+    t.residentBytes = bytes;
+    t.residentMip = firstMip;
+}
+
+// Destroys what replaceStreamedImage left behind: the previous frame's
+// fence has been waited on and it was the only one in flight, so its
+// copies are done and nothing samples the replaced images.
+void VkApp::releaseRetiredTextures()
+{
+    for (ImageWrap& image : m_retiredTextures)
+        image.destroy(m_device);
+    for (BufferWrap& staging : m_retiredStaging)
+        staging.destroy(m_device);
+    m_retiredTextures.clear();
+    m_retiredStaging.clear();
+}